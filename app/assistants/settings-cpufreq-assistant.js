@@ -193,7 +193,7 @@ SettingsCpufreqAssistant.prototype.governorChange = function(event)
 	//alert(event.value);
 	this.governorModel.value = event.value;
 	if (this.setRequest) this.setRequest.cancel();
-	this.setRequest = service.set_cpufreq_params(this.onSetParams, [{name:'scaling_governor', value:this.governorModel.value}], [], [], (Mojo.Environment.DeviceInfo.modelNameAscii.indexOf("TouchPad") == 0) ? 1 : 0);
+	this.setRequest = service.set_cpufreq_params(this.onSetParams, [{name:'scaling_governor', value:this.governorModel.value}], [], []);
 };
 
 SettingsCpufreqAssistant.prototype.onSetParams = function(payload)
@@ -884,8 +884,7 @@ SettingsCpufreqAssistant.prototype.saveButtonPressed = function(event)
 	this.setRequest = service.set_cpufreq_params(this.saveCompleteCpufreq,
 												 standardParams,
 												 specificParams,
-												 overrideParams,
-												 (Mojo.Environment.DeviceInfo.modelNameAscii.indexOf("TouchPad") == 0) ? 1 : 0);
+												 overrideParams);
 };
 
 SettingsCpufreqAssistant.prototype.saveCompleteCpufreq = function(payload)
@@ -72,6 +72,10 @@ function dataHandlerModel()
 	
 	this.lineData = $H();
 	this.barData = {};
+	this.stateFreqs = [];
+	this.stateTimes = [];
+	this.stateCursor = 0;
+	this.historyLoaded = false;
 	
 	this.timer = false;
 	this.rate = parseInt(prefs.get().cardPollSpeed) * 1000;
@@ -143,9 +147,62 @@ dataHandlerModel.prototype.setupModels = function()
 
 dataHandlerModel.prototype.start = function()
 {
+	if (!this.historyLoaded)
+	{
+		this.loadHistory();
+	}
 	this.timerHandler();
 };
 
+// Fill in the graphs from the history the service kept while the card was closed.
+dataHandlerModel.prototype.loadHistory = function()
+{
+	this.historyLoaded = true;
+	
+	var step = this.rate / 1000;
+	var to = Math.round(new Date().getTime()/1000.0);
+	var from = to - (this.cutoff * step);
+	var metrics = ['freq1', 'temp', 'curr', 'load', 'mem'];
+	if (Mojo.Environment.DeviceInfo.modelNameAscii.indexOf("TouchPad") == 0) {
+		metrics.push('freq2');
+	}
+	for (var m = 0; m < metrics.length; m++)
+	{
+		service.get_history(this.historyHandler.bindAsEventListener(this, metrics[m]), metrics[m], from, to, step);
+	}
+};
+dataHandlerModel.prototype.historyHandler = function(payload, metric)
+{
+	if (payload.returnValue) 
+	{
+		for (var p = 0; p < payload.time.length; p++)
+		{
+			var dataObj = this.lineData.get(payload.time[p]);
+			if (!dataObj) dataObj = {};
+			if (!dataObj[metric])
+			{
+				var value = payload.mean[p];
+				var count = payload.count[p];
+				if (metric == 'load')
+				{
+					// Only the one minute average is kept in the history.
+					dataObj.load = {total1:  value * count, count1:  count, value1:  value,
+									total5:  0,             count5:  0,     value5:  0,
+									total15: 0,             count15: 0,     value15: 0};
+				}
+				else
+				{
+					dataObj[metric] = {total: value * count, count: count, value: value};
+				}
+			}
+			this.lineData.set(payload.time[p], dataObj);
+		}
+	}
+
+	this.renderMiniLine(metric);
+	this.renderFullGraph(metric);
+};
+
 dataHandlerModel.prototype.setMainAssistant = function(assistant)
 {
 	this.mainAssistant = assistant;
@@ -594,8 +651,8 @@ dataHandlerModel.prototype.timerFunction = function()
 			this.currReq  = service.get_battery_current(this.currHandler);
 		}
 		this.loadReq  = service.get_proc_loadavg(this.loadHandler);
-		this.memReq   = service.get_proc_meminfo(this.memHandler);
-		this.stateReq = service.get_time_in_state(this.stateHandler, 0);
+		this.memReq   = service.get_memory_stats(this.memHandler, ['MemTotal', 'MemFree', 'SwapTotal', 'SwapFree']);
+		this.stateReq = service.get_cpufreq_stats(this.stateHandler, 0, this.stateCursor);
 	}
 	
 	this.delayedTimer(this.rate);
@@ -763,25 +820,10 @@ dataHandlerModel.prototype.memHandler = function(payload)
 	if (payload.returnValue) 
 	{
 		var timestamp = Math.round(new Date().getTime()/1000.0);
-		var MemTotal = 0;
-		var MemFree = 0;
-		var SwapTotal = 0;
-		var SwapFree = 0;
-		for (var line = 0; line < payload.stdOut.length; line++) {
-			var items = payload.stdOut[line].split(":");
-			if (items[0] == "MemTotal") {
-				MemTotal = parseInt(items[1]);
-			}
-			else if (items[0] == "MemFree") {
-				MemFree = parseInt(items[1]);
-			}
-			else if (items[0] == "SwapTotal") {
-				SwapTotal = parseInt(items[1]);
-			}
-			else if (items[0] == "SwapFree") {
-				SwapFree = parseInt(items[1]);
-			}
-		}
+		var MemTotal = payload.MemTotal || 0;
+		var MemFree = payload.MemFree || 0;
+		var SwapTotal = payload.SwapTotal || 0;
+		var SwapFree = payload.SwapFree || 0;
 		var value = MemTotal - MemFree + SwapTotal - SwapFree;
 		
 		if (this.mainAssistant && this.mainAssistant.controller && this.mainAssistant.isVisible)
@@ -815,31 +857,37 @@ dataHandlerModel.prototype.stateHandler = function(payload)
 {
 	if (payload.returnValue) 
 	{
-		var dataHash = $H();
-		var valueArray = String(payload.stdOut).split(',');
-		for (var v = 0; v < valueArray.length; v++)
+		// A full reply has the frequency list, and later ones only what changed.
+		if (payload.freqs)
+		{
+			this.stateFreqs = payload.freqs;
+			this.stateTimes = payload.time;
+		}
+		else
 		{
-			if (valueArray[v])
+			for (var d = 0; d < payload.time.length; d++)
 			{
-				var dataArray = valueArray[v].split(' ');
-				dataHash.set(parseInt(dataArray[0]), parseInt(dataArray[1]));
+				this.stateTimes[payload.time[d][0]] += payload.time[d][1];
 			}
 		}
+		this.stateCursor = payload.cursor;
+		
+		var dataHash = $H();
+		for (var v = 0; v < this.stateFreqs.length; v++)
+		{
+			dataHash.set(this.stateFreqs[v], this.stateTimes[v]);
+		}
 		if (this.scalingFrequencyChoices.length == 0)
 		{
-			for (var v = 0; v < valueArray.length; v++)
+			for (var v = 0; v < this.stateFreqs.length; v++)
 			{
-				if (valueArray[v])
+				if ((this.stateFreqs[v] / 1000) >= 1000)
 				{
-					var dataArray = valueArray[v].split(' ');
-					if ((parseInt(dataArray[0]) / 1000) >= 1000)
-					{
-						this.scalingFrequencyChoices.push({label:((parseInt(dataArray[0])/1000)/1000) + ' GHz', value:parseInt(dataArray[0])});
-					}
-					else
-					{
-						this.scalingFrequencyChoices.push({label:(parseInt(dataArray[0])/1000) + ' MHz', value:parseInt(dataArray[0])});
-					}
+					this.scalingFrequencyChoices.push({label:((this.stateFreqs[v]/1000)/1000) + ' GHz', value:this.stateFreqs[v]});
+				}
+				else
+				{
+					this.scalingFrequencyChoices.push({label:(this.stateFreqs[v]/1000) + ' MHz', value:this.stateFreqs[v]});
 				}
 			}
 		}
@@ -633,14 +633,18 @@ function profileModel(params)
 };
 profileModel.prototype.apply = function()
 {
+	var applyParams     = [];
 	var standardParams  = [];
 	var specificParams  = [];
 	var overrideParams  = [];
 	var compcacheConfig = [];
 
+	applyParams.push({name:'scaling_governor', value:this.governor});
 	standardParams.push({name:'scaling_governor', value:this.governor});
 	
 	for (var s = 0; s < this.settingsStandard.length; s++) {
+		// The service orders the frequency limits itself, but the boot script does not.
+		applyParams.push(this.settingsStandard[s]);
 		if ((this.settingsStandard[s].name == "scaling_min_freq") &&
 			(parseFloat(this.settingsStandard[s].value) > parseFloat(dataHandler.currentLimits.max))) {
 			alert("newmin: "+this.settingsStandard[s].value+" greater than oldmax: "+dataHandler.currentLimits.max);
@@ -668,10 +672,11 @@ profileModel.prototype.apply = function()
 		}
 	}
 
+	// The cpufreq params and io scheduler are applied together, and rolled back together if any of them fail.
 	if (profiles.setRequests['cpufreq']) profiles.setRequests['cpufreq'].cancel();
-	profiles.setRequests["cpufreq"] = service.set_cpufreq_params(profiles.applyCompleteCpufreq, standardParams, specificParams, overrideParams, (Mojo.Environment.DeviceInfo.modelNameAscii.indexOf("TouchPad") == 0) ? 1 : 0);
+	profiles.setRequests["cpufreq"] = service.apply_profile(profiles.applyCompleteCpufreq, String(this.id), applyParams, specificParams, overrideParams, this.ioScheduler);
 	if (profiles.stickRequests['cpufreq']) profiles.stickRequests['cpufreq'].cancel();
-	profiles.stickRequests['cpufreq'] = service.stick_cpufreq_params(profiles.stickCompleteCpufreq, standardParams, specificParams, overrideParams, (Mojo.Environment.DeviceInfo.modelNameAscii.indexOf("TouchPad") == 0) ? 1 : 0);
+	profiles.stickRequests['cpufreq'] = service.stick_cpufreq_params(profiles.stickCompleteCpufreq, standardParams, specificParams, overrideParams);
 	
 	if (this.settingsCompcache) {
 		for (var s = 0; s < this.settingsCompcache.length; s++) {
@@ -684,8 +689,6 @@ profileModel.prototype.apply = function()
 	}
 
 	if (this.ioScheduler) {
-		if (profiles.setRequests['iosched']) profiles.setRequests['iosched'].cancel();
-		profiles.setRequests["iosched"] = service.set_io_scheduler(profiles.applyCompleteIoSched, this.ioScheduler);
 		if (profiles.stickRequests['iosched']) profiles.stickRequests['iosched'].cancel();
 		profiles.stickRequests["iosched"] = service.stick_io_scheduler(profiles.stickCompleteIoSched, this.ioScheduler);
 	}
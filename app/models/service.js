@@ -13,6 +13,16 @@ service.getMachineName = function(callback)
 	return request;
 };
 
+service.get_cache_stats = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_cache_stats',
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
 
 service.get_proc_version = function(callback)
 {
@@ -24,11 +34,15 @@ service.get_proc_version = function(callback)
 	});
 	return request;
 };
-service.get_proc_cpuinfo = function(callback)
+service.get_proc_cpuinfo = function(callback, chunked)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_proc_cpuinfo',
+		parameters:
+		{
+			subscribe: (chunked ? true : false)
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
@@ -44,6 +58,20 @@ service.get_proc_meminfo = function(callback)
 	});
 	return request;
 };
+service.get_memory_stats = function(callback, fields)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_memory_stats',
+		parameters:
+		{
+			fields: fields
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
 service.get_proc_loadavg = function(callback)
 {
 	var request = new Mojo.Service.Request(service.identifier,
@@ -98,11 +126,15 @@ service.get_scaling_cur_freq = function(callback, cpu)
 	});
 	return request;
 };
-service.get_scaling_governor = function(callback)
+service.get_scaling_governor = function(callback, cpu)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_scaling_governor',
+		parameters:
+		{
+			cpu: cpu
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
@@ -124,6 +156,16 @@ service.get_cpufreq_params = function(callback, governor, cpu)
 	});
 	return request;
 };
+service.get_cpufreq_policies = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_cpufreq_policies',
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
 service.set_cpufreq_params = function(callback, genericParams, governorParams, overrideParams, maxCpu)
 {
 	var request = new Mojo.Service.Request(service.identifier,
@@ -141,6 +183,24 @@ service.set_cpufreq_params = function(callback, genericParams, governorParams, o
 	});
 	return request;
 };
+service.apply_profile = function(callback, profileId, genericParams, governorParams, overrideParams, ioScheduler)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'apply_profile',
+		parameters:
+		{
+			profileId: profileId,
+			genericParams: genericParams,
+			governorParams: governorParams,
+			overrideParams: overrideParams,
+			ioScheduler: ioScheduler
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
 service.stick_cpufreq_params = function(callback, genericParams, governorParams, overrideParams, maxCpu)
 {
 	var request = new Mojo.Service.Request(service.identifier,
@@ -168,17 +228,126 @@ service.unstick_cpufreq_params = function(callback)
 	});
 	return request;
 };
-service.get_cpufreq_file = function(callback)
+service.get_cpufreq_file = function(callback, chunked)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_cpufreq_file',
+		parameters:
+		{
+			subscribe: (chunked ? true : false)
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
 	return request;
 };
 
+service.subscribe_telemetry = function(callback, interval, fields)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'subscribe_telemetry',
+		parameters:
+		{
+			interval: interval,
+			fields: fields,
+			subscribe: true
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_telemetry_snapshot = function(callback, fields)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_telemetry_snapshot',
+		parameters:
+		{
+			fields: fields
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.subscribe_sysfs_changes = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'subscribe_sysfs_changes',
+		parameters:
+		{
+			subscribe: true
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_hotplug_events = function(callback, subscribe)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_hotplug_events',
+		parameters:
+		{
+			subscribe: (subscribe ? true : false)
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_cpu_utilisation = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_cpu_utilisation',
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_pressure = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_pressure',
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_history = function(callback, metric, from, to, step)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_history',
+		parameters:
+		{
+			metric: metric,
+			from: from,
+			to: to,
+			step: step
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_boot_config = function(callback)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_boot_config',
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
 service.get_compcache_config = function(callback, governor)
 {
 	var request = new Mojo.Service.Request(service.identifier,
@@ -227,11 +396,15 @@ service.unstick_compcache_config = function(callback)
 	});
 	return request;
 };
-service.get_compcache_file = function(callback)
+service.get_compcache_file = function(callback, chunked)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_compcache_file',
+		parameters:
+		{
+			subscribe: (chunked ? true : false)
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
@@ -252,21 +425,44 @@ service.get_time_in_state = function(callback, cpu)
 	});
 	return request;
 };
-service.get_total_trans = function(callback)
+service.get_total_trans = function(callback, cpu)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_total_trans',
+		parameters:
+		{
+			cpu: cpu
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
 	return request;
 };
-service.get_trans_table = function(callback)
+service.get_trans_table = function(callback, cpu)
 {
 	var request = new Mojo.Service.Request(service.identifier,
 	{
 		method: 'get_trans_table',
+		parameters:
+		{
+			cpu: cpu
+		},
+		onSuccess: callback,
+		onFailure: callback
+	});
+	return request;
+};
+service.get_cpufreq_stats = function(callback, cpu, cursor)
+{
+	var request = new Mojo.Service.Request(service.identifier,
+	{
+		method: 'get_cpufreq_stats',
+		parameters:
+		{
+			cpu: cpu,
+			cursor: cursor
+		},
 		onSuccess: callback,
 		onFailure: callback
 	});
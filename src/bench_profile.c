@@ -0,0 +1,190 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at
+ your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+//
+// Time a cpufreq profile switch through set_cpufreq_params, through apply_profile
+// compiling a new write plan each time, and through apply_profile with kept plans
+// (named by a profileId, and named by a hash of the params).
+//
+// The work functions are called directly on this thread (no luna bus, no worker
+// threads), against a fake sysfs tree which is built afresh under the directory
+// given (default /tmp/govnah-bench, which should be on tmpfs):  cpu0 and cpu1 in
+// one policy at cpuN/cpufreq, with a global ondemand governor directory and an
+// override directory.  Each switch alternates between two profiles, so every
+// attribute really is written, and each has 3 generic, 2 governor and 1 override
+// params.  Each variant is run BENCH_RUNS times (interleaved with the others) of
+// the given number of switches (default 20000), and the best run is reported in
+// microseconds per switch.
+//
+// Build it with "make bench_profile" in src, and run it with
+// "./bench_profile [switches] [directory]".
+//
+#include "luna_methods.c"
+
+#define BENCH_RUNS 9
+
+#define BENCH_PROFILE(id, governor, min, max, rate, threshold, vdd1)			\
+  "{" id "\"genericParams\": ["								\
+  "{\"name\": \"scaling_governor\", \"value\": \"" governor "\"}, "			\
+  "{\"name\": \"scaling_min_freq\", \"value\": \"" min "\"}, "				\
+  "{\"name\": \"scaling_max_freq\", \"value\": \"" max "\"}], "				\
+  "\"governorParams\": ["								\
+  "{\"name\": \"sampling_rate\", \"value\": \"" rate "\"}, "				\
+  "{\"name\": \"up_threshold\", \"value\": \"" threshold "\"}], "			\
+  "\"overrideParams\": [{\"name\": \"vdd1\", \"value\": \"" vdd1 "\"}]}"
+
+static char *bench_profiles[2][2] = {
+  { BENCH_PROFILE("", "ondemand", "300000", "800000", "50000", "80", "0"),
+    BENCH_PROFILE("", "ondemand", "600000", "1000000", "20000", "95", "1") },
+  { BENCH_PROFILE("\"profileId\": \"1\", ", "ondemand", "300000", "800000", "50000", "80", "0"),
+    BENCH_PROFILE("\"profileId\": \"2\", ", "ondemand", "600000", "1000000", "20000", "95", "1") },
+};
+
+static bool bench_file(char *directory, char *name, char *value) {
+  char filename[MAXLINLEN];
+  char path[MAXLINLEN];
+  char *p;
+
+  sprintf(filename, "%s/%s", directory, name);
+  strcpy(path, filename);
+  for (p = path + 1; (p = strchr(p, '/')); p++) {
+    *p = '\0';
+    if (mkdir(path, 0755) && (errno != EEXIST)) return false;
+    *p = '/';
+  }
+
+  FILE *fp = fopen(filename, "w");
+  if (!fp) return false;
+  bool written = (fprintf(fp, "%s\n", value) >= 0);
+  if (fclose(fp)) written = false;
+
+  return written;
+}
+
+//
+// Build the fake sysfs tree, with the attributes at values neither profile uses.
+//
+static bool bench_tree(char *directory) {
+  char name[MAXLINLEN];
+  int cpu;
+
+  for (cpu = 0; cpu < 2; cpu++) {
+    sprintf(name, "cpu%d/online", cpu);
+    if (!bench_file(directory, name, "1")) return false;
+    sprintf(name, "cpu%d/cpufreq/related_cpus", cpu);
+    if (!bench_file(directory, name, "0-1")) return false;
+    sprintf(name, "cpu%d/cpufreq/scaling_available_frequencies", cpu);
+    if (!bench_file(directory, name, "300000 600000 800000 1000000")) return false;
+    sprintf(name, "cpu%d/cpufreq/scaling_available_governors", cpu);
+    if (!bench_file(directory, name, "ondemand performance powersave")) return false;
+    sprintf(name, "cpu%d/cpufreq/scaling_governor", cpu);
+    if (!bench_file(directory, name, "performance")) return false;
+    sprintf(name, "cpu%d/cpufreq/scaling_min_freq", cpu);
+    if (!bench_file(directory, name, "300000")) return false;
+    sprintf(name, "cpu%d/cpufreq/scaling_max_freq", cpu);
+    if (!bench_file(directory, name, "600000")) return false;
+  }
+
+  return (bench_file(directory, "present", "0-1") &&
+	  bench_file(directory, "online", "0-1") &&
+	  bench_file(directory, "cpufreq/ondemand/sampling_rate", "10000") &&
+	  bench_file(directory, "cpufreq/ondemand/up_threshold", "50") &&
+	  bench_file(directory, "cpufreq/override/vdd1", "2"));
+}
+
+//
+// Time switches between the two profiles, and return the microseconds per switch.
+// Returns a negative time if any switch failed.
+//
+static double bench_run(request_func work, char **profiles, int switches, bool recompile) {
+  request_t *req[2];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    req[i] = request_new(NULL, NULL, work);
+    req[i]->object = json_arena_parse(&req[i]->arena, profiles[i]);
+  }
+
+  gint64 start = g_get_monotonic_time();
+  for (i = 0; i < switches; i++) {
+    // Going round the generation makes every kept plan stale.
+    if (recompile) g_atomic_int_inc(&profile_generation);
+    work(req[i & 1]);
+  }
+  gint64 end = g_get_monotonic_time();
+
+  bool failed = false;
+  for (i = 0; i < 2; i++) {
+    if (!strstr(reply_text(&req[i]->reply), "\"returnValue\": true")) {
+      fprintf(stderr, "%s\n", reply_text(&req[i]->reply));
+      failed = true;
+    }
+    reply_free(&req[i]->reply);
+    arena_free(&req[i]->arena);
+    free(req[i]);
+  }
+
+  return failed ? -1.0 : (double)(end - start) / switches;
+}
+
+int main(int argc, char **argv) {
+  static struct {
+    char *name;
+    request_func work;
+    char **profiles;
+    bool recompile;
+    double best;
+  } variants[] = {
+    { "set_cpufreq_params", set_cpufreq_params_work, bench_profiles[0], false, 0 },
+    { "apply_profile, compiled", apply_profile_work, bench_profiles[0], true, 0 },
+    { "apply_profile, kept by hash", apply_profile_work, bench_profiles[0], false, 0 },
+    { "apply_profile, kept by id", apply_profile_work, bench_profiles[1], false, 0 },
+    { 0, 0, 0, false, 0 }
+  };
+  int switches = (argc > 1) ? atoi(argv[1]) : 20000;
+  double time;
+  int run, i;
+
+  cpudir = (argc > 2) ? argv[2] : "/tmp/govnah-bench";
+  if (switches < 2) switches = 2;
+
+  if (!bench_tree(cpudir)) {
+    fprintf(stderr, "Unable to build the fake sysfs tree in %s: %s\n", cpudir, strerror(errno));
+    return 1;
+  }
+
+  // The work functions log every real write.
+  if (!freopen("/dev/null", "w", stderr)) return 1;
+
+  for (run = 0; run < BENCH_RUNS; run++) {
+    for (i = 0; variants[i].name; i++) {
+      if ((time = bench_run(variants[i].work, variants[i].profiles, switches, variants[i].recompile)) < 0) {
+	printf("%s failed\n", variants[i].name);
+	return 1;
+      }
+      if (!run || (time < variants[i].best)) variants[i].best = time;
+    }
+  }
+
+  printf("%d switches, best of %d runs:\n", switches, BENCH_RUNS);
+  for (i = 0; variants[i].name; i++) {
+    printf("  %-28s %7.1f us/switch\n", variants[i].name, variants[i].best);
+  }
+
+  return 0;
+}
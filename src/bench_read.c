@@ -0,0 +1,118 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at
+ your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+//
+// Time reading the files behind the simple read methods, in calls per second, the old
+// way (popen of "/bin/cat file", one fgets per line) and through reply_file, which is
+// what the methods call on a cache miss.  Both build the same {"stdOut": [...]} reply.
+//
+// The calls are made directly on this thread (no luna bus, no worker threads), each for
+// the given number of seconds (default 1).  A file which does not exist on the host is
+// marked as missing, and its row times the failure path.
+//
+// Build it with "make bench_read" in src, and run it with "./bench_read [seconds]".
+//
+#include "luna_methods.c"
+
+static struct {
+  char *method;
+  char *file;
+} bench_files[] = {
+  { "getMachineName",			"/etc/prefs/properties/machineName" },
+  { "get_proc_version",			"/proc/version" },
+  { "get_proc_cpuinfo",			"/proc/cpuinfo" },
+  { "get_proc_meminfo",			"/proc/meminfo" },
+  { "get_proc_loadavg",			"/proc/loadavg" },
+  { "get_time_in_state",		"/sys/devices/system/cpu/cpu0/cpufreq/stats/time_in_state" },
+  { "get_trans_table",			"/sys/devices/system/cpu/cpu0/cpufreq/stats/trans_table" },
+  { "get_io_scheduler",			"/sys/block/mmcblk0/queue/scheduler" },
+  { "get_tcp_congestion_control",	"/proc/sys/net/ipv4/tcp_congestion_control" },
+  { "get_tcp_available_congestion_control", "/proc/sys/net/ipv4/tcp_available_congestion_control" },
+  { 0, 0 }
+};
+
+//
+// The old way: fork a shell and cat, and escape each line of its output into the reply.
+//
+static void bench_cat(request_t *req, char *file) {
+  char command[MAXLINLEN];
+  char line[MAXLINLEN];
+  bool first = true;
+
+  sprintf(command, "/bin/cat %s 2>&1", file);
+  reply_set(&req->reply, "{\"stdOut\": [");
+
+  FILE *fp = popen(command, "r");
+  if (!fp) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to run command\", \"returnValue\": false, \"errorCode\": -1 }");
+    return;
+  }
+
+  while (fgets(line, sizeof line, fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    reply_append(&req->reply, first ? "\"" : ", \"");
+    reply_escape(&req->reply, line);
+    reply_append(&req->reply, "\"");
+    first = false;
+  }
+
+  if (pclose(fp)) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to run command\", \"returnValue\": false, \"errorCode\": -1 }");
+    return;
+  }
+
+  reply_append(&req->reply, "], \"returnValue\": true}");
+}
+
+//
+// Call the reader over and over for the given time, and return the calls per second.
+//
+static double bench_run(void (*reader)(request_t *req, char *file), request_t *req, char *file, double seconds) {
+  gint64 start = g_get_monotonic_time();
+  gint64 end = start + (gint64)(seconds * 1000000);
+  gint64 now;
+  long calls = 0;
+
+  do {
+    reader(req, file);
+    calls++;
+  } while ((now = g_get_monotonic_time()) < end);
+
+  return calls * 1000000.0 / (now - start);
+}
+
+int main(int argc, char **argv) {
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+  double before, after;
+  int i;
+
+  if (seconds <= 0) seconds = 1.0;
+
+  request_t *req = request_new(NULL, NULL, NULL);
+  if (!req) return 1;
+
+  printf("Calls per second, /bin/cat -> reply_file, %g s each:\n", seconds);
+  for (i = 0; bench_files[i].method; i++) {
+    before = bench_run(bench_cat, req, bench_files[i].file, seconds);
+    after = bench_run(reply_file, req, bench_files[i].file, seconds);
+    printf("  %-38s %8.0f -> %8.0f%s\n", bench_files[i].method, before, after,
+	   access(bench_files[i].file, R_OK) ? "  (missing)" : "");
+  }
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at
+ your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+//
+// Time building the reply for a large file, the old way (each line escaped into a
+// scratch buffer, then strcat onto a fixed buffer) and through reply_file with the
+// reply_t writer, and check that both give the same text.
+//
+// The file is written afresh at the path given (default /tmp/govnah-reply-bench): 64 KB
+// of lines with quotes, tabs and backslashes in them, so most of them need escaping.
+// The fixed buffer is made big enough to hold the whole reply, where the old one was
+// MAXBUFLEN and would have cut it short.  Each way is run for the given number of
+// iterations (default 500), and the time per reply is reported in microseconds.
+//
+// Build it with "make bench_reply" in src, and run it with
+// "./bench_reply [iterations] [file]".
+//
+#include "luna_methods.c"
+
+#define BENCH_FILE_SIZE (64 * 1024)
+#define BENCH_BUFLEN (1024 * 1024)
+
+static char bench_buffer[BENCH_BUFLEN];
+static char bench_escaped[MAXLINLEN * 6];
+
+static bool bench_file(char *file) {
+  int size = 0, line = 0;
+
+  FILE *fp = fopen(file, "w");
+  if (!fp) return false;
+
+  while (size < BENCH_FILE_SIZE) {
+    int len = fprintf(fp, "%d\t\"name %d\"\t\"C:\\path\\to\\%d\"\tsome plain text after it\n", line, line, line);
+    if (len < 0) break;
+    size += len;
+    line++;
+  }
+
+  return !fclose(fp) && (size >= BENCH_FILE_SIZE);
+}
+
+//
+// Escape a string the way the old json_escape did, into a scratch buffer.
+//
+static char *bench_escape(char *out, char *str) {
+  char *p = out;
+  unsigned char c;
+
+  for (; (c = *str); str++) {
+    switch (c) {
+    case '\b': *p++ = '\\'; *p++ = 'b'; break;
+    case '\n': *p++ = '\\'; *p++ = 'n'; break;
+    case '\r': *p++ = '\\'; *p++ = 'r'; break;
+    case '\t': *p++ = '\\'; *p++ = 't'; break;
+    case '"':  *p++ = '\\'; *p++ = '"'; break;
+    case '\\': *p++ = '\\'; *p++ = '\\'; break;
+    default:
+      if ((c < ' ') || (c > 127)) p += sprintf(p, "\\u00%02x", c);
+      else *p++ = c;
+    }
+  }
+  *p = '\0';
+
+  return out;
+}
+
+//
+// The old way, one strcat at a time, each of which scans the reply so far.
+//
+static bool bench_strcat(char *file) {
+  char line[MAXLINLEN];
+  bool first = true;
+
+  FILE *fp = fopen(file, "r");
+  if (!fp) return false;
+
+  strcpy(bench_buffer, "{\"stdOut\": [");
+  while (fgets(line, sizeof line, fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!first) strcat(bench_buffer, ", ");
+    strcat(bench_buffer, "\"");
+    strcat(bench_buffer, bench_escape(bench_escaped, line));
+    strcat(bench_buffer, "\"");
+    first = false;
+  }
+  strcat(bench_buffer, "], \"returnValue\": true}");
+
+  return !fclose(fp);
+}
+
+int main(int argc, char **argv) {
+  int iterations = (argc > 1) ? atoi(argv[1]) : 500;
+  char *file = (argc > 2) ? argv[2] : "/tmp/govnah-reply-bench";
+  gint64 start, end;
+  int i;
+
+  if (iterations < 1) iterations = 1;
+
+  if (!bench_file(file)) {
+    fprintf(stderr, "Unable to write %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  request_t *req = request_new(NULL, NULL, NULL);
+  if (!req) return 1;
+
+  if (!bench_strcat(file)) return 1;
+  reply_file(req, file);
+  if (strcmp(bench_buffer, reply_text(&req->reply))) {
+    printf("The replies differ\n");
+    return 1;
+  }
+  printf("%zu bytes of reply, %d iterations:\n", req->reply.len, iterations);
+
+  start = g_get_monotonic_time();
+  for (i = 0; i < iterations; i++) bench_strcat(file);
+  end = g_get_monotonic_time();
+  printf("  strcat into a fixed buffer %8.1f us/reply\n", (double)(end - start) / iterations);
+
+  start = g_get_monotonic_time();
+  for (i = 0; i < iterations; i++) reply_file(req, file);
+  end = g_get_monotonic_time();
+  printf("  reply_t writer             %8.1f us/reply\n", (double)(end - start) / iterations);
+
+  return 0;
+}
@@ -22,10 +22,13 @@
 
 #include "govnah.h"
 
+static int apply_boot = 0;
+
 static struct option long_options[] = {
   { "help",	no_argument,		0, 'h' },
   { "version",	no_argument,		0, 'V' },
   { "debug",	required_argument,	0, 'D' },
+  { "apply-boot-config", no_argument,	0, 'B' },
   { 0, 0, 0, 0 }
 };
 
@@ -39,7 +42,8 @@ void print_help(char *argv[]) {
 	 "Miscellaneous:\n"
 	 "  -h, --help\t\tprint help information and exit\n"
 	 "  -D, --debug\t\tset debug level\n"
-	 "  -V, --version\t\tprint version information and exit\n", argv[0]);
+	 "  -V, --version\t\tprint version information and exit\n"
+	 "  -B, --apply-boot-config\tapply the sticky settings and exit\n", argv[0]);
 }
 
 int getopts(int argc, char *argv[]) {
@@ -48,13 +52,16 @@ int getopts(int argc, char *argv[]) {
 
   while (1) {
     int option_index = 0;
-    c = getopt_long(argc, argv, "D:Vh", long_options, &option_index);
+    c = getopt_long(argc, argv, "D:VhB", long_options, &option_index);
     if (c == -1)
       break;
     switch (c) {
     case 'D':
       debug = atoi(optarg);
       break;
+    case 'B':
+      apply_boot = 1;
+      break;
     case 'V':
       print_version();
       retVal = 1;
@@ -82,6 +89,9 @@ int main(int argc, char *argv[]) {
   if (getopts(argc, argv) == 1)
     return 1;
 
+  if (apply_boot)
+    return apply_boot_config() ? 0 : 1;
+
   if (luna_service_initialize("org.webosinternals.govnah"))
     luna_service_start();
 
@@ -18,1236 +18,6199 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#include <glib.h>
 
 #include "luna_service.h"
 #include "luna_methods.h"
 
 #define ALLOWED_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-"
 
-//
-// We use static buffers instead of continually allocating and deallocating stuff,
-// since we're a long-running service, and do not want to leak anything.
-//
-static char buffer[MAXBUFLEN];
-static char esc_buffer[MAXBUFLEN];
-static char run_command_buffer[MAXBUFLEN];
-
 static char *cpudir = "/sys/devices/system/cpu";
 static char *battdir    = "/sys/devices/w1_bus_master1";
 
 //
-// Is CPU online
+// Hot sysfs attributes (frequencies, sensors, cpu online state) are polled every
+// tick, so we keep their file descriptors open and re-read them from offset zero
+// with pread, which costs one system call per read instead of four.
 //
-bool is_cpu_online(cpu)
-{
-  bool status = false;
-  char filename[MAXLINLEN];
-  sprintf(filename, "/sys/devices/system/cpu/cpu%d/online", cpu);
-  FILE *fp = fopen(filename, "r");
-  if (!fp) return false;
-  if (fgetc(fp) == '1') status = true;
-  if (fclose(fp)) status = false;
-  return status;
-}
+#define ATTR_CACHE_SIZE 32
+
+typedef struct {
+  char path[MAXLINLEN];
+  int fd;
+  int users;
+  bool stale;
+} cached_attr_t;
+
+static cached_attr_t attr_cache[ATTR_CACHE_SIZE];
+
+// Worker threads share the cache, but only hold the lock to look up or update a slot,
+// never across the read itself, so one stuck sensor cannot hold up the others.
+// A slot that is invalidated while it is being read is closed by its last reader.
+static pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //
-// Bring CPU online
+// Drop a slot from the cache, closing it now or when its last reader is done.
+// The attr_lock must be held.
 //
-void bring_cpu_online(cpu)
-{
-  char filename[MAXLINLEN];
-  sprintf(filename, "/sys/devices/system/cpu/cpu%d/online", cpu);
-  FILE *fp = fopen(filename, "w");
-  if (!fp) return;
-  fputs("1", fp);
-  fclose(fp);
-  return;
+static void attr_drop(cached_attr_t *attr) {
+  attr->path[0] = '\0';
+  if (attr->users) {
+    attr->stale = true;
+  }
+  else {
+    close(attr->fd);
+  }
 }
 
 //
-// Escape a string so that it can be used directly in a JSON response.
-// In general, this means escaping quotes, backslashes and control chars.
-// It uses the static esc_buffer, which must be twice as large as the
-// largest string this routine can handle.
+// Close every cached attribute whose path starts with prefix.
 //
-static char *json_escape_str(char *str)
-{
-  const char *json_hex_chars = "0123456789abcdef";
-
-  // Initialise the output buffer
-  strcpy(esc_buffer, "");
-
-  // Check the constraints on the input string
-  if (strlen(str) > MAXBUFLEN) return (char *)esc_buffer;
-
-  // Initialise the pointers used to step through the input and output.
-  char *resultsPt = (char *)esc_buffer;
-  int pos = 0, start_offset = 0;
-
-  // Traverse the input, copying to the output in the largest chunks
-  // possible, escaping characters as we go.
-  unsigned char c;
-  do {
-    c = str[pos];
-    switch (c) {
-    case '\0':
-      // Terminate the copying
-      break;
-    case '\b':
-    case '\n':
-    case '\r':
-    case '\t':
-    case '"':
-    case '\\': {
-      // Copy the chunk before the character which must be escaped
-      if (pos - start_offset > 0) {
-	memcpy(resultsPt, str + start_offset, pos - start_offset);
-	resultsPt += pos - start_offset;
-      };
-      
-      // Escape the character
-      if      (c == '\b') {memcpy(resultsPt, "\\b",  2); resultsPt += 2;} 
-      else if (c == '\n') {memcpy(resultsPt, "\\n",  2); resultsPt += 2;} 
-      else if (c == '\r') {memcpy(resultsPt, "\\r",  2); resultsPt += 2;} 
-      else if (c == '\t') {memcpy(resultsPt, "\\t",  2); resultsPt += 2;} 
-      else if (c == '"')  {memcpy(resultsPt, "\\\"", 2); resultsPt += 2;} 
-      else if (c == '\\') {memcpy(resultsPt, "\\\\", 2); resultsPt += 2;} 
-
-      // Reset the start of the next chunk
-      start_offset = ++pos;
-      break;
-    }
-
-    default:
-      
-      // Check for "special" characters
-      if ((c < ' ') || (c > 127)) {
-
-	// Copy the chunk before the character which must be escaped
-	if (pos - start_offset > 0) {
-	  memcpy(resultsPt, str + start_offset, pos - start_offset);
-	  resultsPt += pos - start_offset;
-	}
-
-	// Insert a normalised representation
-	sprintf(resultsPt, "\\u00%c%c",
-		json_hex_chars[c >> 4],
-		json_hex_chars[c & 0xf]);
+static void attr_cache_invalidate(char *prefix) {
+  int i;
+  size_t len = strlen(prefix);
 
-	// Reset the start of the next chunk
-	start_offset = ++pos;
-      }
-      else {
-	// Just move along the source string, without copying
-	pos++;
-      }
+  pthread_mutex_lock(&attr_lock);
+  for (i = 0; i < ATTR_CACHE_SIZE; i++) {
+    if (attr_cache[i].path[0] && !strncmp(attr_cache[i].path, prefix, len)) {
+      attr_drop(&attr_cache[i]);
     }
-  } while (c);
-
-  // Copy the final chunk, if required
-  if (pos - start_offset > 0) {
-    memcpy(resultsPt, str + start_offset, pos - start_offset);
-    resultsPt += pos - start_offset;
-  } 
-
-  // Terminate the output buffer ...
-  memcpy(resultsPt, "\0", 1);
-
-  // and return a pointer to it.
-  return (char *)esc_buffer;
+  }
+  pthread_mutex_unlock(&attr_lock);
 }
 
 //
-// A dummy method, useful for unimplemented functions or as a status function.
-// Called directly from webOS, and returns directly to webOS.
+// Open an attribute, marking the descriptor close-on-exec so commands we run do not inherit it.
 //
-bool dummy_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  if (!LSMessageReply(lshandle, message, "{\"returnValue\": true}", &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+static int attr_open(char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
 }
 
 //
-// Run a shell command, and return the output in-line in a buffer for returning to webOS.
-// If lshandle, message and subscriber are defined, then also send back status messages.
-// The global run_command_buffer must be initialised before calling this function.
-// The return value says whether the command executed successfully or not.
+// Read the contents of a hot attribute into text, using (and filling) the cache.
+// Returns the length read, or -1 if the attribute cannot be opened or read.
 //
-static bool run_command(char *command, bool escape) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  // Local buffers to store the current and previous lines.
-  char line[MAXLINLEN];
-
-  // fprintf(stderr, "Running command %s\n", command);
-
-  // run_command_buffer is assumed to be initialised, ready for strcat to append.
-
-  // Is this the first line of output?
-  bool first = true;
-
-  bool array = false;
-
-  // Start execution of the command, and read the output.
-  FILE *fp = popen(command, "r");
+static int attr_read(char *file, char *text, int size) {
+  cached_attr_t *attr = NULL;
+  ssize_t len;
+  int i;
 
-  // Return immediately if we cannot even start the command.
-  if (!fp) {
-    return false;
+  pthread_mutex_lock(&attr_lock);
+  for (i = 0; i < ATTR_CACHE_SIZE; i++) {
+    if (!strcmp(attr_cache[i].path, file)) {
+      attr = &attr_cache[i];
+      attr->users++;
+      break;
+    }
   }
+  pthread_mutex_unlock(&attr_lock);
+
+  if (attr) {
+    len = pread(attr->fd, text, size - 1, 0);
+
+    pthread_mutex_lock(&attr_lock);
+    attr->users--;
+    // The attribute has gone away (for instance its cpu went offline), so reopen it.
+    if ((len < 0) && !attr->stale && !strcmp(attr->path, file)) attr_drop(attr);
+    if (attr->stale && !attr->users) {
+      close(attr->fd);
+      attr->stale = false;
+    }
+    pthread_mutex_unlock(&attr_lock);
 
-  // Loop through the output lines
-  while (fgets(line, sizeof line, fp)) {
+    if (len >= 0) {
+      text[len] = '\0';
+      return len;
+    }
+  }
 
-    // Chomp the newline
-    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+  int fd = attr_open(file);
+  if (fd < 0) return -1;
 
-    // Add formatting breaks between lines
-    if (first) {
-      if (run_command_buffer[strlen(run_command_buffer)-1] == '[') {
-	array = true;
-      }
-      first = false;
-    }
-    else {
-      if (array) {
-	strcat(run_command_buffer, ", ");
-      }
-      else {
-	strcat(run_command_buffer, "<br>");
-      }
-    }
-    
-    // Append the unfiltered output to the run_command_buffer.
-    if (escape) {
-      if (array) {
-	strcat(run_command_buffer, "\"");
-      }
-      strcat(run_command_buffer, json_escape_str(line));
-      if (array) {
-	strcat(run_command_buffer, "\"");
+  len = pread(fd, text, size - 1, 0);
+  if (len < 0) {
+    close(fd);
+    return -1;
+  }
+  text[len] = '\0';
+
+  // Remember it if there is room (and nobody beat us to it), otherwise just
+  // behave like an uncached read.
+  attr = NULL;
+  if (strlen(file) < MAXLINLEN) {
+    pthread_mutex_lock(&attr_lock);
+    for (i = 0; i < ATTR_CACHE_SIZE; i++) {
+      if (!strcmp(attr_cache[i].path, file)) {
+	attr = NULL;
+	break;
       }
+      if (!attr && !attr_cache[i].path[0] && !attr_cache[i].stale) attr = &attr_cache[i];
     }
-    else {
-      strcat(run_command_buffer, line);
+    if (attr) {
+      strcpy(attr->path, file);
+      attr->fd = fd;
     }
+    pthread_mutex_unlock(&attr_lock);
   }
-  
-  // Check the close status of the process
-  if (pclose(fp)) {
-    return false;
-  }
+  if (!attr) close(fd);
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  // %%% We need a way to distinguish command failures from LSMessage failures %%%
-  // %%% This may need to be true if we just want to ignore LSMessage failures %%%
-  return false;
+  return len;
 }
 
 //
-// Send a standard format command failure message back to webOS.
-// The command will be escaped.  The output argument should be a JSON array and is not escaped.
-// The additional text  will not be escaped.
-// The return value is from the LSMessageReply call, not related to the command execution.
+// Parse a decimal integer, with optional leading whitespace and sign, without stdio.
 //
-static bool report_command_failure(LSHandle* lshandle, LSMessage *message, char *command, char *stdErrText, char *additional) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  // Include the command that was executed, in escaped form.
-  snprintf(buffer, MAXBUFLEN,
-	   "{\"errorText\": \"Unable to run command: %s\"",
-	   json_escape_str(command));
+static bool parse_integer(char *text, int *value) {
+  int sign = 1, result = 0;
 
-  // Include any stderr fields from the command.
-  if (stdErrText) {
-    strcat(buffer, ", \"stdErr\": ");
-    strcat(buffer, stdErrText);
-  }
+  while ((*text == ' ') || (*text == '\t') || (*text == '\n')) text++;
+  if (*text == '-') { sign = -1; text++; }
+  else if (*text == '+') text++;
 
-  // Report that an error occurred.
-  strcat(buffer, ", \"returnValue\": false, \"errorCode\": -1");
+  if ((*text < '0') || (*text > '9')) return false;
 
-  // Add any additional JSON fields.
-  if (additional) {
-    strcat(buffer, ", ");
-    strcat(buffer, additional);
+  while ((*text >= '0') && (*text <= '9')) {
+    result = result * 10 + (*text++ - '0');
   }
 
-  // Terminate the JSON reply message ...
-  strcat(buffer, "}");
-
-  // fprintf(stderr, "Message is %s\n", buffer);
-
-  // and send it.
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-
+  *value = sign * result;
   return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
 }
 
 //
-// Run a simple shell command, and return the output to webOS.
+// The cpu topology is read once at startup from the kernel's present cpu list, so the
+// per-cpu methods cover every cpu without the client having to know how many there are.
 //
-static bool simple_command(LSHandle* lshandle, LSMessage *message, char *command) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  // Initialise the output buffer
-  strcpy(run_command_buffer, "{\"stdOut\": [");
-
-  // Run the command
-  if (run_command(command, true)) {
+#define MAX_CPUS 32
 
-    // Finalise the message ...
-    strcat(run_command_buffer, "], \"returnValue\": true}");
+static int cpu_total = 0;
 
-    // fprintf(stderr, "Message is %s\n", run_command_buffer);
-
-    // and send it to webOS.
-    if (!LSMessageReply(lshandle, message, run_command_buffer, &lserror)) goto error;
+//
+// Parse a kernel cpu list (such as "0-3,6", or "0 1 2 3" in related_cpus) into a bitmask.
+//
+static unsigned int parse_cpu_list(char *text) {
+  unsigned int mask = 0;
+  char *end;
+  long first, last;
+
+  while (*text) {
+    first = last = strtol(text, &end, 10);
+    if (end == text) break;
+    text = end;
+    if (*text == '-') {
+      last = strtol(text+1, &end, 10);
+      if (end == text+1) break;
+      text = end;
+    }
+    for (; (first <= last) && (first < MAX_CPUS); first++) {
+      if (first >= 0) mask |= 1U << first;
+    }
+    if ((*text != ',') && (*text != ' ')) break;
+    text++;
   }
-  else {
 
-    // Finalise the command output ...
-    strcat(run_command_buffer, "]");
+  return mask;
+}
 
-    // and use it in a failure report message.
-    if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto end;
-  }
+//
+// Read the first line of a small file into text (which must hold MAXLINLEN),
+// without the trailing newline.
+//
+static bool read_line(char *filename, char *text) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) return false;
+  bool status = (fgets(text, MAXLINLEN, fp) != NULL);
+  fclose(fp);
+  if (!status) return false;
 
+  text[strcspn(text, "\n")] = '\0';
   return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
 }
 
 //
-// Read a single string from a file, and return it to webOS.
+// Read one of the cpu lists in the cpu directory (present, online, possible).
 //
-static bool read_single_line(LSHandle* lshandle, LSMessage *message, char *file) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+static bool read_cpu_list(char *name, unsigned int *mask) {
+  char filename[MAXLINLEN];
+  char text[MAXLINLEN];
 
-  char line[MAXLINLEN];
+  sprintf(filename, "%s/%s", cpudir, name);
+  if (!read_line(filename, text)) return false;
 
-  // fprintf(stderr, "Reading from %s\n", file);
+  *mask = parse_cpu_list(text);
+  return (*mask != 0);
+}
 
-  FILE *fp = fopen(file, "r");
+//
+// Count the cpus that the kernel knows about (online or not), from the present list,
+// or by probing the cpu directories on kernels which do not have one.
+//
+static void topology_init(void) {
+  char filename[MAXLINLEN];
+  unsigned int present;
+  int cpu;
 
-  if (!fp) {
-    sprintf(buffer, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
+  if (read_cpu_list("present", &present)) {
+    for (cpu = MAX_CPUS; (cpu > 1) && !(present & (1U << (cpu-1))); cpu--);
   }
   else {
-    int value;
-    if (fgets(line, MAXLINLEN-1, fp)) {
-      sprintf(buffer, "{\"value\": \"%s\", \"returnValue\": true }", json_escape_str(line));
-    }
-    else {
-      sprintf(buffer, "{\"errorText\": \"Unable to parse %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
-    }
-    if (fclose(fp)) {
-      sprintf(buffer, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
+    for (cpu = 1; cpu < MAX_CPUS; cpu++) {
+      sprintf(filename, "%s/cpu%d", cpudir, cpu);
+      if (access(filename, F_OK)) break;
     }
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  cpu_total = cpu;
+}
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+static int present_cpus(void) {
+  if (!cpu_total) topology_init();
+  return cpu_total;
 }
 
 //
-// Read a single integer from a file, and return it to webOS.
+// The online state of each cpu is tracked from kernel hotplug uevents (see hotplug_init),
+// so the hot paths test a bitmap instead of reading the online files.  The files are
+// only read if the netlink listener could not be started, and before writing them,
+// since a lost or late uevent must not stop a cpu being brought online.  The bitmap
+// is seeded again from the online list every HOTPLUG_RESEED_INTERVAL seconds, and
+// whenever a write to an online file fails.
 //
-static bool read_single_integer(LSHandle* lshandle, LSMessage *message, char *file) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+#define HOTPLUG_RESEED_INTERVAL 60
 
-  // fprintf(stderr, "Reading from %s\n", file);
+static volatile gint cpu_online_mask = 1;
+static bool hotplug_listening = false;
 
-  FILE *fp = fopen(file, "r");
+static void hotplug_seed(void);
 
-  if (!fp) {
-    sprintf(buffer, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
-  }
-  else {
-    int value;
-    if (fscanf(fp, "%d", &value) == 1) {
-      sprintf(buffer, "{\"value\": %d, \"returnValue\": true }", value);
-    }
-    else {
-      sprintf(buffer, "{\"errorText\": \"Unable to parse %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
-    }
-    if (fclose(fp)) {
-      sprintf(buffer, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
-    }
-  }
+static void cpu_online_update(int cpu, bool online) {
+  gint old, mask;
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  if ((cpu < 0) || (cpu >= MAX_CPUS)) return;
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  do {
+    old = g_atomic_int_get(&cpu_online_mask);
+    mask = online ? (old | (gint)(1U << cpu)) : (old & ~(gint)(1U << cpu));
+  } while (!g_atomic_int_compare_and_exchange(&cpu_online_mask, old, mask));
 }
 
 //
-// Get the machine name, and return the output to webOS.
+// Read the online state of a CPU from sysfs
 //
-bool get_machine_name_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /etc/prefs/properties/machineName 2>&1");
+static bool read_cpu_online(int cpu)
+{
+  char filename[MAXLINLEN];
+  char text[MAXNUMLEN];
+  sprintf(filename, "%s/cpu%d/online", cpudir, cpu);
+  if (attr_read(filename, text, sizeof text) < 1) return false;
+  if (text[0] == '1') return true;
+  // An offline cpu loses its cpufreq directory, so drop any descriptors into it.
+  sprintf(filename, "%s/cpu%d/cpufreq/", cpudir, cpu);
+  attr_cache_invalidate(filename);
+  return false;
 }
 
 //
-// Read /proc/version
+// Is CPU online
 //
-bool get_proc_version_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/version 2>&1");
+bool is_cpu_online(cpu)
+{
+  if (hotplug_listening && (cpu >= 0) && (cpu < MAX_CPUS)) {
+    return (g_atomic_int_get(&cpu_online_mask) & (gint)(1U << cpu)) != 0;
+  }
+  return read_cpu_online(cpu);
 }
 
 //
-// Read /proc/cpuinfo
+// Bring CPU online
 //
-bool get_proc_cpuinfo_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/cpuinfo 2>&1");
+void bring_cpu_online(cpu)
+{
+  char filename[MAXLINLEN];
+  if (read_cpu_online(cpu)) {
+    cpu_online_update(cpu, true);
+    return;
+  }
+  sprintf(filename, "%s/cpu%d/online", cpudir, cpu);
+  FILE *fp = fopen(filename, "w");
+  bool written = fp && (fputs("1", fp) >= 0);
+  if (fp && fclose(fp)) written = false;
+  // Don't wait for the uevent, since the caller is about to use the cpu.
+  if (written) cpu_online_update(cpu, true);
+  else hotplug_seed();
+  // The cpufreq directory is recreated when the cpu comes online.
+  sprintf(filename, "%s/cpu%d/cpufreq/", cpudir, cpu);
+  attr_cache_invalidate(filename);
+  return;
 }
 
 //
-// Read /proc/meminfo
+// Cpus which share a clock are grouped into cpufreq policies (clusters, on big.LITTLE
+// parts, each with its own frequency table and governor).  Modern kernels have a
+// cpufreq/policyN directory for each one; older kernels have a cpuN/cpufreq directory
+// for each cpu, and list the cpus it shares with in related_cpus (or affected_cpus).
+// Tunables are read and written once per policy, rather than once per cpu.
 //
-bool get_proc_meminfo_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/meminfo 2>&1");
+typedef struct {
+  int cpu;			// The first cpu in the policy, which names it.
+  unsigned int cpus;		// Mask of the cpus in the policy.
+  bool modern;			// Whether the policy has a cpufreq/policyN directory.
+} cpufreq_policy_t;
+
+static void policy_directory(cpufreq_policy_t *policy, char *directory) {
+  if (policy->modern) {
+    sprintf(directory, "%s/cpufreq/policy%d", cpudir, policy->cpu);
+  }
+  else {
+    sprintf(directory, "%s/cpu%d/cpufreq", cpudir, policy->cpu);
+  }
 }
 
-//
-// Read /proc/loadavg
-//
-bool get_proc_loadavg_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/loadavg 2>&1");
-}
+static unsigned int policy_cpus(char *directory) {
+  char filename[MAXLINLEN];
+  char text[MAXLINLEN];
 
-//
-// Read omap34xx_temp (Pre & Pre2)
-//
-bool get_omap34xx_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return read_single_integer(lshandle, message, "/sys/devices/platform/omap34xx_temp/temp1_input");
-}
+  sprintf(filename, "%s/related_cpus", directory);
+  if (read_line(filename, text)) return parse_cpu_list(text);
 
-//
-// Read tmp105_temp (Pixi)
-//
-bool get_tmp105_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return read_single_integer(lshandle, message, "/sys/devices/platform/tmp105/celsius");
-}
+  sprintf(filename, "%s/affected_cpus", directory);
+  if (read_line(filename, text)) return parse_cpu_list(text);
 
-//
-// Read a6_temp (Veer, Pre3 & TouchPad)
-//
-bool get_a6_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return read_single_integer(lshandle, message, "/sys/class/misc/a6_0/regs/gettemp");
+  return 0;
 }
 
 //
-// Read current (amps)
+// Find the policies which cover any of the target cpus, in cpu order.
+// A cpu which is not in any policy (such as an offline cpu on an older kernel)
+// is given a policy of its own, at cpuN/cpufreq.
 //
-bool get_battery_current_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-  
+static int cpufreq_policies(cpufreq_policy_t *policies, unsigned int targets) {
   char directory[MAXLINLEN];
   char filename[MAXLINLEN];
-  char battname[MAXLINLEN];
-  
-  sprintf(buffer, "{\"returnValue\": true }");
-
-  DIR *dp = opendir(battdir);
-  if (!dp) {
-    sprintf(buffer, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false }", battdir);
-    // fprintf(stderr, "Message is %s\n", buffer);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  unsigned int covered = 0;
+  int count = 0;
+  int cpu, i, j;
+
+  sprintf(directory, "%s/cpufreq", cpudir);
+  DIR *dp = opendir(directory);
+  if (dp) {
+    struct dirent *ep;
+    while ((ep = readdir(dp)) && (count < MAX_CPUS)) {
+      if ((sscanf(ep->d_name, "policy%d", &cpu) != 1) || (cpu < 0) || (cpu >= MAX_CPUS)) continue;
+      sprintf(filename, "%s/%s", directory, ep->d_name);
+      policies[count].cpu = cpu;
+      policies[count].cpus = policy_cpus(filename) | (1U << cpu);
+      policies[count].modern = true;
+      covered |= policies[count++].cpus;
+    }
+    closedir(dp);
   }
 
-  struct dirent *ep;
+  for (cpu = 0; (cpu < present_cpus()) && (count < MAX_CPUS); cpu++) {
+    if (covered & (1U << cpu)) continue;
+    sprintf(directory, "%s/cpu%d/cpufreq", cpudir, cpu);
+    policies[count].cpu = cpu;
+    policies[count].cpus = policy_cpus(directory) | (1U << cpu);
+    policies[count].modern = false;
+    covered |= policies[count++].cpus;
+  }
 
-  while (ep = readdir(dp)) {
-  
-      /* Find the directory that starts with 32- */
-      if (!strncmp(ep->d_name,"32-",3)) {
-	strcpy(battname, ep->d_name);
-      }
+  // Keep the ones we want, sorted by their first cpu.
+  for (i = 0, j = 0; i < count; i++) {
+    if (policies[i].cpus & targets) policies[j++] = policies[i];
   }
-  
-  if (closedir(dp)) {
-    sprintf(buffer, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    directory);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  count = j;
+
+  for (i = 1; i < count; i++) {
+    cpufreq_policy_t policy = policies[i];
+    for (j = i; (j > 0) && (policies[j-1].cpu > policy.cpu); j--) policies[j] = policies[j-1];
+    policies[j] = policy;
   }
 
-  sprintf(filename, "%s/%s/getcurrent", battdir, battname);
+  return count;
+}
 
-  FILE *fp = fopen(filename, "r");
+//
+// Find the cpufreq directory of the policy which a cpu belongs to.
+//
+static void cpu_policy_directory(int cpu, char *directory) {
+  cpufreq_policy_t policies[MAX_CPUS];
 
-  if (!fp) {
-    sprintf(buffer, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }", filename);
+  if ((cpu >= 0) && (cpu < MAX_CPUS) && cpufreq_policies(policies, 1U << cpu)) {
+    policy_directory(&policies[0], directory);
   }
   else {
-    int value;
-    if (fscanf(fp, "%d", &value) == 1) {
-      sprintf(buffer, "{\"value\": %d, \"returnValue\": true }", value);
-    }
-    else {
-      sprintf(buffer, "{\"errorText\": \"Unable to parse %s\", \"returnValue\": false, \"errorCode\": -1 }", filename);
-    }
-    if (fclose(fp)) {
-      sprintf(buffer, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }", filename);
-    }
+    sprintf(directory, "%s/cpu%d/cpufreq", cpudir, cpu);
   }
-
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;  
 }
 
 //
-// Read current (amps)
+// Request payloads are parsed into a per-request arena, rather than by mjson with
+// malloc, since the trees were never freed and the daemon grew with every poll.
+// The tree has the same json_t shape, so json_find_first_label works on it as
+// usual, but it must never be passed to json_free_value.  Instead the whole arena
+// is reset once the reply has been sent, keeping its first block for the next call.
 //
-bool get_a6_current_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return read_single_integer(lshandle, message, "/sys/class/misc/a6_0/regs/getcurrent");
-}
+#define ARENA_BLOCK_SIZE 4096
+#define JSON_MAX_DEPTH 32
 
-//
-// Read scaling_cur_freq
-//
-bool get_scaling_cur_freq_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+} arena_block_t;
 
-  int cpu = 0;
-  
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+typedef struct {
+  arena_block_t *blocks;
+} arena_t;
 
-  // Extract the governor argument from the message
-  json_t *param = json_find_first_label(object, "cpu");
-  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
-    cpu = atoi(param->child->text);
-  }
+// Allocations are aligned for any of the types we put in them.
+#define ARENA_ALIGN(n) (((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
 
-  if (cpu == 0) {
-    return read_single_integer(lshandle, message, "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq");
-  }
-  else if (is_cpu_online(1)) {
-    return read_single_integer(lshandle, message, "/sys/devices/system/cpu/cpu1/cpufreq/scaling_cur_freq");
-  }
-  else {
-    if (!LSMessageReply(lshandle, message, "{\"value\": 0, \"returnValue\": true}", &lserror)) goto error;
+//
+// Allocate size bytes (zeroed) from an arena.
+//
+static void *arena_alloc(arena_t *a, size_t size) {
+  arena_block_t *block = a->blocks;
+  void *ptr;
+
+  size = ARENA_ALIGN(size);
+
+  if (!block || (block->used + size > block->size)) {
+    size_t len = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+    block = (arena_block_t *)malloc(ARENA_ALIGN(sizeof(arena_block_t)) + len);
+    if (!block) return NULL;
+    block->used = 0;
+    block->size = len;
+    block->next = a->blocks;
+    a->blocks = block;
   }
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  ptr = (char *)block + ARENA_ALIGN(sizeof(arena_block_t)) + block->used;
+  block->used += size;
+  memset(ptr, 0, size);
+
+  return ptr;
 }
 
 //
-// Read scaling_governor
+// Copy len characters of text into an arena, as a null terminated string.
 //
-bool get_scaling_governor_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return read_single_line(lshandle, message, "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor");
+static char *arena_strndup(arena_t *a, const char *text, size_t len) {
+  char *copy = (char *)arena_alloc(a, len + 1);
+  if (!copy) return NULL;
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  return copy;
 }
 
 //
-// Read cpufreq params
+// Release everything allocated from an arena, but keep one ordinary block for reuse.
 //
-bool get_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-  
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
-  char errorText[MAXLINLEN];
-
-  struct stat statbuf;
-  DIR *dp;
+static void arena_reset(arena_t *a) {
+  arena_block_t *block = a->blocks, *next;
+  arena_block_t *keep = NULL;
+
+  while (block) {
+    next = block->next;
+    if (!keep && (block->size == ARENA_BLOCK_SIZE)) {
+      keep = block;
+      keep->used = 0;
+      keep->next = NULL;
+    }
+    else {
+      free(block);
+    }
+    block = next;
+  }
 
-  bool error = false;
-  char *governor = NULL;
-  int cpu = 0;
+  a->blocks = keep;
+}
 
-  sprintf(buffer, "{\"returnValue\": true }");
-  
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+//
+// Release an arena entirely.
+//
+static void arena_free(arena_t *a) {
+  arena_reset(a);
+  free(a->blocks);
+  a->blocks = NULL;
+}
 
-  // Extract the cpu argument from the message
-  json_t *param = json_find_first_label(object, "cpu");
-  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
-    cpu = atoi(param->child->text);
-  }
+static json_t *json_arena_value(arena_t *a, const char **text, int depth);
 
-  // Extract the governor argument from the message
-  param = json_find_first_label(object, "governor");
-  if (param && (param->child->type == JSON_STRING)) {
-    governor = param->child->text;
-  }
+static const char *json_skip_space(const char *text) {
+  while ((*text == ' ') || (*text == '\t') || (*text == '\n') || (*text == '\r')) text++;
+  return text;
+}
 
-  if (governor) {
-    sprintf(directory, "%s/cpufreq/%s", cpudir, governor);
-    dp = opendir (directory);
-    if (!dp) {
-      sprintf(directory, "%s/cpu%d/cpufreq/%s", cpudir, cpu, governor);
-    }
-    else {
-      closedir(dp);
-    }
+//
+// Add a child to the end of a json_t node.
+//
+static void json_arena_append(json_t *parent, json_t *child) {
+  child->parent = parent;
+  if (!parent->child) {
+    parent->child = child;
   }
   else {
-    sprintf(directory, "%s/cpu%d/cpufreq", cpudir, cpu);
+    parent->child_end->next = child;
+    child->previous = parent->child_end;
   }
+  parent->child_end = child;
+}
 
-  // Bring the cpu online
-  if (cpu) bring_cpu_online(cpu);
+//
+// Parse a string, leaving its escapes in place just like mjson does.
+//
+static json_t *json_arena_string(arena_t *a, const char **text) {
+  const char *start = *text + 1, *end = start;
 
-  dp = opendir (directory);
-  if (!dp) {
-    // Don't report an error, since some governors do not have specific parameters.
-    sprintf(buffer, "{\"errorText\": \"Unable to open %s\", \"returnValue\": true }", directory);
-    // fprintf(stderr, "Message is %s\n", buffer);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  while (*end && (*end != '"')) {
+    if ((*end == '\\') && end[1]) end++;
+    end++;
   }
+  if (*end != '"') return NULL;
 
-  struct dirent *ep;
-  bool first = true;
-  sprintf(buffer, "{\"params\": [");
-  
-  while (ep = readdir (dp)) {
-    if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, "..") ||
-	!strcmp(ep->d_name, "stats") || !strcmp(ep->d_name, "affected_cpus") ||
-	!strcmp(ep->d_name, "scaling_driver")) {
-      continue;
-    }
-
-    sprintf(filename, "%s/%s", directory, ep->d_name);
+  json_t *value = (json_t *)arena_alloc(a, sizeof(json_t));
+  if (!value) return NULL;
+  value->type = JSON_STRING;
+  if (!(value->text = arena_strndup(a, start, end - start))) return NULL;
 
-    bool writeable = false;
-    bool directory = false;
+  *text = end + 1;
+  return value;
+}
 
-    if (!stat(filename, &statbuf)) {
-      if (statbuf.st_mode & S_IWUSR) {
-	writeable = true;
-      }
-      if (statbuf.st_mode & S_IFDIR) {
-	directory = true;
-      }
-    }
-      
-    strcpy(line,"");
+//
+// Parse the members of an object or the elements of an array.
+// Object members are labels (strings) whose only child is the member value.
+//
+static json_t *json_arena_container(arena_t *a, const char **text, int depth) {
+  bool object = (**text == '{');
+  char close = object ? '}' : ']';
+
+  json_t *container = (json_t *)arena_alloc(a, sizeof(json_t));
+  if (!container) return NULL;
+  container->type = object ? JSON_OBJECT : JSON_ARRAY;
+
+  *text = json_skip_space(*text + 1);
+  if (**text == close) {
+    (*text)++;
+    return container;
+  }
 
-    if (directory) {
-      // Skip over other directories
-      continue;
+  while (true) {
+    json_t *entry;
+
+    if (object) {
+      if (**text != '"') return NULL;
+      if (!(entry = json_arena_string(a, text))) return NULL;
+      *text = json_skip_space(*text);
+      if (*(*text)++ != ':') return NULL;
+      json_t *value = json_arena_value(a, text, depth + 1);
+      if (!value) return NULL;
+      json_arena_append(entry, value);
     }
     else {
-      FILE *fp = fopen(filename, "r");
-      if (!fp) {
-	sprintf(errorText, "Unable to open %s", filename);
-	error = true;
-      }
-      else {
-	if (!fgets(line, MAXLINLEN-1, fp)) {
-	  sprintf(errorText, "Unable to parse %s", filename);
-	  error = true;
-	}
-	else {
-	  line[strlen(line)-1] = '\0';
-	}
-	if (fclose(fp)) {
-	  sprintf(errorText, "Unable to close %s", filename);
-	  error = true;
-	}
-      }
-	
-      // Special case for unsupported setspeed
-      if (!strcmp(ep->d_name, "scaling_setspeed") && !strcmp(line, "<unsupported>")) {
-	writeable = false;
-      }
+      if (!(entry = json_arena_value(a, text, depth + 1))) return NULL;
+    }
+    json_arena_append(container, entry);
 
-      if (error) {
-	sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
-		errorText);
-	break;
-      }
-      else {
-	sprintf(buffer+strlen(buffer), "%s{\"name\": \"%s\", \"writeable\": %s, \"value\": \"%s\"}",
-		(first ? "" : ", "), ep->d_name, (writeable ? "true" : "false"), json_escape_str(line));
-	first = false;
-      }
+    *text = json_skip_space(*text);
+    if (**text == ',') {
+      *text = json_skip_space(*text + 1);
+      continue;
     }
+    if (*(*text)++ != close) return NULL;
+    return container;
   }
-  if (closedir(dp)) {
-    sprintf(buffer, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    directory);
-    error = true;
-  }
+}
 
-  if (!error) {
-    strcat(buffer, "], \"returnValue\": ");
-    strcat(buffer, error ? "false" : "true");
-    if (governor) {
-      strcat(buffer, ", \"governor\": \"");
-      strcat(buffer, governor);
-      strcat(buffer, "\"");
-    }
-    strcat(buffer, "}");
+//
+// Parse any JSON value.
+//
+static json_t *json_arena_value(arena_t *a, const char **text, int depth) {
+  const char *start;
+  json_t *value;
+
+  if (depth > JSON_MAX_DEPTH) return NULL;
+
+  *text = json_skip_space(*text);
+  start = *text;
+
+  switch (*start) {
+  case '{':
+  case '[':
+    return json_arena_container(a, text, depth);
+  case '"':
+    return json_arena_string(a, text);
+  case 't':
+  case 'f':
+  case 'n':
+    if (!(value = (json_t *)arena_alloc(a, sizeof(json_t)))) return NULL;
+    if (!strncmp(start, "true", 4))       { value->type = JSON_TRUE;  *text += 4; }
+    else if (!strncmp(start, "false", 5)) { value->type = JSON_FALSE; *text += 5; }
+    else if (!strncmp(start, "null", 4))  { value->type = JSON_NULL;  *text += 4; }
+    else return NULL;
+    return value;
+  default:
+    while (strchr("+-0123456789.eE", **text) && **text) (*text)++;
+    if (*text == start) return NULL;
+    if (!(value = (json_t *)arena_alloc(a, sizeof(json_t)))) return NULL;
+    value->type = JSON_NUMBER;
+    if (!(value->text = arena_strndup(a, start, *text - start))) return NULL;
+    return value;
   }
+}
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+//
+// Parse a JSON document into an arena.  Returns NULL if it is not valid JSON.
+//
+static json_t *json_arena_parse(arena_t *a, const char *text) {
+  json_t *document;
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  if (!text) return NULL;
+
+  document = json_arena_value(a, &text, 0);
+  if (!document || *json_skip_space(text)) return NULL;
+
+  return document;
 }
 
 //
-// Write cpufreq params
+// Replies are built in a growable buffer that keeps its length, so appending never
+// rescans the text and large replies are never truncated.  The buffers are kept and
+// reused from call to call, so once warmed up they rarely need to grow again.
 //
-bool set_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+#define REPLY_INITIAL_SIZE MAXBUFLEN
+#define REPLY_KEEP_SIZE (64*1024)
 
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char errorText[MAXLINLEN];
+typedef struct {
+  char *text;
+  size_t len;
+  size_t size;
+  bool failed;
+} reply_t;
 
-  bool error = false;
-  char *governor = NULL;
-  int maxCpu = 0;
-  int i;
-  DIR *dp;
+static char *reply_oom = "{\"errorText\": \"Out of memory\", \"returnValue\": false, \"errorCode\": -1 }";
 
-  sprintf(buffer, "{\"returnValue\": true }");
+//
+// Make room for extra more characters (plus the terminating null).
+// Returns false, and marks the reply as failed, if we run out of memory.
+//
+static bool reply_reserve(reply_t *r, size_t extra) {
+  size_t size = r->size ? r->size : REPLY_INITIAL_SIZE;
+  char *text;
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  if (r->failed) return false;
+  if (r->text && (r->len + extra < r->size)) return true;
 
-  // Extract the maxCpu argument from the message
-  json_t *param = json_find_first_label(object, "maxCpu");
-  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
-    maxCpu = atoi(param->child->text);
-  }
+  while (r->len + extra >= size) size *= 2;
 
-  // Extract the genericParams argument from the message
-  json_t *genericParams = json_find_first_label(object, "genericParams");
-  if (!genericParams || (genericParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array\"}",
-			&lserror)) goto error;
-    return true;
+  text = (char *)realloc(r->text, size);
+  if (!text) {
+    r->failed = true;
+    return false;
   }
+  r->text = text;
+  r->size = size;
 
-  // Extract the governorParams argument from the message
-  json_t *governorParams = json_find_first_label(object, "governorParams");
-  if (!governorParams || (governorParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array\"}",
-			&lserror)) goto error;
-    return true;
-  }
+  return true;
+}
 
-  // Extract the overrideParams argument from the message
-  json_t *overrideParams = json_find_first_label(object, "overrideParams");
-  if (!overrideParams || (overrideParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array\"}",
-			&lserror)) goto error;
-    return true;
+//
+// Empty a reply, ready for reuse.  An unusually large buffer is given back.
+//
+static void reply_reset(reply_t *r) {
+  if (r->size > REPLY_KEEP_SIZE) {
+    free(r->text);
+    r->text = NULL;
+    r->size = 0;
   }
+  r->len = 0;
+  r->failed = false;
+  if (reply_reserve(r, 0)) r->text[0] = '\0';
+}
 
-  if (maxCpu) {
-    // Bring the other CPUs online
-    for (i = 1; i <= maxCpu; i++) {
-      bring_cpu_online(maxCpu);
-    }
-  }
+//
+// Release the buffer of a reply.
+//
+static void reply_free(reply_t *r) {
+  free(r->text);
+  r->text = NULL;
+  r->len = r->size = 0;
+  r->failed = false;
+}
 
-  json_t *genericEntry = genericParams->child->child;
-  while (genericEntry) {
-    if (genericEntry->type != JSON_OBJECT) {
+//
+// The text of a reply, ready to send to webOS.
+//
+static char *reply_text(reply_t *r) {
+  return (r->failed || !r->text) ? reply_oom : r->text;
+}
+
+//
+// Append len characters of data to a reply.
+//
+static bool reply_write(reply_t *r, const char *data, size_t len) {
+  if (!reply_reserve(r, len)) return false;
+
+  memcpy(r->text + r->len, data, len);
+  r->len += len;
+  r->text[r->len] = '\0';
+
+  return true;
+}
+
+//
+// Append a string to a reply.
+//
+static bool reply_append(reply_t *r, const char *str) {
+  return reply_write(r, str, strlen(str));
+}
+
+//
+// Append formatted text to a reply, growing it if the text does not fit.
+//
+static bool reply_vprintf(reply_t *r, const char *format, va_list args) {
+  va_list retry;
+  int len;
+
+  if (!reply_reserve(r, 0)) return false;
+
+  va_copy(retry, args);
+  len = vsnprintf(r->text + r->len, r->size - r->len, format, args);
+  if ((len >= 0) && (r->len + len >= r->size)) {
+    if (reply_reserve(r, len)) {
+      vsnprintf(r->text + r->len, r->size - r->len, format, retry);
+    }
+  }
+  va_end(retry);
+
+  if (len < 0) r->failed = true;
+  if (r->failed) return false;
+
+  r->len += len;
+
+  return true;
+}
+
+static bool reply_printf(reply_t *r, const char *format, ...) {
+  va_list args;
+  bool status;
+
+  va_start(args, format);
+  status = reply_vprintf(r, format, args);
+  va_end(args);
+
+  return status;
+}
+
+//
+// Replace the contents of a reply with formatted text.
+//
+static bool reply_set(reply_t *r, const char *format, ...) {
+  va_list args;
+  bool status;
+
+  reply_reset(r);
+
+  va_start(args, format);
+  status = reply_vprintf(r, format, args);
+  va_end(args);
+
+  return status;
+}
+
+//
+// Append a string to a reply, escaped so that it can be used directly in a JSON string.
+// In general, this means escaping quotes, backslashes and control chars.
+// This is done in one pass, after reserving room for the worst case.
+//
+static bool reply_escape(reply_t *r, const char *str) {
+  const char *json_hex_chars = "0123456789abcdef";
+  size_t len = strlen(str);
+  unsigned char c;
+  char *out;
+
+  // Any character may become a six character \u00XX sequence.
+  if (!reply_reserve(r, len * 6)) return false;
+
+  out = r->text + r->len;
+
+  while ((c = *str++)) {
+    switch (c) {
+    case '\b': *out++ = '\\'; *out++ = 'b';  break;
+    case '\n': *out++ = '\\'; *out++ = 'n';  break;
+    case '\r': *out++ = '\\'; *out++ = 'r';  break;
+    case '\t': *out++ = '\\'; *out++ = 't';  break;
+    case '"':  *out++ = '\\'; *out++ = '"';  break;
+    case '\\': *out++ = '\\'; *out++ = '\\'; break;
+    default:
+      // Insert a normalised representation of "special" characters
+      if ((c < ' ') || (c > 127)) {
+	*out++ = '\\'; *out++ = 'u'; *out++ = '0'; *out++ = '0';
+	*out++ = json_hex_chars[c >> 4];
+	*out++ = json_hex_chars[c & 0xf];
+      }
+      else {
+	*out++ = c;
+      }
+    }
+  }
+
+  *out = '\0';
+  r->len = out - r->text;
+
+  return true;
+}
+
+//
+// We reuse static reply buffers instead of continually allocating and deallocating
+// stuff, since we're a long-running service, and do not want to leak anything.
+// These are only used from the main loop; worker threads use their request's reply.
+//
+static reply_t buffer;
+static reply_t run_command_buffer;
+static arena_t payload_arena;
+
+//
+// Parse the payload of a message that is handled directly on the main loop.
+// The tree is only valid until the next call, when the arena is reset.
+//
+static json_t *parse_payload(LSMessage *message) {
+  arena_reset(&payload_arena);
+  return json_arena_parse(&payload_arena, LSMessageGetPayload(message));
+}
+
+//
+// Replies for static and slow-changing system data (the machine name, kernel version,
+// cpuinfo, the available schedulers and so on) are cached, keyed by method and arguments,
+// each with its own time to live.  Methods which change the underlying data invalidate
+// the entries that depend on it.  The cache is only used from the main loop.
+//
+#define CACHE_ENTRIES 16
+#define CACHE_FOREVER ((guint)-1)
+
+typedef struct {
+  char *key;
+  char *text;
+  gint64 stored;
+  gint64 expires;		// Milliseconds of monotonic time, or 0 for never.
+} cache_entry_t;
+
+static cache_entry_t cache_entries[CACHE_ENTRIES];
+
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_invalidations = 0;
+
+// Bumped by every invalidation, so that a read which was already in progress when the
+// data changed does not put its stale result back into the cache.
+static guint cache_generation = 0;
+
+static void cache_drop(cache_entry_t *entry) {
+  free(entry->key);
+  free(entry->text);
+  memset(entry, 0, sizeof(cache_entry_t));
+}
+
+//
+// Return the cached reply for a key, or NULL if there is none (or it has expired).
+//
+static char *cache_lookup(char *key) {
+  gint64 now = g_get_monotonic_time() / 1000;
+  int i;
+
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    cache_entry_t *entry = &cache_entries[i];
+    if (!entry->key || strcmp(entry->key, key)) continue;
+    if (entry->expires && (now >= entry->expires)) {
+      cache_drop(entry);
+      break;
+    }
+    cache_hits++;
+    return entry->text;
+  }
+
+  cache_misses++;
+  return NULL;
+}
+
+//
+// Store a reply for a key, replacing the oldest entry if the cache is full.
+// The ttl is in seconds.  Returns the cached copy, or NULL if there is no memory.
+//
+static char *cache_store(char *key, char *text, guint ttl) {
+  gint64 now = g_get_monotonic_time() / 1000;
+  cache_entry_t *slot = NULL;
+  int i;
+
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    cache_entry_t *entry = &cache_entries[i];
+    if (entry->key && !strcmp(entry->key, key)) {
+      slot = entry;
+      break;
+    }
+    if (!slot || (slot->key && (!entry->key || (entry->stored < slot->stored)))) {
+      slot = entry;
+    }
+  }
+
+  cache_drop(slot);
+
+  slot->key = strdup(key);
+  slot->text = strdup(text);
+  if (!slot->key || !slot->text) {
+    cache_drop(slot);
+    return NULL;
+  }
+
+  slot->stored = now;
+  slot->expires = (ttl == CACHE_FOREVER) ? 0 : now + (gint64)ttl * 1000;
+
+  return slot->text;
+}
+
+//
+// Forget the cached reply for a key, after the data behind it has been changed.
+//
+static void cache_invalidate(char *key) {
+  int i;
+
+  cache_generation++;
+
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    if (cache_entries[i].key && !strcmp(cache_entries[i].key, key)) {
+      cache_drop(&cache_entries[i]);
+      cache_invalidations++;
+    }
+  }
+}
+
+//
+// Blocking sysfs and procfs reads and writes (which can stall on cpu hotplug or a
+// slow driver) are run on a small pool of worker threads, so they never hold up
+// the main loop.  Each request carries its own reply buffers, and the reply is sent
+// from the main loop once the work is done, since the luna bus is not thread safe.
+// Work which changes anything (every set, stick, unstick and apply method) goes to
+// a single writer thread instead, so changes are made one at a time and in the order
+// they arrived, and a slow write can never be overtaken by a later one.
+//
+#define WORKER_THREADS 4
+
+typedef struct request request_t;
+
+typedef void (*request_func)(request_t *req);
+
+struct request {
+  LSHandle *lshandle;
+  LSMessage *message;
+  json_t *object;
+  request_func work;
+  request_func done;
+  char *file;
+  char *invalidate;
+  guint cache_ttl;
+  guint cache_generation;
+  unsigned int fields;
+  bool subscribed;
+  bool serial;
+  bool threaded;
+  bool sending;
+  gint64 time;
+  reply_t reply;
+  arena_t arena;
+};
+
+static GThreadPool *workers = NULL;
+static GThreadPool *writer = NULL;
+
+// Finished requests are kept for reuse, along with their (already grown) reply buffers.
+// Requests are only allocated and released on the main loop, so this needs no locking.
+#define REQUEST_SPARES 8
+
+static request_t *request_spares[REQUEST_SPARES];
+static int request_spare_count = 0;
+
+//
+// Allocate a request for a message, holding a reference to it until the reply is sent.
+// The message may be NULL, for internal work such as the telemetry sampler.
+//
+static request_t *request_new(LSHandle *lshandle, LSMessage *message, request_func work) {
+  request_t *req;
+  reply_t reply;
+  arena_t arena;
+
+  if (request_spare_count) {
+    req = request_spares[--request_spare_count];
+  }
+  else {
+    req = (request_t *)calloc(1, sizeof(request_t));
+    if (!req) return NULL;
+  }
+
+  reply = req->reply;
+  arena = req->arena;
+  memset(req, 0, sizeof(request_t));
+  req->reply = reply;
+  req->arena = arena;
+
+  req->lshandle = lshandle;
+  req->message = message;
+  req->work = work;
+
+  if (message) {
+    LSMessageRef(message);
+    req->object = json_arena_parse(&req->arena, LSMessageGetPayload(message));
+  }
+
+  reply_set(&req->reply, "{\"returnValue\": true }");
+
+  return req;
+}
+
+//
+// Send the reply for a finished request (or hand it to its done function) from the
+// main loop, and release it.
+//
+static gboolean request_done(gpointer data) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  request_t *req = (request_t *)data;
+
+  if (req->invalidate) {
+    cache_invalidate(req->invalidate);
+  }
+
+  if (req->cache_ttl && (req->cache_generation == cache_generation) && !req->reply.failed) {
+    (void)cache_store(req->file, reply_text(&req->reply), req->cache_ttl);
+  }
+
+  if (req->done) {
+    req->done(req);
+  }
+  else if (req->message) {
+    // fprintf(stderr, "Message is %s\n", reply_text(&req->reply));
+    if (!LSMessageReply(req->lshandle, req->message, reply_text(&req->reply), &lserror)) {
+      LSErrorPrint(&lserror, stderr);
+      LSErrorFree(&lserror);
+    }
+  }
+
+  if (req->message) LSMessageUnref(req->message);
+  if (request_spare_count < REQUEST_SPARES) {
+    reply_reset(&req->reply);
+    arena_reset(&req->arena);
+    request_spares[request_spare_count++] = req;
+  }
+  else {
+    reply_free(&req->reply);
+    arena_free(&req->arena);
+    free(req);
+  }
+
+  return FALSE;
+}
+
+//
+// An intermediate reply, on its way from a worker thread to the main loop.
+//
+typedef struct {
+  request_t *req;
+  char *text;
+} partial_t;
+
+// Signalled as each intermediate reply is sent, for a worker waiting to send the next.
+static pthread_mutex_t partial_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t partial_sent = PTHREAD_COND_INITIALIZER;
+
+static gboolean partial_send(gpointer data) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  partial_t *partial = (partial_t *)data;
+  request_t *req = partial->req;
+
+  if (!LSMessageReply(req->lshandle, req->message, partial->text, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+  }
+
+  free(partial->text);
+  free(partial);
+
+  pthread_mutex_lock(&partial_lock);
+  req->sending = false;
+  pthread_cond_broadcast(&partial_sent);
+  pthread_mutex_unlock(&partial_lock);
+
+  return FALSE;
+}
+
+//
+// Send the reply built so far as an intermediate message (such as one chunk of a
+// large file), leaving the request free to build the next one.  Only one intermediate
+// reply is in flight at a time: a worker waits here until the main loop has sent the
+// previous one, so a slow main loop holds up the reader rather than piling up copies.
+// Intermediate replies are queued on the main loop ahead of the final one, so they
+// arrive in order, and the request keeps its reference on the message until they have
+// all been sent.  Returns false (and nothing is sent) if we run out of memory, in
+// which case the caller must end the request with an error.
+//
+static bool request_send(request_t *req) {
+  partial_t *partial;
+
+  // A request being run inline on the main loop can not wait for it.
+  if (req->threaded) {
+    pthread_mutex_lock(&partial_lock);
+    while (req->sending) pthread_cond_wait(&partial_sent, &partial_lock);
+    pthread_mutex_unlock(&partial_lock);
+  }
+
+  if (req->reply.failed || !(partial = (partial_t *)malloc(sizeof(partial_t)))) {
+    reply_reset(&req->reply);
+    return false;
+  }
+  if (!(partial->text = strdup(reply_text(&req->reply)))) {
+    free(partial);
+    reply_reset(&req->reply);
+    return false;
+  }
+
+  partial->req = req;
+  req->sending = true;
+  g_idle_add(partial_send, partial);
+
+  reply_reset(&req->reply);
+  return true;
+}
+
+//
+// Worker thread body: do the blocking part of a request, then pass it back to the main loop.
+//
+static void request_worker(gpointer data, gpointer user_data) {
+  request_t *req = (request_t *)data;
+
+  req->threaded = true;
+  req->work(req);
+
+  g_idle_add(request_done, req);
+}
+
+//
+// Start the worker pool and the writer thread.  If threads are not available,
+// requests are run inline.
+//
+static void request_init(void) {
+  GError *error = NULL;
+
+  workers = g_thread_pool_new(request_worker, NULL, WORKER_THREADS, FALSE, &error);
+  if (!workers) {
+    fprintf(stderr, "Unable to start worker threads: %s\n", error ? error->message : "unknown error");
+    if (error) g_error_free(error);
+    error = NULL;
+  }
+
+  writer = g_thread_pool_new(request_worker, NULL, 1, FALSE, &error);
+  if (!writer) {
+    fprintf(stderr, "Unable to start writer thread: %s\n", error ? error->message : "unknown error");
+    if (error) g_error_free(error);
+  }
+}
+
+//
+// Hand a request to the worker pool (or to the writer thread, for serial work), or run
+// it inline if that is not running.
+//
+static void request_queue(request_t *req) {
+  GThreadPool *pool = req->serial ? writer : workers;
+  GError *error = NULL;
+
+  if (pool) {
+    g_thread_pool_push(pool, req, &error);
+    if (!error) return;
+    fprintf(stderr, "Unable to queue request: %s\n", error->message);
+    g_error_free(error);
+  }
+
+  // Still reply from the main loop, so that any intermediate replies go first.
+  req->work(req);
+  g_idle_add(request_done, req);
+}
+
+//
+// Allocate a request for a message, or reply that we are out of memory.
+//
+static request_t *request_prepare(LSHandle* lshandle, LSMessage *message, request_func work, char *file) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  request_t *req = request_new(lshandle, message, work);
+  if (!req) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}",
+			&lserror)) {
+      LSErrorPrint(&lserror, stderr);
+      LSErrorFree(&lserror);
+    }
+    return NULL;
+  }
+
+  req->file = file;
+
+  return req;
+}
+
+//
+// Queue work for a message, optionally on a single file.
+// Called directly from webOS, and the reply is sent when the work completes.
+//
+static bool queue_request(LSHandle* lshandle, LSMessage *message, request_func work, char *file) {
+  request_t *req = request_prepare(lshandle, message, work, file);
+  if (req) request_queue(req);
+
+  return true;
+}
+
+//
+// Queue work which changes things on the writer thread, behind any earlier changes,
+// and invalidate any cached reply for file (if not NULL) once the work is done.
+//
+static bool queue_write_request(LSHandle* lshandle, LSMessage *message, request_func work, char *file) {
+  request_t *req = request_prepare(lshandle, message, work, file);
+  if (req) {
+    req->invalidate = file;
+    req->serial = true;
+    request_queue(req);
+  }
+
+  return true;
+}
+
+//
+// A dummy method, useful for unimplemented functions or as a status function.
+// Called directly from webOS, and returns directly to webOS.
+//
+bool dummy_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  if (!LSMessageReply(lshandle, message, "{\"returnValue\": true}", &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Send a standard format command failure message back to webOS.
+// The command will be escaped.  The output argument should be a JSON array and is not escaped.
+// The additional text  will not be escaped.
+// The return value is from the LSMessageReply call, not related to the command execution.
+//
+static bool report_command_failure(LSHandle* lshandle, LSMessage *message, char *command, char *stdErrText, char *additional) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  // Include the command that was executed, in escaped form.
+  reply_set(&buffer, "{\"errorText\": \"Unable to run command: ");
+  reply_escape(&buffer, command);
+  reply_append(&buffer, "\"");
+
+  // Include any stderr fields from the command.
+  if (stdErrText) {
+    reply_append(&buffer, ", \"stdErr\": ");
+    reply_append(&buffer, stdErrText);
+  }
+
+  // Report that an error occurred.
+  reply_append(&buffer, ", \"returnValue\": false, \"errorCode\": -1");
+
+  // Add any additional JSON fields.
+  if (additional) {
+    reply_append(&buffer, ", ");
+    reply_append(&buffer, additional);
+  }
+
+  // Terminate the JSON reply message ...
+  reply_append(&buffer, "}");
+
+  // fprintf(stderr, "Message is %s\n", reply_text(&buffer));
+
+  // and send it.
+  if (!LSMessageReply(lshandle, message, reply_text(&buffer), &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Append one line to a reply as an escaped JSON array element.
+//
+static bool append_line(reply_t *out, char *line, bool *first) {
+  if (!*first && !reply_append(out, ", ")) return false;
+  *first = false;
+
+  return (reply_append(out, "\"") && reply_escape(out, line) && reply_append(out, "\""));
+}
+
+//
+// Lines are split out of each chunk read from a file just like fgets would do it,
+// breaking over-long lines, and carrying a partial line over to the next chunk.
+//
+typedef struct {
+  char line[MAXLINLEN];
+  int len;
+  bool first;
+} lines_t;
+
+//
+// Append every complete line in a chunk to a reply as an escaped JSON array element.
+//
+static bool append_lines(reply_t *out, lines_t *lines, char *chunk, ssize_t count) {
+  bool status = true;
+  int i;
+
+  for (i = 0; status && (i < count); i++) {
+    if (chunk[i] == '\n') {
+      lines->line[lines->len] = '\0';
+      status = append_line(out, lines->line, &lines->first);
+      lines->len = 0;
+      continue;
+    }
+    if (lines->len == MAXLINLEN-1) {
+      lines->line[lines->len] = '\0';
+      status = append_line(out, lines->line, &lines->first);
+      lines->len = 0;
+    }
+    lines->line[lines->len++] = chunk[i];
+  }
+
+  return status;
+}
+
+//
+// Don't lose a final line without a newline.
+//
+static bool append_last_line(reply_t *out, lines_t *lines) {
+  if (!lines->len) return true;
+
+  lines->line[lines->len] = '\0';
+  lines->len = 0;
+
+  return append_line(out, lines->line, &lines->first);
+}
+
+//
+// Read a file directly, without forking a shell and /bin/cat, and append each line to
+// the out reply as an escaped JSON string, one array element per line.
+// The out reply must be initialised before calling this function.
+// If errorText is not NULL, it is filled in with the reason for any failure.
+//
+static bool read_file(reply_t *out, char *file, char *errorText) {
+  char chunk[CHUNKSIZE];
+  lines_t lines;
+  bool status = true;
+  ssize_t count = 0;
+
+  lines.len = 0;
+  lines.first = true;
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    if (errorText) sprintf(errorText, "Unable to open %s", file);
+    return false;
+  }
+
+  while (status && (count = read(fd, chunk, sizeof chunk))) {
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if (errorText) sprintf(errorText, "Unable to read %s", file);
+      status = false;
+      break;
+    }
+
+    status = append_lines(out, &lines, chunk, count);
+  }
+
+  if (status) status = append_last_line(out, &lines);
+
+  if (!status && (count >= 0)) {
+    if (errorText) sprintf(errorText, "Out of memory reading %s", file);
+  }
+
+  if (close(fd)) {
+    if (errorText) sprintf(errorText, "Unable to close %s", file);
+    status = false;
+  }
+
+  return status;
+}
+
+//
+// Read a small procfs, sysfs or config file into the reply for a request.
+//
+static void reply_file(request_t *req, char *file) {
+  char errorText[MAXLINLEN];
+
+  // Initialise the output buffer
+  reply_set(&req->reply, "{\"stdOut\": [");
+
+  // Read the file, and finalise the message
+  if (read_file(&req->reply, file, errorText)) {
+    reply_append(&req->reply, "], \"returnValue\": true}");
+  }
+  else {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }", errorText);
+    // Don't cache failures.
+    req->cache_ttl = 0;
+  }
+}
+
+static void simple_file_work(request_t *req) {
+  reply_file(req, req->file);
+}
+
+//
+// Send the lines read so far as one numbered chunk.  Returns false if it could not be sent.
+//
+static bool send_chunk(request_t *req, lines_t *lines, int chunk, char *data, ssize_t count) {
+  lines->first = true;
+
+  reply_set(&req->reply, "{\"chunk\": %d, \"stdOut\": [", chunk);
+  if (data) {
+    append_lines(&req->reply, lines, data, count);
+  }
+  else {
+    append_last_line(&req->reply, lines);
+  }
+  reply_append(&req->reply, "], \"subscribed\": true, \"returnValue\": true}");
+
+  return request_send(req);
+}
+
+//
+// Read a file in CHUNKSIZE pieces, sending the complete lines of each piece as soon
+// as it is read, so the first lines arrive sooner.  Memory use stays bounded, since
+// each chunk waits for the one before it to be sent (see request_send).
+// The final reply gives the number of chunks that were sent.
+//
+static void chunked_file_work(request_t *req) {
+  char chunk[CHUNKSIZE];
+  lines_t lines;
+  ssize_t count;
+  int chunks = 0;
+  bool sent = true;
+
+  lines.len = 0;
+
+  int fd = open(req->file, O_RDONLY);
+  if (fd < 0) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }", req->file);
+    return;
+  }
+
+  while ((count = read(fd, chunk, sizeof chunk))) {
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!(sent = send_chunk(req, &lines, ++chunks, chunk, count))) break;
+  }
+
+  if (sent && (count == 0) && lines.len) {
+    sent = send_chunk(req, &lines, ++chunks, NULL, 0);
+  }
+
+  if (!sent) {
+    reply_set(&req->reply, "{\"errorText\": \"Out of memory sending chunk %d of %s\", \"chunks\": %d, \"returnValue\": false, \"errorCode\": -1 }",
+	      chunks, req->file, chunks - 1);
+  }
+  else if (count < 0) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to read %s\", \"chunks\": %d, \"returnValue\": false, \"errorCode\": -1 }",
+	      req->file, chunks);
+  }
+  else if (close(fd)) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to close %s\", \"chunks\": %d, \"returnValue\": false, \"errorCode\": -1 }",
+	      req->file, chunks);
+    return;
+  }
+  else {
+    reply_set(&req->reply, "{\"chunks\": %d, \"subscribed\": false, \"returnValue\": true}", chunks);
+    return;
+  }
+
+  close(fd);
+}
+
+//
+// Read a small procfs, sysfs or config file, and return the lines to webOS.
+// If the caller subscribes, the file is streamed back in numbered chunks instead.
+//
+static bool simple_file(LSHandle* lshandle, LSMessage *message, char *file) {
+  if (LSMessageIsSubscription(message)) {
+    return queue_request(lshandle, message, chunked_file_work, file);
+  }
+  return queue_request(lshandle, message, simple_file_work, file);
+}
+
+//
+// Read a small file which rarely changes, replying from the cache when we can.
+// The ttl is in seconds, or CACHE_FOREVER.
+//
+static bool cached_file(LSHandle* lshandle, LSMessage *message, char *file, guint ttl) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  if (LSMessageIsSubscription(message)) {
+    return simple_file(lshandle, message, file);
+  }
+
+  char *text = cache_lookup(file);
+  if (text) {
+    if (!LSMessageReply(lshandle, message, text, &lserror)) goto error;
+    return true;
+  }
+
+  request_t *req = request_prepare(lshandle, message, simple_file_work, file);
+  if (req) {
+    req->cache_ttl = ttl;
+    req->cache_generation = cache_generation;
+    request_queue(req);
+  }
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// The kernel release never changes while we are running, so it is only asked for once,
+// at startup, and can then be read from any thread.
+//
+static struct utsname kernel;
+static bool kernel_known = false;
+
+static void kernel_init(void) {
+  kernel_known = !uname(&kernel);
+}
+
+static char *kernel_release(void) {
+  return kernel_known ? kernel.release : NULL;
+}
+
+//
+// Slow command chains (such as reconfiguring compcache) are run as jobs, one step
+// at a time, from child watches on the main loop, so they never block other calls.
+// The original message is answered when the chain completes or a step fails, and
+// if it was a subscription it is also sent a progress message as each step starts.
+//
+#define JOB_MAX 4
+#define JOB_MAX_STEPS 8
+#define JOB_MAX_ARGS 16
+
+typedef struct {
+  LSHandle *lshandle;
+  LSMessage *message;
+  char commands[JOB_MAX_STEPS][MAXLINLEN];
+  guint delays[JOB_MAX_STEPS];
+  int steps;
+  int current;
+  GPid pid;
+  int out_fd;
+  bool exited;
+  int status;
+  char output[MAXBUFLEN];
+  size_t output_len;
+} job_t;
+
+static job_t *jobs[JOB_MAX];
+
+static void job_step(job_t *job);
+
+//
+// Create a job to answer message, or return NULL if too many jobs are running.
+//
+static job_t *job_new(LSHandle* lshandle, LSMessage *message) {
+  int i;
+
+  for (i = 0; i < JOB_MAX; i++) {
+    if (!jobs[i]) break;
+  }
+  if (i == JOB_MAX) return NULL;
+
+  job_t *job = g_new0(job_t, 1);
+  job->lshandle = lshandle;
+  job->message = message;
+  job->out_fd = -1;
+  LSMessageRef(message);
+  jobs[i] = job;
+
+  return job;
+}
+
+//
+// Is any job running?
+//
+static bool job_busy(void) {
+  int i;
+
+  for (i = 0; i < JOB_MAX; i++) {
+    if (jobs[i]) return true;
+  }
+  return false;
+}
+
+//
+// Add a command step to a job.  Arguments are separated by single spaces.
+//
+static void job_command(job_t *job, const char *format, ...) {
+  va_list args;
+
+  if (job->steps == JOB_MAX_STEPS) return;
+
+  va_start(args, format);
+  vsnprintf(job->commands[job->steps], MAXLINLEN, format, args);
+  va_end(args);
+  job->delays[job->steps] = 0;
+  job->steps++;
+}
+
+//
+// Add a pause (in milliseconds) to a job, without needing to run /bin/sleep.
+//
+static void job_delay(job_t *job, guint delay) {
+  if (job->steps == JOB_MAX_STEPS) return;
+
+  sprintf(job->commands[job->steps], "sleep %d", (delay + 999) / 1000);
+  job->delays[job->steps] = delay;
+  job->steps++;
+}
+
+//
+// Send the final reply for a job (success, or the failure of the current step), and free it.
+//
+static void job_finish(job_t *job, bool success, char *errorText) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  bool first = true;
+  int i;
+
+  if (success) {
+    if (!LSMessageReply(job->lshandle, job->message, "{\"returnValue\": true}", &lserror)) goto error;
+  }
+  else {
+    // Format the output of the failed step as a JSON array of lines.
+    reply_set(&run_command_buffer, "[");
+    job->output[job->output_len] = '\0';
+    char *line = strtok(job->output, "\n");
+    while (line) {
+      append_line(&run_command_buffer, line, &first);
+      line = strtok(NULL, "\n");
+    }
+    if (errorText) append_line(&run_command_buffer, errorText, &first);
+    reply_append(&run_command_buffer, "]");
+    if (!report_command_failure(job->lshandle, job->message, job->commands[job->current],
+				reply_text(&run_command_buffer), NULL)) goto end;
+  }
+
+ end:
+  for (i = 0; i < JOB_MAX; i++) {
+    if (jobs[i] == job) jobs[i] = NULL;
+  }
+  LSMessageUnref(job->message);
+  g_free(job);
+  return;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  goto end;
+}
+
+//
+// Move on to the next step once the current one has both exited and closed its output.
+//
+static void job_step_done(job_t *job) {
+  if (!job->exited || (job->out_fd >= 0)) return;
+
+  if (!WIFEXITED(job->status) || WEXITSTATUS(job->status)) {
+    job_finish(job, false, NULL);
+    return;
+  }
+
+  job->current++;
+  job_step(job);
+}
+
+//
+// Child watch: the current step has exited.
+//
+static void job_exited(GPid pid, gint status, gpointer data) {
+  job_t *job = (job_t *)data;
+
+  g_spawn_close_pid(pid);
+  job->exited = true;
+  job->status = status;
+  job_step_done(job);
+}
+
+//
+// Output watch: collect what the current step prints, until it closes its output.
+//
+static gboolean job_output(GIOChannel *source, GIOCondition condition, gpointer data) {
+  job_t *job = (job_t *)data;
+  char chunk[MAXLINLEN];
+  ssize_t len;
+
+  len = read(job->out_fd, chunk, sizeof chunk);
+  if ((len < 0) && (errno == EINTR)) return TRUE;
+
+  if (len > 0) {
+    if (job->output_len + len >= MAXBUFLEN) len = MAXBUFLEN - 1 - job->output_len;
+    memcpy(job->output + job->output_len, chunk, len);
+    job->output_len += len;
+    return TRUE;
+  }
+
+  close(job->out_fd);
+  job->out_fd = -1;
+  job_step_done(job);
+  return FALSE;
+}
+
+//
+// Timeout: a pause step has elapsed.
+//
+static gboolean job_delay_done(gpointer data) {
+  job_t *job = (job_t *)data;
+
+  job->current++;
+  job_step(job);
+  return FALSE;
+}
+
+//
+// Send stderr to the same pipe as stdout in the child, like 2>&1 did.
+//
+static void job_child_setup(gpointer data) {
+  dup2(1, 2);
+}
+
+//
+// Start the current step of a job, or finish the job if there are none left.
+//
+static void job_step(job_t *job) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  char command[MAXLINLEN];
+  char *argv[JOB_MAX_ARGS];
+  GError *gerror = NULL;
+  int argc = 0;
+
+  if (job->current == job->steps) {
+    job_finish(job, true, NULL);
+    return;
+  }
+
+  if (LSMessageIsSubscription(job->message)) {
+    reply_set(&buffer, "{\"step\": %d, \"steps\": %d, \"command\": \"", job->current + 1, job->steps);
+    reply_escape(&buffer, job->commands[job->current]);
+    reply_append(&buffer, "\", \"subscribed\": true, \"returnValue\": true}");
+    if (!LSMessageReply(job->lshandle, job->message, reply_text(&buffer), &lserror)) {
+      LSErrorPrint(&lserror, stderr);
+      LSErrorFree(&lserror);
+    }
+  }
+
+  if (job->delays[job->current]) {
+    g_timeout_add(job->delays[job->current], job_delay_done, job);
+    return;
+  }
+
+  // Split the command into arguments.
+  strcpy(command, job->commands[job->current]);
+  char *arg = strtok(command, " ");
+  while (arg && (argc < JOB_MAX_ARGS - 1)) {
+    argv[argc++] = arg;
+    arg = strtok(NULL, " ");
+  }
+  argv[argc] = NULL;
+
+  job->exited = false;
+  job->output_len = 0;
+
+  if (!g_spawn_async_with_pipes(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+				job_child_setup, NULL, &job->pid, NULL, &job->out_fd, NULL, &gerror)) {
+    job_finish(job, false, gerror ? gerror->message : "Unable to start command");
+    if (gerror) g_error_free(gerror);
+    return;
+  }
+
+  GIOChannel *channel = g_io_channel_unix_new(job->out_fd);
+  g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, job_output, job);
+  g_io_channel_unref(channel);
+
+  g_child_watch_add(job->pid, job_exited, job);
+}
+
+//
+// Start running a job.  The reply is sent when it completes.
+//
+static void job_start(job_t *job) {
+  job->current = 0;
+  job_step(job);
+}
+
+//
+// Read a single string from a file into the reply for a request.
+//
+static void reply_single_line(request_t *req, char *file) {
+  char line[MAXLINLEN];
+
+  // fprintf(stderr, "Reading from %s\n", file);
+
+  FILE *fp = fopen(file, "r");
+
+  if (!fp) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
+  }
+  else {
+    if (fgets(line, MAXLINLEN-1, fp)) {
+      reply_set(&req->reply, "{\"value\": \"");
+      reply_escape(&req->reply, line);
+      reply_append(&req->reply, "\", \"returnValue\": true }");
+    }
+    else {
+      reply_set(&req->reply, "{\"errorText\": \"Unable to parse %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
+    }
+    if (fclose(fp)) {
+      reply_set(&req->reply, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }", file);
+    }
+  }
+}
+
+//
+// Read a single integer from a hot sysfs attribute, through the descriptor cache.
+// If errorText is not NULL, it is filled in with the reason for any failure.
+//
+static bool read_integer(char *file, int *value, char *errorText) {
+  char text[MAXNUMLEN];
+
+  if (attr_read(file, text, sizeof text) < 0) {
+    if (errorText) sprintf(errorText, "Unable to open %s", file);
+    return false;
+  }
+
+  if (!parse_integer(text, value)) {
+    if (errorText) sprintf(errorText, "Unable to parse %s", file);
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Read a single integer from a file into the reply for a request.
+//
+static void reply_single_integer(request_t *req, char *file) {
+  char errorText[MAXLINLEN];
+  int value;
+
+  // fprintf(stderr, "Reading from %s\n", file);
+
+  if (read_integer(file, &value, errorText)) {
+    reply_set(&req->reply, "{\"value\": %d, \"returnValue\": true }", value);
+  }
+  else {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }", errorText);
+  }
+}
+
+static void read_single_integer_work(request_t *req) {
+  reply_single_integer(req, req->file);
+}
+
+//
+// Read a single integer from a file, and return it to webOS.
+//
+static bool read_single_integer(LSHandle* lshandle, LSMessage *message, char *file) {
+  return queue_request(lshandle, message, read_single_integer_work, file);
+}
+
+//
+// Get the machine name, and return the output to webOS.
+//
+bool get_machine_name_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return cached_file(lshandle, message, "/etc/prefs/properties/machineName", 60);
+}
+
+//
+// Read /proc/version
+//
+bool get_proc_version_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return cached_file(lshandle, message, "/proc/version", CACHE_FOREVER);
+}
+
+//
+// Read /proc/cpuinfo
+//
+bool get_proc_cpuinfo_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return cached_file(lshandle, message, "/proc/cpuinfo", 10);
+}
+
+//
+// Read /proc/meminfo
+//
+bool get_proc_meminfo_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return simple_file(lshandle, message, "/proc/meminfo");
+}
+
+//
+// Read /proc/loadavg
+//
+bool get_proc_loadavg_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return simple_file(lshandle, message, "/proc/loadavg");
+}
+
+//
+// Read omap34xx_temp (Pre & Pre2)
+//
+bool get_omap34xx_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return read_single_integer(lshandle, message, "/sys/devices/platform/omap34xx_temp/temp1_input");
+}
+
+//
+// Read tmp105_temp (Pixi)
+//
+bool get_tmp105_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return read_single_integer(lshandle, message, "/sys/devices/platform/tmp105/celsius");
+}
+
+//
+// Read a6_temp (Veer, Pre3 & TouchPad)
+//
+bool get_a6_temp_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return read_single_integer(lshandle, message, "/sys/class/misc/a6_0/regs/gettemp");
+}
+
+//
+// Read the battery current (amps) from the w1 battery gauge.
+// If errorText is not NULL, it is filled in with the reason for any failure.
+//
+static bool read_battery_current(int *value, char *errorText) {
+  static char battfile[MAXLINLEN];
+  char filename[MAXLINLEN];
+  char battname[MAXLINLEN];
+
+  pthread_mutex_lock(&attr_lock);
+  strcpy(filename, battfile);
+  pthread_mutex_unlock(&attr_lock);
+
+  // Only scan for the battery again if it has gone away.
+  if (filename[0] && read_integer(filename, value, NULL)) return true;
+
+  strcpy(battname, "");
+
+  DIR *dp = opendir(battdir);
+  if (!dp) {
+    if (errorText) sprintf(errorText, "Unable to open %s", battdir);
+    return false;
+  }
+
+  struct dirent *ep;
+
+  while (ep = readdir(dp)) {
+  
+      /* Find the directory that starts with 32- */
+      if (!strncmp(ep->d_name,"32-",3)) {
+	strcpy(battname, ep->d_name);
+      }
+  }
+  
+  if (closedir(dp)) {
+    if (errorText) sprintf(errorText, "Unable to close %s", battdir);
+    return false;
+  }
+
+  if (!battname[0]) {
+    if (errorText) sprintf(errorText, "Unable to find battery in %s", battdir);
+    return false;
+  }
+
+  sprintf(filename, "%s/%s/getcurrent", battdir, battname);
+
+  if (!read_integer(filename, value, errorText)) return false;
+
+  pthread_mutex_lock(&attr_lock);
+  strcpy(battfile, filename);
+  pthread_mutex_unlock(&attr_lock);
+
+  return true;
+}
+
+static void get_battery_current_work(request_t *req) {
+  char errorText[MAXLINLEN];
+  int value;
+
+  if (read_battery_current(&value, errorText)) {
+    reply_set(&req->reply, "{\"value\": %d, \"returnValue\": true }", value);
+  }
+  else {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }", errorText);
+  }
+}
+
+//
+// Read current (amps)
+//
+bool get_battery_current_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_battery_current_work, NULL);
+}
+
+//
+// Read current (amps)
+//
+bool get_a6_current_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return read_single_integer(lshandle, message, "/sys/class/misc/a6_0/regs/getcurrent");
+}
+
+static void append_cpu_freqs(reply_t *out);
+static void append_cpu_online(reply_t *out);
+static void append_time_in_state(reply_t *out);
+
+static void get_scaling_cur_freq_work(request_t *req) {
+  char filename[MAXLINLEN];
+  int cpu = 0;
+
+  // Extract the cpu argument from the message
+  json_t *param = json_find_first_label(req->object, "cpu");
+  if (!param) {
+    // Without a cpu argument, return every cpu in one reply.
+    reply_set(&req->reply, "{");
+    append_cpu_freqs(&req->reply);
+    reply_append(&req->reply, ", ");
+    append_cpu_online(&req->reply);
+    reply_append(&req->reply, ", \"returnValue\": true}");
+    return;
+  }
+  if ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER)) {
+    cpu = atoi(param->child->text);
+  }
+
+  if ((cpu == 0) || ((cpu > 0) && (cpu < present_cpus()) && is_cpu_online(cpu))) {
+    sprintf(filename, "%s/cpu%d/cpufreq/scaling_cur_freq", cpudir, cpu);
+    reply_single_integer(req, filename);
+  }
+  else {
+    reply_set(&req->reply, "{\"value\": 0, \"returnValue\": true}");
+  }
+}
+
+//
+// Read scaling_cur_freq for one cpu, or for all of them if no cpu is given
+//
+bool get_scaling_cur_freq_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_scaling_cur_freq_work, NULL);
+}
+
+//
+// The cpu argument of a request, or cpu 0 if there is none.
+//
+static int request_cpu(request_t *req) {
+  json_t *param = json_find_first_label(req->object, "cpu");
+  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
+    return atoi(param->child->text);
+  }
+  return 0;
+}
+
+static void get_scaling_governor_work(request_t *req) {
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+
+  cpu_policy_directory(request_cpu(req), directory);
+  sprintf(filename, "%s/scaling_governor", directory);
+  reply_single_line(req, filename);
+}
+
+//
+// Read scaling_governor for the policy of a cpu (cpu 0 if none is given)
+//
+bool get_scaling_governor_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_scaling_governor_work, NULL);
+}
+
+static void get_cpufreq_params_work(request_t *req) {
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+  char line[MAXLINLEN];
+  char errorText[MAXLINLEN];
+
+  struct stat statbuf;
+  DIR *dp;
+
+  bool error = false;
+  char *governor = NULL;
+  int cpu = request_cpu(req);
+  
+  json_t *object = req->object;
+
+  // Extract the governor argument from the message
+  json_t *param = json_find_first_label(object, "governor");
+  if (param && (param->child->type == JSON_STRING)) {
+    governor = param->child->text;
+  }
+
+  if (governor) {
+    sprintf(directory, "%s/cpufreq/%s", cpudir, governor);
+    dp = opendir (directory);
+    if (!dp) {
+      cpu_policy_directory(cpu, filename);
+      sprintf(directory, "%s/%s", filename, governor);
+    }
+    else {
+      closedir(dp);
+    }
+  }
+  else {
+    cpu_policy_directory(cpu, directory);
+  }
+
+  dp = opendir (directory);
+  if (!dp && cpu && !is_cpu_online(cpu)) {
+    // Older kernels remove the cpufreq directory of an offline cpu.  This is only a
+    // read, so the cpu is not brought online for it (that is a write, which is left to
+    // set_cpufreq_params on the writer thread).
+    reply_set(&req->reply, "{\"params\": [], \"online\": false, \"returnValue\": true }");
+    return;
+  }
+  if (!dp) {
+    // Don't report an error, since some governors do not have specific parameters.
+    reply_set(&req->reply, "{\"errorText\": \"Unable to open %s\", \"returnValue\": true }", directory);
+    return;
+  }
+
+  struct dirent *ep;
+  bool first = true;
+  reply_set(&req->reply, "{\"params\": [");
+  
+  while (ep = readdir (dp)) {
+    if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, "..") ||
+	!strcmp(ep->d_name, "stats") || !strcmp(ep->d_name, "affected_cpus") ||
+	!strcmp(ep->d_name, "scaling_driver")) {
+      continue;
+    }
+
+    sprintf(filename, "%s/%s", directory, ep->d_name);
+
+    bool writeable = false;
+    bool directory = false;
+
+    if (!stat(filename, &statbuf)) {
+      if (statbuf.st_mode & S_IWUSR) {
+	writeable = true;
+      }
+      if (statbuf.st_mode & S_IFDIR) {
+	directory = true;
+      }
+    }
+      
+    strcpy(line,"");
+
+    if (directory) {
+      // Skip over other directories
+      continue;
+    }
+    else {
+      FILE *fp = fopen(filename, "r");
+      if (!fp) {
+	sprintf(errorText, "Unable to open %s", filename);
+	error = true;
+      }
+      else {
+	if (!fgets(line, MAXLINLEN-1, fp)) {
+	  sprintf(errorText, "Unable to parse %s", filename);
+	  error = true;
+	}
+	else {
+	  line[strlen(line)-1] = '\0';
+	}
+	if (fclose(fp)) {
+	  sprintf(errorText, "Unable to close %s", filename);
+	  error = true;
+	}
+      }
+	
+      // Special case for unsupported setspeed
+      if (!strcmp(ep->d_name, "scaling_setspeed") && !strcmp(line, "<unsupported>")) {
+	writeable = false;
+      }
+
+      if (error) {
+	reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+		errorText);
+	break;
+      }
+      else {
+	reply_printf(&req->reply, "%s{\"name\": \"%s\", \"writeable\": %s, \"value\": \"",
+		     (first ? "" : ", "), ep->d_name, (writeable ? "true" : "false"));
+	reply_escape(&req->reply, line);
+	reply_append(&req->reply, "\"}");
+	first = false;
+      }
+    }
+  }
+  if (closedir(dp)) {
+    reply_set(&req->reply, "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
+	    directory);
+    error = true;
+  }
+
+  if (!error) {
+    reply_append(&req->reply, "], \"returnValue\": ");
+    reply_append(&req->reply, error ? "false" : "true");
+    if (governor) {
+      reply_append(&req->reply, ", \"governor\": \"");
+      reply_append(&req->reply, governor);
+      reply_append(&req->reply, "\"");
+    }
+    reply_append(&req->reply, "}");
+  }
+}
+
+//
+// Read cpufreq params
+//
+bool get_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_cpufreq_params_work, NULL);
+}
+
+//
+// Append a space separated attribute (such as a frequency table) as a JSON array.
+//
+static void append_words(reply_t *out, char *label, char *text, bool quoted) {
+  char *word, *saveptr;
+  bool first = true;
+
+  reply_printf(out, ", \"%s\": [", label);
+  for (word = strtok_r(text, " ", &saveptr); word; word = strtok_r(NULL, " ", &saveptr)) {
+    if (quoted) {
+      reply_printf(out, "%s\"", first ? "" : ", ");
+      reply_escape(out, word);
+      reply_append(out, "\"");
+    }
+    else if (strspn(word, "0123456789") == strlen(word)) {
+      reply_printf(out, "%s%s", first ? "" : ", ", word);
+    }
+    else {
+      continue;
+    }
+    first = false;
+  }
+  reply_append(out, "]");
+}
+
+static char *policy_integer_attrs[][2] = {
+  { "scaling_cur_freq", "curFreq" },
+  { "scaling_min_freq", "minFreq" },
+  { "scaling_max_freq", "maxFreq" },
+  { "cpuinfo_min_freq", "cpuinfoMinFreq" },
+  { "cpuinfo_max_freq", "cpuinfoMaxFreq" },
+  { NULL, NULL }
+};
+
+static void get_cpufreq_policies_work(request_t *req) {
+  cpufreq_policy_t policies[MAX_CPUS];
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+  char text[MAXLINLEN];
+  int count, cpu, value, i, j;
+
+  count = cpufreq_policies(policies, ~0U);
+
+  reply_set(&req->reply, "{\"policies\": [");
+  for (i = 0; i < count; i++) {
+    policy_directory(&policies[i], directory);
+
+    reply_printf(&req->reply, "%s{\"policy\": %d, \"cpus\": [", i ? ", " : "", policies[i].cpu);
+    for (cpu = 0, j = 0; cpu < MAX_CPUS; cpu++) {
+      if (policies[i].cpus & (1U << cpu)) reply_printf(&req->reply, "%s%d", j++ ? ", " : "", cpu);
+    }
+    reply_append(&req->reply, "]");
+
+    sprintf(filename, "%s/scaling_governor", directory);
+    if (read_line(filename, text)) {
+      reply_append(&req->reply, ", \"governor\": \"");
+      reply_escape(&req->reply, text);
+      reply_append(&req->reply, "\"");
+    }
+
+    for (j = 0; policy_integer_attrs[j][0]; j++) {
+      sprintf(filename, "%s/%s", directory, policy_integer_attrs[j][0]);
+      if (read_integer(filename, &value, NULL)) {
+	reply_printf(&req->reply, ", \"%s\": %d", policy_integer_attrs[j][1], value);
+      }
+    }
+
+    // Each cluster of a big.LITTLE part has its own frequency table.
+    sprintf(filename, "%s/scaling_available_frequencies", directory);
+    if (read_line(filename, text)) append_words(&req->reply, "availableFrequencies", text, false);
+
+    sprintf(filename, "%s/scaling_available_governors", directory);
+    if (read_line(filename, text)) append_words(&req->reply, "availableGovernors", text, true);
+
+    reply_append(&req->reply, "}");
+  }
+  reply_append(&req->reply, "], \"returnValue\": true}");
+}
+
+//
+// Read the cpufreq policies (groups of cpus sharing a clock), with their cpus,
+// governor, frequency limits and frequency table
+//
+bool get_cpufreq_policies_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_cpufreq_policies_work, NULL);
+}
+
+//
+// Write a value to a tunable, unless it already has that value: writing scaling_governor
+// again restarts the governor (and makes the frequency blip), and the others are just
+// wasted writes.  Some attributes are write-only (sysfs will not even open them for
+// reading), so the check is only a best effort on a separate read-only descriptor, and
+// the value is written whenever the current one cannot be read.  Sets skipped if nothing
+// needed writing, and returns false (describing the failure in errorText) if the write
+// failed.
+//
+static bool write_tunable(char *filename, char *value, char *errorText, bool *skipped) {
+  char current[MAXLINLEN];
+  ssize_t len;
+  int fd;
+
+  *skipped = false;
+
+  if ((fd = open(filename, O_RDONLY)) >= 0) {
+    len = pread(fd, current, sizeof current - 1, 0);
+    close(fd);
+    if (len >= 0) {
+      current[len] = '\0';
+      current[strcspn(current, "\n")] = '\0';
+      if (!strcmp(current, value)) {
+	*skipped = true;
+	return true;
+      }
+    }
+  }
+
+  fd = open(filename, O_WRONLY);
+  if (fd < 0) {
+    sprintf(errorText, "Unable to open %s", filename);
+    return false;
+  }
+
+  fprintf(stderr, "Writing %s to %s\n", value, filename);
+
+  len = strlen(value);
+  if (pwrite(fd, value, len, 0) != len) {
+    sprintf(errorText, "Unable to write to %s", filename);
+    close(fd);
+    return false;
+  }
+  if (close(fd)) {
+    sprintf(errorText, "Unable to close %s", filename);
+    return false;
+  }
+
+  return true;
+}
+
+static void set_cpufreq_params_work(request_t *req) {
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+  char errorText[MAXLINLEN];
+
+  bool error = false;
+  bool skipped;
+  char *governor = NULL;
+  int writes = 0, skips = 0;
+  int maxCpu = 0;
+  int i;
+  DIR *dp;
+
+  json_t *object = req->object;
+
+  // Extract the maxCpu argument from the message, or apply to every cpu that is present
+  maxCpu = present_cpus() - 1;
+  json_t *param = json_find_first_label(object, "maxCpu");
+  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
+    maxCpu = atoi(param->child->text);
+  }
+  if (maxCpu < 0) maxCpu = 0;
+  if (maxCpu >= present_cpus()) maxCpu = present_cpus() - 1;
+
+  // Extract the genericParams argument from the message
+  json_t *genericParams = json_find_first_label(object, "genericParams");
+  if (!genericParams || (genericParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array\"}");
+    return;
+  }
+
+  // Extract the governorParams argument from the message
+  json_t *governorParams = json_find_first_label(object, "governorParams");
+  if (!governorParams || (governorParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array\"}");
+    return;
+  }
+
+  // Extract the overrideParams argument from the message
+  json_t *overrideParams = json_find_first_label(object, "overrideParams");
+  if (!overrideParams || (overrideParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array\"}");
+    return;
+  }
+
+  if (maxCpu) {
+    // Bring the other CPUs online
+    for (i = 1; i <= maxCpu; i++) {
+      bring_cpu_online(i);
+    }
+  }
+
+  // Write each tunable once for each policy covering cpus 0 to maxCpu.
+  cpufreq_policy_t policies[MAX_CPUS];
+  int count = cpufreq_policies(policies, (maxCpu >= MAX_CPUS-1) ? ~0U : ((1U << (maxCpu+1)) - 1));
+
+  json_t *genericEntry = genericParams->child->child;
+  while (genericEntry) {
+    if (genericEntry->type != JSON_OBJECT) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array element\"}");
+      return;
+    }
+    json_t *name = json_find_first_label(genericEntry, "name");
+    if (!name || (name->child->type != JSON_STRING) ||
+	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name genericEntry\"}");
+      return;
+    }
+    json_t *value = json_find_first_label(genericEntry, "value");
+    if (!value || (value->child->type != JSON_STRING) ||
+	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value genericEntry\"}");
+      return;
+    }
+
+    if (!strcmp(name->child->text, "scaling_governor")) {
+      governor = value->child->text;
+    }
+
+    for (i = 0; i < count; i++) {
+      policy_directory(&policies[i], directory);
+      sprintf(filename, "%s/%s", directory, name->child->text);
+
+      if (!write_tunable(filename, value->child->text, errorText, &skipped)) error = true;
+      else if (skipped) skips++;
+      else writes++;
+
+      if (error) {
+	reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+		errorText);
+	break;
+      }
+    }
+    
+    genericEntry = genericEntry->next;
+  }
+
+  if (governor != NULL) {
+
+    json_t *governorEntry = governorParams->child->child;
+    while (governorEntry) {
+      if (governorEntry->type != JSON_OBJECT) {
+	reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array element\"}");
+	return;
+      }
+      json_t *name = json_find_first_label(governorEntry, "name");
+      if (!name || (name->child->type != JSON_STRING) ||
+	  (strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
+	reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name governorEntry\"}");
+	return;
+      }
+      json_t *value = json_find_first_label(governorEntry, "value");
+      if (!value || (value->child->type != JSON_STRING) ||
+	  (strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) {
+	reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value governorEntry\"}");
+	return;
+      }
+
+      for (i = 0; i < count; i++) {
+	sprintf(directory, "%s/cpufreq/%s", cpudir, governor);
+	dp = opendir (directory);
+	if (!dp) {
+	  policy_directory(&policies[i], directory);
+	  sprintf(directory + strlen(directory), "/%s", governor);
+	}
+	else {
+	  i = count;
+	  closedir(dp);
+	}
+	sprintf(filename, "%s/%s", directory, name->child->text);
+
+	if (!write_tunable(filename, value->child->text, errorText, &skipped)) error = true;
+	else if (skipped) skips++;
+	else writes++;
+
+	if (error) {
+	  reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+		  errorText);
+	  break;
+	}
+      }
+    
+      governorEntry = governorEntry->next;
+    }
+  }
+
+  json_t *overrideEntry = overrideParams->child->child;
+  while (overrideEntry) {
+    if (overrideEntry->type != JSON_OBJECT) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array element\"}");
+      return;
+    }
+    json_t *name = json_find_first_label(overrideEntry, "name");
+    if (!name || (name->child->type != JSON_STRING) ||
+	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name overrideEntry\"}");
+      return;
+    }
+    json_t *value = json_find_first_label(overrideEntry, "value");
+    if (!value || (value->child->type != JSON_STRING) ||
+	(strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value overrideEntry\"}");
+      return;
+    }
+
+    for (i = 0; i < count; i++) {
+      sprintf(directory, "%s/cpufreq/override", cpudir);
+      dp = opendir (directory);
+      if (!dp) {
+	policy_directory(&policies[i], directory);
+	strcat(directory, "/override");
+      }
+      else {
+	i = count;
+	closedir(dp);
+      }
+      sprintf(filename, "%s/%s", directory, name->child->text);
+
+      if (!write_tunable(filename, value->child->text, errorText, &skipped)) error = true;
+      else if (skipped) skips++;
+      else writes++;
+
+      if (error) {
+	reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+		errorText);
+	break;
+      }
+    }
+    
+    overrideEntry = overrideEntry->next;
+  }
+
+  if (!error) {
+    reply_set(&req->reply, "{\"writesPerformed\": %d, \"writesSkipped\": %d, \"returnValue\": true}", writes, skips);
+  }
+}
+
+//
+// Write cpufreq params
+//
+bool set_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, set_cpufreq_params_work, NULL);
+}
+
+//
+// Settings which are made "sticky" are kept in a single boot config file, with one line
+// for each section (cpufreq, iosched, sysfs, sysctl and compcache) holding the validated
+// arguments of its stick call as JSON.  At boot, one upstart script runs us with
+// --apply-boot-config to apply the whole file in-process (see apply_boot_config), rather
+// than running a generated shell script for each section.  The file is only ever
+// replaced by renaming a complete new copy over it, so it is never seen half written.
+//
+#define BOOT_CONFIG "/var/palm/data/org.webosinternals.govnah-boot"
+#define BOOT_STATUS "/var/palm/data/org.webosinternals.govnah-boot-status"
+
+static pthread_mutex_t boot_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Replace the line for section in the boot config with json, or remove it if json is NULL.
+// The file itself is removed once it has no sections left.
+//
+static bool boot_config_update(char *section, char *json, char *errorText) {
+  char *tempname = BOOT_CONFIG ".tmp";
+  char *line = NULL;
+  size_t size = 0;
+  size_t len = strlen(section);
+  bool empty = true;
+  bool error = false;
+
+  pthread_mutex_lock(&boot_config_lock);
+
+  FILE *out = fopen(tempname, "w");
+  if (!out) {
+    sprintf(errorText, "Unable to open %s", tempname);
+    pthread_mutex_unlock(&boot_config_lock);
+    return false;
+  }
+
+  FILE *in = fopen(BOOT_CONFIG, "r");
+  if (in) {
+    while (getline(&line, &size, in) > 0) {
+      if (!strncmp(line, section, len) && (line[len] == ' ')) continue;
+      if (fputs(line, out) < 0) error = true;
+      empty = false;
+    }
+    free(line);
+    fclose(in);
+  }
+
+  if (json) {
+    if (fprintf(out, "%s %s\n", section, json) < 0) error = true;
+    empty = false;
+  }
+
+  if (fflush(out) || fsync(fileno(out))) error = true;
+  if (fclose(out)) error = true;
+
+  if (error) {
+    sprintf(errorText, "Unable to write to %s", tempname);
+    (void)unlink(tempname);
+  }
+  else if (empty) {
+    (void)unlink(tempname);
+    (void)unlink(BOOT_CONFIG);
+  }
+  else if (rename(tempname, BOOT_CONFIG)) {
+    sprintf(errorText, "Unable to rename %s", tempname);
+    (void)unlink(tempname);
+    error = true;
+  }
+
+  pthread_mutex_unlock(&boot_config_lock);
+
+  return !error;
+}
+
+//
+// Append a params array to a boot config section.  Entries with an unusable name or
+// value are left out, as the stick calls have always skipped them.
+//
+static void boot_config_params(reply_t *out, char *label, json_t *params, char *nameChars, char *valueChars) {
+  bool first = true;
+
+  reply_printf(out, "\"%s\": [", label);
+
+  json_t *entry = params->child->child;
+  while (entry) {
+    if (entry->type != JSON_OBJECT) goto next;
+    json_t *name = json_find_first_label(entry, "name");
+    if (!name || (name->child->type != JSON_STRING) ||
+	(strspn(name->child->text, nameChars) != strlen(name->child->text))) goto next;
+    json_t *value = json_find_first_label(entry, "value");
+    if (!value || (value->child->type != JSON_STRING) ||
+	(strspn(value->child->text, valueChars) != strlen(value->child->text))) goto next;
+
+    reply_printf(out, "%s{\"name\": \"%s\", \"value\": \"%s\"}", (first ? "" : ", "),
+		 name->child->text, value->child->text);
+    first = false;
+
+  next:
+    entry = entry->next;
+  }
+
+  reply_append(out, "]");
+}
+
+//
+// Store (or with a NULL section text, remove) a section of the boot config, and
+// reply with the outcome.
+//
+static void stick_section(request_t *req, char *section, reply_t *json) {
+  char errorText[MAXLINLEN];
+  bool stored;
+
+  if (json && json->failed) {
+    strcpy(errorText, "Out of memory");
+    stored = false;
+  }
+  else {
+    stored = boot_config_update(section, json ? json->text : NULL, errorText);
+  }
+  if (json) reply_free(json);
+
+  if (!stored) {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+	      errorText);
+  }
+}
+
+static void stick_cpufreq_params_work(request_t *req) {
+  reply_t section = { 0 };
+  int maxCpu = 0;
+
+  json_t *object = req->object;
+
+  // Extract the maxCpu argument from the message, or apply to every cpu that is present
+  maxCpu = present_cpus() - 1;
+  json_t *param = json_find_first_label(object, "maxCpu");
+  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
+    maxCpu = atoi(param->child->text);
+  }
+  if (maxCpu < 0) maxCpu = 0;
+  if (maxCpu >= present_cpus()) maxCpu = present_cpus() - 1;
+
+  // Extract the genericParams argument from the message
+  json_t *genericParams = json_find_first_label(object, "genericParams");
+  if (!genericParams || (genericParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array\"}");
+    return;
+  }
+
+  // Extract the governorParams argument from the message
+  json_t *governorParams = json_find_first_label(object, "governorParams");
+  if (!governorParams || (governorParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array\"}");
+    return;
+  }
+
+  // Extract the overrideParams argument from the message
+  json_t *overrideParams = json_find_first_label(object, "overrideParams");
+  if (!overrideParams || (overrideParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array\"}");
+    return;
+  }
+
+  // This is applied at boot by apply_profile, so it takes the same arguments.
+  reply_printf(&section, "{\"maxCpu\": %d, ", maxCpu);
+  boot_config_params(&section, "genericParams", genericParams, ALLOWED_CHARS, ALLOWED_CHARS);
+  reply_append(&section, ", ");
+  boot_config_params(&section, "governorParams", governorParams, ALLOWED_CHARS, ALLOWED_CHARS" ");
+  reply_append(&section, ", ");
+  boot_config_params(&section, "overrideParams", overrideParams, ALLOWED_CHARS, ALLOWED_CHARS" ");
+  reply_append(&section, "}");
+
+  stick_section(req, "cpufreq", &section);
+}
+
+//
+// Save cpufreq params in the boot config, to make them "sticky"
+//
+bool stick_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, stick_cpufreq_params_work, NULL);
+}
+
+static void unstick_cpufreq_params_work(request_t *req) {
+  stick_section(req, "cpufreq", NULL);
+}
+
+//
+// Remove cpufreq params from the boot config
+//
+bool unstick_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, unstick_cpufreq_params_work, NULL);
+}
+
+//
+// apply_profile applies the cpufreq params of a profile (as for set_cpufreq_params),
+// and optionally an io scheduler, as a single transaction.  Every name and value is
+// checked before anything is written, and governors, frequency limits and schedulers
+// are checked against what the kernel offers.  For each policy the governor is written
+// first, then the frequency limits in whichever order keeps min <= max throughout, then
+// the rest.  The old value of each attribute is read just before it is written (and if
+// it is already the value wanted, the write is skipped), and if any write fails,
+// everything written so far (including any cpus brought online) is put back in reverse
+// order.  The reply lists the value each attribute actually took, since the kernel may
+// clamp what it is given, and counts the writes performed and skipped.
+//
+// A profile is first compiled into a write plan: a descriptor for each directory it
+// writes into (the cpu directory, the global cpufreq directory, each policy and the
+// block queue), and an ordered list of steps, each an attribute path relative to one
+// of those directories and the value to write.  Applying the plan is then a loop of
+// openat, pread (to save the old value) and pwrite.  The plan is kept, under the
+// profileId the client names it with or else under a hash of its params, so switching
+// back to it skips the path building, directory scans and validation.  A kept plan is compiled again when its params
+// change, when a cpu goes offline (older kernels remove the cpu's cpufreq directory),
+// and when one of its writes fails, in case the sysfs layout has changed under it
+// (a governor module being unloaded, say).
+//
+typedef enum { STEP_ONLINE, STEP_GENERIC, STEP_GOVERNOR, STEP_OVERRIDE, STEP_IO } step_kind_t;
+
+#define PROFILE_DIR_CPU		0
+#define PROFILE_DIR_CPUFREQ	1
+#define PROFILE_DIR_BLOCK	2
+#define PROFILE_DIR_POLICY	3
+#define PROFILE_DIRS		(PROFILE_DIR_POLICY + MAX_CPUS)
+#define PROFILE_VALUE_LEN	256
+#define PROFILE_PLANS		8
+
+typedef struct {
+  step_kind_t kind;
+  int policy;			// Index into the policies, or the cpu for STEP_ONLINE.
+  int dir;			// Index into the directories.
+  int target;			// The directory it was written in this time (see profile_target).
+  bool pair;			// The first of a min and max frequency pair (see profile_order).
+  char *name;
+  char *path;			// Relative to the directory.
+  char *value;
+  char old[PROFILE_VALUE_LEN];
+  bool saved;
+  bool written;
+  bool skipped;			// It already had the value, so was left alone.
+  int fd;			// Kept open from the write until the run is over.
+  int readFd;			// Kept open from saving the old value, for the reply.
+} profile_step_t;
+
+typedef struct {
+  cpufreq_policy_t policies[MAX_CPUS];
+  int count;
+  char *governor;
+  int dirs[PROFILE_DIRS];
+  char *dirnames[PROFILE_DIRS];
+  int shared[2];		// Whether the governor and override tunables are global, once known.
+  profile_step_t *steps;
+  int used;
+  int size;
+  arena_t arena;		// Holds the steps and their strings.
+} profile_t;
+
+typedef struct {
+  char id[MAXNUMLEN];
+  guint32 hash;
+  gint generation;
+  gint64 used;
+  profile_t profile;
+} profile_plan_t;
+
+static profile_plan_t profile_plans[PROFILE_PLANS];
+
+// Bumped whenever a cpu goes offline, which makes every kept plan stale.
+static volatile gint profile_generation = 0;
+
+// Profiles are applied one at a time, so two switches never interleave their writes.
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Check whether word is one of the words in a list, which may have the current
+// choice in brackets (as the io scheduler does).
+//
+static bool word_in_list(char *list, char *word) {
+  char text[MAXLINLEN];
+  char *token, *saveptr;
+
+  strncpy(text, list, MAXLINLEN - 1);
+  text[MAXLINLEN - 1] = '\0';
+  for (token = strtok_r(text, " []", &saveptr); token; token = strtok_r(NULL, " []", &saveptr)) {
+    if (!strcmp(token, word)) return true;
+  }
+
+  return false;
+}
+
+//
+// Check that an io scheduler is a plain name, and one which the kernel offers.
+//
+static bool io_scheduler_available(char *name) {
+  char text[MAXLINLEN];
+
+  return ((strspn(name, ALLOWED_CHARS) == strlen(name)) &&
+	  read_line("/sys/block/mmcblk0/queue/scheduler", text) && word_in_list(text, name));
+}
+
+//
+// Set up an empty profile, with room for size steps.
+//
+static bool profile_init(profile_t *profile, int size) {
+  int i;
+
+  memset(profile, 0, sizeof *profile);
+  for (i = 0; i < PROFILE_DIRS; i++) profile->dirs[i] = -1;
+  profile->shared[0] = profile->shared[1] = -1;
+  profile->size = size;
+  profile->steps = (profile_step_t *)arena_alloc(&profile->arena, size * sizeof(profile_step_t));
+
+  return profile->steps != NULL;
+}
+
+//
+// Close the attributes left open by a run.
+//
+static void profile_close(profile_t *profile) {
+  int s;
+
+  for (s = 0; s < profile->used; s++) {
+    if (profile->steps[s].fd >= 0) close(profile->steps[s].fd);
+    if (profile->steps[s].readFd >= 0) close(profile->steps[s].readFd);
+    profile->steps[s].fd = profile->steps[s].readFd = -1;
+  }
+}
+
+static void profile_free(profile_t *profile) {
+  int i;
+
+  profile_close(profile);
+  for (i = 0; i < PROFILE_DIRS; i++) {
+    if (profile->dirs[i] >= 0) close(profile->dirs[i]);
+    profile->dirs[i] = -1;
+  }
+  arena_free(&profile->arena);
+  profile->steps = NULL;
+  profile->used = 0;
+}
+
+//
+// Open one of the directories a profile writes into.  One which does not exist (such
+// as the global cpufreq directory on some kernels) is left closed, so that writes into
+// it fail with the directory's name.  Returns false if we are out of memory.
+//
+static bool profile_open_dir(profile_t *profile, int dir, char *directory) {
+  profile->dirnames[dir] = arena_strndup(&profile->arena, directory, strlen(directory));
+  if (!profile->dirnames[dir]) return false;
+
+  profile->dirs[dir] = open(directory, O_RDONLY);
+  if (profile->dirs[dir] >= 0) fcntl(profile->dirs[dir], F_SETFD, FD_CLOEXEC);
+
+  return true;
+}
+
+static bool profile_add(profile_t *profile, step_kind_t kind, int policy, int dir, char *path, char *name, char *value) {
+  profile_step_t *step = &profile->steps[profile->used];
+
+  step->kind = kind;
+  step->policy = policy;
+  step->dir = dir;
+  step->fd = step->readFd = -1;
+  step->path = arena_strndup(&profile->arena, path, strlen(path));
+  step->name = arena_strndup(&profile->arena, name, strlen(name));
+  step->value = arena_strndup(&profile->arena, value, strlen(value));
+  if (!step->path || !step->name || !step->value) return false;
+
+  profile->used++;
+  return true;
+}
+
+//
+// Read the current value of an attribute from fd.  For the io scheduler, that is the
+// bracketed choice.  A value too long to be put back is not saved.
+//
+static bool profile_read(profile_step_t *step, int fd, char *text, int size) {
+  ssize_t len = pread(fd, text, size - 1, 0);
+  if ((len < 0) || (len >= size - 1)) return false;
+  text[len] = '\0';
+  text[strcspn(text, "\n")] = '\0';
+
+  if (step->kind == STEP_IO) {
+    char *start = strchr(text, '[');
+    char *end = start ? strchr(start, ']') : NULL;
+    if (!end) return false;
+    *end = '\0';
+    memmove(text, start + 1, strlen(start + 1) + 1);
+  }
+
+  return true;
+}
+
+//
+// Read the current value of a step's attribute, on the descriptor kept from saving
+// its old value if there is one (the one kept from the write is write-only).
+//
+static bool profile_current(profile_t *profile, profile_step_t *step, char *text, int size) {
+  if (step->readFd >= 0) return profile_read(step, step->readFd, text, size);
+
+  int fd = openat(profile->dirs[step->target], step->path, O_RDONLY);
+  if (fd < 0) return false;
+
+  bool status = profile_read(step, fd, text, size);
+  close(fd);
+
+  return status;
+}
+
+//
+// Work out which directory a step is written in this time.  Returns false if it is to
+// be skipped, which is the case for the policies after the first when the governor (or
+// override) tunables are global.  The global governor directory only appears once the
+// governor has been written, so that is checked at the first such step, and remembered.
+//
+static bool profile_target(profile_t *profile, profile_step_t *step) {
+  int which, fd;
+
+  step->target = step->dir;
+  if ((step->kind != STEP_GOVERNOR) && (step->kind != STEP_OVERRIDE)) return true;
+
+  which = (step->kind == STEP_OVERRIDE);
+  if (profile->shared[which] < 0) {
+    fd = openat(profile->dirs[PROFILE_DIR_CPUFREQ], which ? "override" : profile->governor, O_RDONLY);
+    profile->shared[which] = (fd >= 0);
+    if (fd >= 0) close(fd);
+  }
+  if (!profile->shared[which]) return true;
+
+  if (step->policy) return false;
+  step->target = PROFILE_DIR_CPUFREQ;
+  return true;
+}
+
+//
+// A min and max frequency pair is written minimum first, unless the new minimum is
+// above the current maximum (which the kernel would refuse), in which case the maximum
+// goes first.  The current maximum differs from one switch to the next, so the pair is
+// put in order in place each time.
+//
+static void profile_order(profile_t *profile, int s) {
+  char text[MAXNUMLEN];
+  profile_step_t *first = &profile->steps[s];
+  profile_step_t *second = &profile->steps[s + 1];
+  profile_step_t *min = strcmp(first->name, "scaling_min_freq") ? second : first;
+  profile_step_t *max = (min == first) ? second : first;
+  profile_step_t swap;
+  bool minFirst = true;
+
+  max->target = max->dir;
+  if (profile_current(profile, max, text, sizeof text)) {
+    minFirst = (strtoul(min->value, NULL, 10) <= strtoul(text, NULL, 10));
+  }
+
+  if (minFirst != (min == first)) {
+    swap = *first;
+    *first = *second;
+    *second = swap;
+    first->pair = true;
+    second->pair = false;
+  }
+}
+
+//
+// Write each step from first onwards, saving the old values, and skipping any which
+// already have the value.  Returns the number of the step which failed, or -1.  Some
+// attributes are write-only (sysfs will not open them for reading), so the old value
+// is read on a separate descriptor if it can be, and a step without one is written
+// anyway, and just cannot be rolled back.  Both descriptors are left open, so the old
+// value can be put back, and the new one reported, without opening it again.
+//
+static int profile_write(profile_t *profile, int first, char *errorText) {
+  char filename[MAXLINLEN];
+  profile_step_t *step;
+  ssize_t len;
+  int fd, s;
+
+  for (s = first; s < profile->used; s++) {
+    if (profile->steps[s].pair) profile_order(profile, s);
+    step = &profile->steps[s];
+    if ((step->kind == STEP_ONLINE) && read_cpu_online(step->policy)) continue;
+    if (!profile_target(profile, step)) continue;
+
+    step->readFd = openat(profile->dirs[step->target], step->path, O_RDONLY);
+    step->saved = (step->readFd >= 0) && profile_read(step, step->readFd, step->old, sizeof step->old);
+
+    // Rewriting a value it already has is not harmless (writing scaling_governor
+    // again restarts the governor, and makes the frequency blip), so don't.
+    if (step->saved && !strcmp(step->old, step->value)) {
+      step->skipped = true;
+      continue;
+    }
+
+    fd = openat(profile->dirs[step->target], step->path, O_WRONLY);
+    if (fd < 0) {
+      if (step->kind == STEP_ONLINE) hotplug_seed();
+      sprintf(errorText, "Unable to open %s/%s", profile->dirnames[step->target], step->path);
+      return s;
+    }
+    step->fd = fd;
+
+    len = strlen(step->value);
+    if (pwrite(fd, step->value, len, 0) != len) {
+      if (step->kind == STEP_ONLINE) hotplug_seed();
+      sprintf(errorText, "Unable to write %s to %s/%s", step->value, profile->dirnames[step->target], step->path);
+      return s;
+    }
+    step->written = true;
+
+    if (step->kind == STEP_ONLINE) {
+      cpu_online_update(step->policy, true);
+      sprintf(filename, "%s/cpu%d/cpufreq/", cpudir, step->policy);
+      attr_cache_invalidate(filename);
+    }
+  }
+
+  return -1;
+}
+
+//
+// Put back the old values of everything written, newest first.
+// Returns false if any of them could not be put back.
+//
+static bool profile_rollback(profile_t *profile) {
+  profile_step_t *step;
+  bool restored = true;
+  ssize_t len;
+  int fd, s;
+
+  for (s = profile->used - 1; s >= 0; s--) {
+    step = &profile->steps[s];
+    // An attribute whose old value could not be read (a write-only one) has nothing
+    // to put back, so it is left as it is.
+    if (!step->written || !step->saved) continue;
+    fprintf(stderr, "Restoring %s to %s/%s\n", step->old, profile->dirnames[step->target], step->path);
+    fd = (step->fd >= 0) ? step->fd : openat(profile->dirs[step->target], step->path, O_WRONLY);
+    if (fd < 0) {
+      restored = false;
+      continue;
+    }
+    len = strlen(step->old);
+    if (pwrite(fd, step->old, len, 0) != len) restored = false;
+    else if (step->kind == STEP_ONLINE) cpu_online_update(step->policy, false);
+  }
+
+  return restored;
+}
+
+//
+// Forget what was written by the last run of a kept plan, before running it again.
+//
+static void profile_rewind(profile_t *profile) {
+  int s;
+
+  for (s = 0; s < profile->used; s++) {
+    profile->steps[s].saved = false;
+    profile->steps[s].written = false;
+    profile->steps[s].skipped = false;
+  }
+}
+
+//
+// Check the syntax of a params array, and count its entries.
+// Returns -1 if any entry is not a name and value with allowed characters.
+//
+static int profile_check_params(json_t *params, char *allowed) {
+  int count = 0;
+
+  json_t *entry = params->child->child;
+  while (entry) {
+    if (entry->type != JSON_OBJECT) return -1;
+    json_t *name = json_find_first_label(entry, "name");
+    if (!name || (name->child->type != JSON_STRING) ||
+	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) return -1;
+    json_t *value = json_find_first_label(entry, "value");
+    if (!value || (value->child->type != JSON_STRING) ||
+	(strspn(value->child->text, allowed) != strlen(value->child->text))) return -1;
+    count++;
+    entry = entry->next;
+  }
+
+  return count;
+}
+
+static char *profile_param(json_t *entry, char *label) {
+  return json_find_first_label(entry, label)->child->text;
+}
+
+//
+// Hash a string (FNV-1a) into a running hash, with a terminator so that the
+// boundaries between strings count.
+//
+static guint32 profile_hash_text(guint32 hash, char *text) {
+  while (*text) {
+    hash ^= (unsigned char)*text++;
+    hash *= 16777619;
+  }
+  hash ^= 0xff;
+  hash *= 16777619;
+
+  return hash;
+}
+
+//
+// Hash the names and values of a params array, so a kept plan can tell when the
+// profile it was compiled from has been edited.
+//
+static guint32 profile_hash_params(guint32 hash, json_t *params) {
+  json_t *entry;
+
+  for (entry = params->child->child; entry; entry = entry->next) {
+    hash = profile_hash_text(hash, profile_param(entry, "name"));
+    hash = profile_hash_text(hash, profile_param(entry, "value"));
+  }
+
+  return profile_hash_text(hash, "");
+}
+
+//
+// Hash everything a plan is compiled from.
+//
+static guint32 profile_hash(guint32 hash, json_t *genericParams, json_t *governorParams, json_t *overrideParams,
+			    char *ioScheduler, char *maxCpu) {
+  hash = profile_hash_params(hash, genericParams);
+  hash = profile_hash_params(hash, governorParams);
+  hash = profile_hash_params(hash, overrideParams);
+  hash = profile_hash_text(hash, ioScheduler ? ioScheduler : "");
+  return profile_hash_text(hash, maxCpu);
+}
+
+//
+// Check a generic param for one policy against what the kernel offers.
+//
+static bool profile_check_value(profile_t *profile, int policy, char *name, char *value, char *errorText) {
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+  char text[MAXLINLEN];
+  unsigned long freq, limit;
+
+  policy_directory(&profile->policies[policy], directory);
+
+  if (!strcmp(name, "scaling_governor")) {
+    sprintf(filename, "%s/scaling_available_governors", directory);
+    if (read_line(filename, text) && !word_in_list(text, value)) {
+      sprintf(errorText, "Governor %s is not available for cpu %d", value, profile->policies[policy].cpu);
+      return false;
+    }
+  }
+  else if (!strcmp(name, "scaling_min_freq") || !strcmp(name, "scaling_max_freq")) {
+    if (strspn(value, "0123456789") != strlen(value)) {
+      sprintf(errorText, "Invalid frequency %s for %s", value, name);
+      return false;
+    }
+    freq = strtoul(value, NULL, 10);
+    sprintf(filename, "%s/scaling_available_frequencies", directory);
+    if (read_line(filename, text)) {
+      if (!word_in_list(text, value)) {
+	sprintf(errorText, "Frequency %s is not available for cpu %d", value, profile->policies[policy].cpu);
+	return false;
+      }
+    }
+    else {
+      // Without a frequency table, at least keep to the hardware limits.
+      sprintf(filename, "%s/cpuinfo_min_freq", directory);
+      if (read_line(filename, text) && (freq < (limit = strtoul(text, NULL, 10)))) {
+	sprintf(errorText, "Frequency %s is below the minimum of %lu for cpu %d", value, limit, profile->policies[policy].cpu);
+	return false;
+      }
+      sprintf(filename, "%s/cpuinfo_max_freq", directory);
+      if (read_line(filename, text) && (freq > (limit = strtoul(text, NULL, 10)))) {
+	sprintf(errorText, "Frequency %s is above the maximum of %lu for cpu %d", value, limit, profile->policies[policy].cpu);
+	return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+//
+// Plan the generic params of one policy: the governor, then the frequency limits
+// (as a pair, if both are given), then the rest in the order given.
+//
+static bool profile_plan_policy(profile_t *profile, int policy, json_t *genericParams, char *errorText) {
+  json_t *minEntry = NULL, *maxEntry = NULL, *entry;
+  int dir = PROFILE_DIR_POLICY + policy;
+  char *name, *value;
+
+  for (entry = genericParams->child->child; entry; entry = entry->next) {
+    name = profile_param(entry, "name");
+    value = profile_param(entry, "value");
+    if (!profile_check_value(profile, policy, name, value, errorText)) return false;
+    if (!strcmp(name, "scaling_governor")) {
+      if (!profile_add(profile, STEP_GENERIC, policy, dir, name, name, value)) goto oom;
+    }
+    else if (!strcmp(name, "scaling_min_freq")) minEntry = entry;
+    else if (!strcmp(name, "scaling_max_freq")) maxEntry = entry;
+  }
+
+  if (minEntry && maxEntry &&
+      (strtoul(profile_param(minEntry, "value"), NULL, 10) > strtoul(profile_param(maxEntry, "value"), NULL, 10))) {
+    sprintf(errorText, "scaling_min_freq %s is above scaling_max_freq %s",
+	    profile_param(minEntry, "value"), profile_param(maxEntry, "value"));
+    return false;
+  }
+
+  if (minEntry) {
+    if (!profile_add(profile, STEP_GENERIC, policy, dir, "scaling_min_freq", "scaling_min_freq",
+		     profile_param(minEntry, "value"))) goto oom;
+    profile->steps[profile->used - 1].pair = (maxEntry != NULL);
+  }
+  if (maxEntry) {
+    if (!profile_add(profile, STEP_GENERIC, policy, dir, "scaling_max_freq", "scaling_max_freq",
+		     profile_param(maxEntry, "value"))) goto oom;
+  }
+
+  for (entry = genericParams->child->child; entry; entry = entry->next) {
+    name = profile_param(entry, "name");
+    if (!strcmp(name, "scaling_governor") || !strcmp(name, "scaling_min_freq") ||
+	!strcmp(name, "scaling_max_freq")) continue;
+    if (!profile_add(profile, STEP_GENERIC, policy, dir, name, name, profile_param(entry, "value"))) goto oom;
+  }
+
+  return true;
+
+ oom:
+  strcpy(errorText, "Out of memory");
+  return false;
+}
+
+//
+// Compile a profile into a plan.  The other cpus have to be online before their
+// policies can be found or checked, so the steps which bring them online are written
+// as the plan is compiled.  On failure the caller has to roll those back.
+//
+static bool profile_compile(profile_t *profile, int maxCpu, json_t *genericParams, json_t *governorParams,
+			    json_t *overrideParams, char *ioScheduler, char *errorText) {
+  char directory[MAXLINLEN];
+  char path[MAXLINLEN];
+  json_t *entry;
+  int i;
+
+  if (!profile_open_dir(profile, PROFILE_DIR_CPU, cpudir)) goto oom;
+  for (i = 1; i <= maxCpu; i++) {
+    sprintf(path, "cpu%d/online", i);
+    if (!profile_add(profile, STEP_ONLINE, i, PROFILE_DIR_CPU, path, "online", "1")) goto oom;
+  }
+  if (profile_write(profile, 0, errorText) >= 0) return false;
+
+  for (entry = genericParams->child->child; entry; entry = entry->next) {
+    if (strcmp(profile_param(entry, "name"), "scaling_governor")) continue;
+    profile->governor = arena_strndup(&profile->arena, profile_param(entry, "value"),
+				      strlen(profile_param(entry, "value")));
+    if (!profile->governor) goto oom;
+  }
+
+  sprintf(directory, "%s/cpufreq", cpudir);
+  if (!profile_open_dir(profile, PROFILE_DIR_CPUFREQ, directory)) goto oom;
+
+  profile->count = cpufreq_policies(profile->policies, (maxCpu >= MAX_CPUS-1) ? ~0U : ((1U << (maxCpu+1)) - 1));
+  for (i = 0; i < profile->count; i++) {
+    policy_directory(&profile->policies[i], directory);
+    if (!profile_open_dir(profile, PROFILE_DIR_POLICY + i, directory)) goto oom;
+    if (!profile_plan_policy(profile, i, genericParams, errorText)) return false;
+  }
+
+  if (profile->governor) {
+    for (entry = governorParams->child->child; entry; entry = entry->next) {
+      sprintf(path, "%s/%s", profile->governor, profile_param(entry, "name"));
+      for (i = 0; i < profile->count; i++) {
+	if (!profile_add(profile, STEP_GOVERNOR, i, PROFILE_DIR_POLICY + i, path,
+			 profile_param(entry, "name"), profile_param(entry, "value"))) goto oom;
+      }
+    }
+  }
+  for (entry = overrideParams->child->child; entry; entry = entry->next) {
+    sprintf(path, "override/%s", profile_param(entry, "name"));
+    for (i = 0; i < profile->count; i++) {
+      if (!profile_add(profile, STEP_OVERRIDE, i, PROFILE_DIR_POLICY + i, path,
+		       profile_param(entry, "name"), profile_param(entry, "value"))) goto oom;
+    }
+  }
+
+  if (ioScheduler) {
+    if (!profile_open_dir(profile, PROFILE_DIR_BLOCK, "/sys/block/mmcblk0/queue")) goto oom;
+    if (!profile_add(profile, STEP_IO, 0, PROFILE_DIR_BLOCK, "scheduler", "io_scheduler", ioScheduler)) goto oom;
+  }
+
+  return true;
+
+ oom:
+  strcpy(errorText, "Out of memory");
+  return false;
+}
+
+static void profile_plan_drop(profile_plan_t *plan) {
+  profile_free(&plan->profile);
+  plan->id[0] = '\0';
+}
+
+//
+// Find the kept plan for a profile, if it is still good.
+// The profile_lock must be held.
+//
+static profile_plan_t *profile_plan_find(char *id, guint32 hash) {
+  int i;
+
+  for (i = 0; i < PROFILE_PLANS; i++) {
+    profile_plan_t *plan = &profile_plans[i];
+    if (!plan->id[0] || strcmp(plan->id, id)) continue;
+    if ((plan->hash == hash) && (plan->generation == g_atomic_int_get(&profile_generation))) return plan;
+    profile_plan_drop(plan);
+    break;
+  }
+
+  return NULL;
+}
+
+//
+// Find room for a new plan, dropping the least recently used if need be.
+// The profile_lock must be held.
+//
+static profile_plan_t *profile_plan_slot(void) {
+  profile_plan_t *oldest = &profile_plans[0];
+  int i;
+
+  for (i = 0; i < PROFILE_PLANS; i++) {
+    if (!profile_plans[i].id[0]) return &profile_plans[i];
+    if (profile_plans[i].used < oldest->used) oldest = &profile_plans[i];
+  }
+  profile_plan_drop(oldest);
+
+  return oldest;
+}
+
+static void apply_profile_work(request_t *req) {
+  char errorText[MAXLINLEN];
+  char text[MAXLINLEN];
+  char key[MAXNUMLEN];
+  profile_t *profile;
+  profile_plan_t *plan;
+  profile_step_t *step;
+  char *ioScheduler = NULL;
+  char *id = NULL;
+  bool cached = false;
+  bool first = true;
+  int maxCpu, entries, s;
+  int performed = 0, skipped = 0;
+
+  json_t *object = req->object;
+
+  // Extract the maxCpu argument from the message, or apply to every cpu that is present
+  maxCpu = present_cpus() - 1;
+  json_t *param = json_find_first_label(object, "maxCpu");
+  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
+    maxCpu = atoi(param->child->text);
+  }
+  if (maxCpu < 0) maxCpu = 0;
+  if (maxCpu >= present_cpus()) maxCpu = present_cpus() - 1;
+
+  json_t *genericParams = json_find_first_label(object, "genericParams");
+  json_t *governorParams = json_find_first_label(object, "governorParams");
+  json_t *overrideParams = json_find_first_label(object, "overrideParams");
+  if (!genericParams || (genericParams->child->type != JSON_ARRAY) ||
+      !governorParams || (governorParams->child->type != JSON_ARRAY) ||
+      !overrideParams || (overrideParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing params arrays\"}");
+    return;
+  }
+
+  int generic = profile_check_params(genericParams, ALLOWED_CHARS);
+  int governor = profile_check_params(governorParams, ALLOWED_CHARS" ");
+  int override = profile_check_params(overrideParams, ALLOWED_CHARS" ");
+  if ((generic < 0) || (governor < 0) || (override < 0)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid params entry\"}");
+    return;
+  }
+  entries = generic + governor + override;
+
+  param = json_find_first_label(object, "ioScheduler");
+  if (param && (param->child->type == JSON_STRING)) {
+    ioScheduler = param->child->text;
+    if (!io_scheduler_available(ioScheduler)) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Io scheduler %s is not available\"}",
+		ioScheduler);
+      return;
+    }
+  }
+
+  param = json_find_first_label(object, "profileId");
+  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
+    id = param->child->text;
+    if (!id[0] || (strlen(id) >= MAXNUMLEN) || (strspn(id, ALLOWED_CHARS) != strlen(id))) {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid profileId\"}");
+      return;
+    }
+  }
+
+  sprintf(text, "%d", maxCpu);
+  guint32 hash = profile_hash(2166136261U, genericParams, governorParams, overrideParams, ioScheduler, text);
+
+  // A profile without a profileId is kept under a name made from a second hash of
+  // its params, which can't clash with a profileId since '#' is not allowed in one.
+  if (!id) {
+    sprintf(key, "#%08x", profile_hash(0x811c9dc5U ^ 0xffffffffU, genericParams, governorParams, overrideParams,
+					ioScheduler, text));
+    id = key;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+  gint generation = g_atomic_int_get(&profile_generation);
+
+  if ((plan = profile_plan_find(id, hash))) {
+    profile = &plan->profile;
+    profile_rewind(profile);
+    if (profile_write(profile, 0, errorText) < 0) {
+      cached = true;
+      goto applied;
+    }
+    // The plan no longer matches sysfs, so put things back and compile it afresh.
+    profile_rollback(profile);
+    profile_plan_drop(plan);
+  }
+
+  plan = profile_plan_slot();
+  profile = &plan->profile;
+  if (!profile_init(profile, maxCpu + entries * (maxCpu + 1) + 1)) {
+    strcpy(errorText, "Out of memory");
+    goto failed;
+  }
+  if (!profile_compile(profile, maxCpu, genericParams, governorParams, overrideParams, ioScheduler, errorText)) goto failed;
+  if (profile_write(profile, 0, errorText) >= 0) goto failed;
+
+  strcpy(plan->id, id);
+  plan->hash = hash;
+  plan->generation = generation;
+
+ applied:
+  plan->used = g_get_monotonic_time();
+
+  // Report what each attribute ended up as.
+  reply_set(&req->reply, "{\"applied\": [");
+  for (s = 0; s < profile->used; s++) {
+    step = &profile->steps[s];
+    if ((!step->written && !step->skipped) || (step->kind == STEP_ONLINE)) continue;
+    if (step->written) performed++;
+    else skipped++;
+    if (!profile_current(profile, step, text, sizeof text)) strcpy(text, "");
+    reply_printf(&req->reply, "%s{\"name\": \"%s\", ", (first ? "" : ", "), step->name);
+    if (step->kind != STEP_IO) reply_printf(&req->reply, "\"cpu\": %d, ", profile->policies[step->policy].cpu);
+    if (strcmp(text, step->value)) reply_printf(&req->reply, "\"requested\": \"%s\", ", step->value);
+    reply_printf(&req->reply, "\"value\": \"%s\"}", text);
+    first = false;
+  }
+  reply_printf(&req->reply, "], \"writesPerformed\": %d, \"writesSkipped\": %d, \"cached\": %s, \"returnValue\": true}",
+	       performed, skipped, cached ? "true" : "false");
+  profile_close(profile);
+  pthread_mutex_unlock(&profile_lock);
+  return;
+
+ failed:
+  reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"rolledBack\": %s}",
+	    errorText, profile_rollback(profile) ? "true" : "false");
+  profile_plan_drop(plan);
+  pthread_mutex_unlock(&profile_lock);
+}
+
+//
+// Apply the cpufreq params and io scheduler of a profile, all or nothing
+//
+bool apply_profile_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, apply_profile_work, "/sys/block/mmcblk0/queue/scheduler");
+}
+
+//
+// Read the boot config file, which holds the sticky cpufreq params
+//
+bool get_cpufreq_file_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return simple_file(lshandle, message, BOOT_CONFIG);
+}
+
+static void get_time_in_state_work(request_t *req) {
+  char filename[MAXLINLEN];
+  int cpu = 0;
+
+  // Extract the cpu argument from the message
+  json_t *param = json_find_first_label(req->object, "cpu");
+  if (!param) {
+    // Without a cpu argument, return every cpu in one reply.
+    reply_set(&req->reply, "{");
+    append_time_in_state(&req->reply);
+    append_cpu_online(&req->reply);
+    reply_append(&req->reply, ", \"returnValue\": true}");
+    return;
+  }
+  if ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER)) {
+    cpu = atoi(param->child->text);
+  }
+
+  if ((cpu == 0) || ((cpu > 0) && (cpu < present_cpus()) && is_cpu_online(cpu))) {
+    sprintf(filename, "%s/cpu%d/cpufreq/stats/time_in_state", cpudir, cpu);
+    reply_file(req, filename);
+  }
+  else {
+    reply_set(&req->reply, "{\"returnValue\": false}");
+  }
+}
+
+//
+// Read time_in_state for one cpu, or for all of them if no cpu is given
+//
+bool get_time_in_state_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_time_in_state_work, NULL);
+}
+
+//
+// Read a file from the stats directory of the policy of the cpu in a request.
+//
+static void reply_policy_stats(request_t *req, char *name) {
+  char directory[MAXLINLEN];
+  char filename[MAXLINLEN];
+
+  cpu_policy_directory(request_cpu(req), directory);
+  sprintf(filename, "%s/stats/%s", directory, name);
+  reply_file(req, filename);
+}
+
+static void get_total_trans_work(request_t *req) {
+  reply_policy_stats(req, "total_trans");
+}
+
+static void get_trans_table_work(request_t *req) {
+  reply_policy_stats(req, "trans_table");
+}
+
+//
+// Read total_trans for the policy of a cpu (cpu 0 if none is given)
+//
+bool get_total_trans_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_total_trans_work, NULL);
+}
+
+//
+// Read trans_table for the policy of a cpu (cpu 0 if none is given)
+//
+bool get_trans_table_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_trans_table_work, NULL);
+}
+
+//
+// get_cpufreq_stats parses time_in_state and trans_table for one cpu into a list of
+// frequencies, the time (in 10ms units) spent at each, and a from/to matrix of
+// transition counts, and works out the average frequency and the busiest transitions.
+// Every reply carries a cursor.  A client which passes back the cursor of its previous
+// reply gets only the counters which have changed since then, as deltas indexed into
+// the frequency list it already has, with the derived figures covering just that
+// interval.  Recent samples are kept in a small ring for this; a client whose cursor
+// has dropped out of the ring, or whose frequency table no longer matches (or whose
+// counters were reset), simply gets a full reply again.
+//
+#define CPUFREQ_MAX_STATES 32
+#define CPUFREQ_STATS_RING 16
+#define CPUFREQ_TOP_TRANSITIONS 3
+
+typedef struct {
+  guint cursor;
+  int cpu;
+  gint64 time;
+  int states;
+  bool has_trans;
+  unsigned long freqs[CPUFREQ_MAX_STATES];
+  unsigned long long times[CPUFREQ_MAX_STATES];
+  unsigned int trans[CPUFREQ_MAX_STATES][CPUFREQ_MAX_STATES];
+} cpufreq_stats_t;
+
+static cpufreq_stats_t cpufreq_stats_ring[CPUFREQ_STATS_RING];
+static guint cpufreq_stats_cursor = 0;
+static pthread_mutex_t cpufreq_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Read and parse the stats of one cpu.  The trans_table is optional, since some
+// kernels leave it out (or truncate it when it does not fit in a page).
+//
+static bool read_cpufreq_stats(int cpu, cpufreq_stats_t *stats) {
+  char filename[MAXLINLEN];
+  char line[MAXLINLEN];
+  unsigned long freq;
+  char *p, *end;
+  int row = 0, col;
+
+  memset(stats, 0, sizeof *stats);
+  stats->cpu = cpu;
+  stats->time = g_get_monotonic_time() / 1000;
+
+  sprintf(filename, "%s/cpu%d/cpufreq/stats/time_in_state", cpudir, cpu);
+  FILE *fp = fopen(filename, "r");
+  if (!fp) return false;
+  while ((stats->states < CPUFREQ_MAX_STATES) &&
+	 (fscanf(fp, "%lu %llu", &stats->freqs[stats->states], &stats->times[stats->states]) == 2)) {
+    stats->states++;
+  }
+  fclose(fp);
+  if (!stats->states) return false;
+
+  // Rows are "freq: count count ...", in the same order as time_in_state, after
+  // a couple of header lines which do not start with a frequency.
+  sprintf(filename, "%s/cpu%d/cpufreq/stats/trans_table", cpudir, cpu);
+  fp = fopen(filename, "r");
+  if (!fp) return true;
+  while (fgets(line, MAXLINLEN, fp) && (row < stats->states)) {
+    if ((sscanf(line, "%lu", &freq) != 1) || !(p = strchr(line, ':'))) continue;
+    if (freq != stats->freqs[row]) break;
+    for (col = 0, p++; col < stats->states; col++, p = end) {
+      stats->trans[row][col] = strtoul(p, &end, 10);
+      if (end == p) break;
+    }
+    if (col < stats->states) break;
+    row++;
+  }
+  fclose(fp);
+  stats->has_trans = (row == stats->states);
+
+  return true;
+}
+
+//
+// Check that base is an earlier sample of the same table as now.
+//
+static bool cpufreq_stats_follow(cpufreq_stats_t *now, cpufreq_stats_t *base) {
+  int i, j;
+
+  if ((base->cpu != now->cpu) || (base->states != now->states) ||
+      (base->has_trans != now->has_trans)) return false;
+  for (i = 0; i < now->states; i++) {
+    if ((base->freqs[i] != now->freqs[i]) || (base->times[i] > now->times[i])) return false;
+    if (!now->has_trans) continue;
+    for (j = 0; j < now->states; j++) {
+      if (base->trans[i][j] > now->trans[i][j]) return false;
+    }
+  }
+
+  return true;
+}
+
+//
+// Append the average frequency and the busiest transitions over the interval since
+// base, or since boot if there is no base.
+//
+static void append_cpufreq_derived(reply_t *out, cpufreq_stats_t *now, cpufreq_stats_t *base) {
+  unsigned long long time, weighted = 0, total = 0, transitions = 0;
+  unsigned int count, top[CPUFREQ_TOP_TRANSITIONS][3];
+  int tops = 0, i, j, k;
+
+  for (i = 0; i < now->states; i++) {
+    time = now->times[i] - (base ? base->times[i] : 0);
+    weighted += time * now->freqs[i];
+    total += time;
+  }
+  reply_printf(out, "\"averageFreq\": %llu, ", total ? weighted / total : 0ULL);
+
+  if (!now->has_trans) return;
+
+  // Keep the busiest transitions in order, by insertion.
+  for (i = 0; i < now->states; i++) {
+    for (j = 0; j < now->states; j++) {
+      count = now->trans[i][j] - (base ? base->trans[i][j] : 0);
+      transitions += count;
+      if (!count) continue;
+      for (k = tops; (k > 0) && (top[k-1][2] < count); k--) {
+	if (k < CPUFREQ_TOP_TRANSITIONS) memcpy(top[k], top[k-1], sizeof top[k]);
+      }
+      if (k >= CPUFREQ_TOP_TRANSITIONS) continue;
+      top[k][0] = i; top[k][1] = j; top[k][2] = count;
+      if (tops < CPUFREQ_TOP_TRANSITIONS) tops++;
+    }
+  }
+
+  if (base && (now->time > base->time)) {
+    reply_printf(out, "\"transPerSec\": %.1f, ", transitions * 1000.0 / (now->time - base->time));
+  }
+  reply_append(out, "\"topTransitions\": [");
+  for (k = 0; k < tops; k++) {
+    reply_printf(out, "%s[%lu, %lu, %u]", (k ? ", " : ""),
+		 now->freqs[top[k][0]], now->freqs[top[k][1]], top[k][2]);
+  }
+  reply_append(out, "], ");
+}
+
+//
+// Append the full tables.
+//
+static void append_cpufreq_tables(reply_t *out, cpufreq_stats_t *now) {
+  int i, j;
+
+  reply_append(out, "\"freqs\": [");
+  for (i = 0; i < now->states; i++) {
+    reply_printf(out, "%s%lu", (i ? ", " : ""), now->freqs[i]);
+  }
+  reply_append(out, "], \"time\": [");
+  for (i = 0; i < now->states; i++) {
+    reply_printf(out, "%s%llu", (i ? ", " : ""), now->times[i]);
+  }
+  reply_append(out, "], ");
+
+  if (!now->has_trans) return;
+  reply_append(out, "\"trans\": [");
+  for (i = 0; i < now->states; i++) {
+    reply_append(out, (i ? ", [" : "["));
+    for (j = 0; j < now->states; j++) {
+      reply_printf(out, "%s%u", (j ? ", " : ""), now->trans[i][j]);
+    }
+    reply_append(out, "]");
+  }
+  reply_append(out, "], ");
+}
+
+//
+// Append the counters which changed since base, as [index, delta] pairs for time
+// and [from, to, delta] triples for transitions.
+//
+static void append_cpufreq_deltas(reply_t *out, cpufreq_stats_t *now, cpufreq_stats_t *base) {
+  bool first = true;
+  int i, j;
+
+  reply_append(out, "\"time\": [");
+  for (i = 0; i < now->states; i++) {
+    if (now->times[i] == base->times[i]) continue;
+    reply_printf(out, "%s[%d, %llu]", (first ? "" : ", "), i, now->times[i] - base->times[i]);
+    first = false;
+  }
+  reply_append(out, "], ");
+
+  if (!now->has_trans) return;
+  first = true;
+  reply_append(out, "\"trans\": [");
+  for (i = 0; i < now->states; i++) {
+    for (j = 0; j < now->states; j++) {
+      if (now->trans[i][j] == base->trans[i][j]) continue;
+      reply_printf(out, "%s[%d, %d, %u]", (first ? "" : ", "), i, j, now->trans[i][j] - base->trans[i][j]);
+      first = false;
+    }
+  }
+  reply_append(out, "], ");
+}
+
+static void get_cpufreq_stats_work(request_t *req) {
+  cpufreq_stats_t now, base;
+  bool delta = false;
+  guint cursor = 0;
+  int cpu = 0;
+
+  json_t *param = json_find_first_label(req->object, "cpu");
+  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
+    cpu = atoi(param->child->text);
+  }
+  param = json_find_first_label(req->object, "cursor");
+  if (param && (param->child->type == JSON_NUMBER)) {
+    cursor = strtoul(param->child->text, NULL, 10);
+  }
+
+  if ((cpu < 0) || (cpu >= present_cpus()) || (cpu && !is_cpu_online(cpu)) ||
+      !read_cpufreq_stats(cpu, &now)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"No cpufreq stats for cpu %d\"}", cpu);
+    return;
+  }
+
+  pthread_mutex_lock(&cpufreq_stats_lock);
+  if (cursor && (cpufreq_stats_ring[cursor % CPUFREQ_STATS_RING].cursor == cursor)) {
+    base = cpufreq_stats_ring[cursor % CPUFREQ_STATS_RING];
+    delta = cpufreq_stats_follow(&now, &base);
+  }
+  // Cursor zero means none, so skip it when the counter wraps.
+  if (!++cpufreq_stats_cursor) cpufreq_stats_cursor++;
+  now.cursor = cpufreq_stats_cursor;
+  cpufreq_stats_ring[now.cursor % CPUFREQ_STATS_RING] = now;
+  pthread_mutex_unlock(&cpufreq_stats_lock);
+
+  reply_set(&req->reply, "{\"cpu\": %d, \"cursor\": %u, ", cpu, now.cursor);
+  if (delta) {
+    reply_printf(&req->reply, "\"since\": %u, \"elapsed\": %lld, ", cursor, (long long)(now.time - base.time));
+    append_cpufreq_deltas(&req->reply, &now, &base);
+  }
+  else {
+    append_cpufreq_tables(&req->reply, &now);
+  }
+  append_cpufreq_derived(&req->reply, &now, (delta ? &base : NULL));
+  reply_append(&req->reply, "\"returnValue\": true}");
+}
+
+//
+// Return the parsed time_in_state and trans_table of one cpu (default cpu 0), or just
+// the changes since the reply which returned the given cursor
+//
+bool get_cpufreq_stats_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_cpufreq_stats_work, NULL);
+}
+
+//
+// The telemetry sampler reads every dashboard metric once per tick, and fans the
+// sample out to all subscribers of subscribe_telemetry, each at its own rate and
+// with only the fields it asked for.  The tick runs at the fastest subscriber
+// interval, and stops when nobody listens.
+//
+#define TELEMETRY_KEY "telemetry"
+#define TELEMETRY_MAX_SUBSCRIBERS 16
+#define TELEMETRY_DEFAULT_INTERVAL 1000
+#define TELEMETRY_MIN_INTERVAL 250
+
+// Field mask bits, so clients only pay for reading what they draw.
+#define TELEMETRY_FREQ		0x01
+#define TELEMETRY_TEMP		0x02
+#define TELEMETRY_CURRENT	0x04
+#define TELEMETRY_LOADAVG	0x08
+#define TELEMETRY_MEMINFO	0x10
+#define TELEMETRY_TIMEINSTATE	0x20
+#define TELEMETRY_CPUUTIL	0x40
+#define TELEMETRY_PRESSURE	0x80
+#define TELEMETRY_COMPCACHE	0x100
+#define TELEMETRY_ALL		0x1ff
+
+static char *telemetry_field_names[] = {
+  "freq", "temp", "current", "loadavg", "meminfo", "timeInState", "cpuUtil", "pressure", "compcache", NULL
+};
+
+#define TELEMETRY_FIELDS ((int)(sizeof telemetry_field_names / sizeof telemetry_field_names[0]) - 1)
+
+// The JSON of each field read, one after another in text, so that replies with any
+// subset of them can be put together without reading anything again.
+typedef struct {
+  reply_t text;
+  size_t start[TELEMETRY_FIELDS];
+  size_t len[TELEMETRY_FIELDS];
+  unsigned int fields;
+  long long timestamp;
+} telemetry_reading_t;
+
+typedef struct {
+  LSMessage *message;
+  guint interval;
+  unsigned int fields;
+  gint64 due;
+  bool seen;
+} telemetry_subscriber_t;
+
+static telemetry_subscriber_t telemetry_subscribers[TELEMETRY_MAX_SUBSCRIBERS];
+static guint telemetry_source = 0;
+static guint telemetry_tick = 0;
+static bool telemetry_sampling = false;
+
+// Filled in by the worker thread, and published from the main loop once it is done.
+static telemetry_reading_t telemetry_reading;
+
+// Temperature sensors, in order of preference (Veer, Pre3 & TouchPad; Pre & Pre2; Pixi).
+static char *temp_sensors[] = {
+  "/sys/class/misc/a6_0/regs/gettemp",
+  "/sys/devices/platform/omap34xx_temp/temp1_input",
+  "/sys/devices/platform/tmp105/celsius",
+  NULL
+};
+static char *a6_current = "/sys/class/misc/a6_0/regs/getcurrent";
+
+// The meminfo fields that are passed up to webOS.
+static char *telemetry_meminfo_keys[] = {
+  "MemTotal", "MemFree", "Buffers", "Cached", "SwapTotal", "SwapFree", NULL
+};
+
+//
+// Read the first temperature sensor that this device has.
+//
+static bool read_temperature(int *value) {
+  static int sensor = -1;
+  int i;
+
+  // Probe for the sensor only once, since they do not come and go.
+  if (sensor < 0) {
+    for (i = 0; temp_sensors[i]; i++) {
+      if (!access(temp_sensors[i], R_OK)) break;
+    }
+    sensor = i;
+  }
+
+  if (!temp_sensors[sensor]) return false;
+
+  return read_integer(temp_sensors[sensor], value, NULL);
+}
+
+//
+// Read the current from the A6 chip if there is one, otherwise from the battery gauge.
+//
+static bool read_current(int *value) {
+  static int a6 = -1;
+
+  // Probe for the A6 chip only once.
+  if (a6 < 0) a6 = !access(a6_current, R_OK);
+
+  if (a6) {
+    return read_integer(a6_current, value, NULL);
+  }
+  return read_battery_current(value, NULL);
+}
+
+//
+// Append the frequency of each CPU (zero when offline) as a JSON array.
+//
+static void append_cpu_freqs(reply_t *out) {
+  char filename[MAXLINLEN];
+  int cpu, value;
+
+  reply_append(out, "\"freq\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    sprintf(filename, "%s/cpu%d/cpufreq/scaling_cur_freq", cpudir, cpu);
+    if ((cpu && !is_cpu_online(cpu)) || !read_integer(filename, &value, NULL)) {
+      value = 0;
+    }
+    reply_printf(out, "%s%d", (cpu ? ", " : ""), value);
+  }
+  reply_append(out, "]");
+}
+
+//
+// Append the online state of each CPU as a JSON array.
+//
+static void append_cpu_online(reply_t *out) {
+  int cpu;
+
+  reply_append(out, "\"online\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    reply_printf(out, "%s%s", (cpu ? ", " : ""), (!cpu || is_cpu_online(cpu)) ? "true" : "false");
+  }
+  reply_append(out, "]");
+}
+
+//
+// Append the 1, 5 and 15 minute load averages as a JSON array.
+//
+static void append_loadavg(reply_t *out) {
+  float load1, load5, load15;
+
+  FILE *fp = fopen("/proc/loadavg", "r");
+  if (!fp) return;
+  if (fscanf(fp, "%f %f %f", &load1, &load5, &load15) == 3) {
+    reply_printf(out, "\"loadavg\": [%.2f, %.2f, %.2f], ", load1, load5, load15);
+  }
+  fclose(fp);
+}
+
+//
+// Append the interesting /proc/meminfo fields (in kB) as a JSON object.
+//
+static void append_meminfo(reply_t *out) {
+  char line[MAXLINLEN];
+  char key[MAXLINLEN];
+  unsigned long value;
+  bool first = true;
+  int i;
+
+  FILE *fp = fopen("/proc/meminfo", "r");
+  if (!fp) return;
+  reply_append(out, "\"meminfo\": {");
+  while (fgets(line, sizeof line, fp)) {
+    if (sscanf(line, "%[^:]: %lu", key, &value) != 2) continue;
+    for (i = 0; telemetry_meminfo_keys[i]; i++) {
+      if (!strcmp(key, telemetry_meminfo_keys[i])) {
+	reply_printf(out, "%s\"%s\": %lu", (first ? "" : ", "), key, value);
+	first = false;
+	break;
+      }
+    }
+  }
+  fclose(fp);
+  reply_append(out, "}, ");
+}
+
+//
+// Append the time_in_state table of each CPU (empty when offline) as a JSON array
+// of [frequency, time] pairs.
+//
+static void append_time_in_state(reply_t *out) {
+  char filename[MAXLINLEN];
+  unsigned long freq, time;
+  int cpu;
+
+  reply_append(out, "\"timeInState\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    reply_printf(out, "%s[", (cpu ? ", " : ""));
+    sprintf(filename, "%s/cpu%d/cpufreq/stats/time_in_state", cpudir, cpu);
+    FILE *fp = (cpu && !is_cpu_online(cpu)) ? NULL : fopen(filename, "r");
+    if (fp) {
+      bool first = true;
+      while (fscanf(fp, "%lu %lu", &freq, &time) == 2) {
+	reply_printf(out, "%s[%lu, %lu]", (first ? "" : ", "), freq, time);
+	first = false;
+      }
+      fclose(fp);
+    }
+    reply_append(out, "]");
+  }
+  reply_append(out, "], ");
+}
+
+//
+// Counters which are reported as deltas or rates (cpu times, stall totals, compcache swap
+// ins and outs, memory events) keep their last two samples as baselines, shared by every
+// reader, so a delta is since an earlier sample by anyone rather than since the caller's
+// own previous call.  The baselines are only moved on once the newest is at least
+// STAT_MIN_WINDOW old, and each reader compares with the newest baseline which is at
+// least STAT_MIN_WINDOW old (the previous one, if another reader has only just moved
+// them on), so that no reader sees a window too short to be useful.
+//
+#define STAT_MIN_WINDOW 250
+
+//
+// Pick the baseline to compare with at now, given the times of the newest baseline and
+// the one before it (zero if not taken yet).  Returns 0 or 1, or -1 if neither is old
+// enough yet.  The baselines are moved on when this returns 0, or when there is no
+// newest baseline at all.
+//
+static int baseline_window(gint64 newest, gint64 previous, gint64 now) {
+  if (newest && (now - newest >= STAT_MIN_WINDOW)) return 0;
+  if (previous && (now - previous >= STAT_MIN_WINDOW)) return 1;
+  return -1;
+}
+
+//
+// Cpu utilisation is worked out from the jiffy counters in /proc/stat, as the share of
+// the time between two samples spent in each state.  The baselines are whole samples,
+// shared by telemetry, snapshots and get_cpu_utilisation.
+//
+
+typedef struct {
+  unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+} cpu_times_t;
+
+typedef struct {
+  cpu_times_t times[MAX_CPUS+1];	// Index 0 is the "cpu" line for the whole system, and cpu N is at index N+1.
+  unsigned long long seen;
+  gint64 time;
+} cpu_sample_t;
+
+// The newest baseline is at index 0, and the one before it at index 1.
+static cpu_sample_t stat_baselines[2];
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Read the counters for the whole system and each online cpu (offline cpus are
+// missing from /proc/stat), and note which ones were found in seen.
+//
+static bool read_cpu_times(cpu_times_t *times, unsigned long long *seen) {
+  char line[MAXLINLEN];
+  cpu_times_t t;
+  int cpu, index;
+
+  FILE *fp = fopen("/proc/stat", "r");
+  if (!fp) return false;
+
+  *seen = 0;
+  while (fgets(line, MAXLINLEN, fp) && !strncmp(line, "cpu", 3)) {
+    memset(&t, 0, sizeof t);
+    if (line[3] == ' ') {
+      index = 0;
+    }
+    else if ((sscanf(line + 3, "%d", &cpu) == 1) && (cpu >= 0) && (cpu < MAX_CPUS)) {
+      index = cpu + 1;
+    }
+    else {
+      continue;
+    }
+    // Older kernels have fewer columns, and the missing ones stay zero.
+    if (sscanf(line + 3 + strcspn(line + 3, " "), "%llu %llu %llu %llu %llu %llu %llu %llu",
+	       &t.user, &t.nice, &t.system, &t.idle, &t.iowait, &t.irq, &t.softirq, &t.steal) < 4) continue;
+    times[index] = t;
+    *seen |= 1ULL << index;
+  }
+  fclose(fp);
+
+  return (*seen & 1);
+}
+
+static void append_cpu_times(reply_t *out, cpu_times_t *now, cpu_times_t *then) {
+  unsigned long long user = (now->user + now->nice) - (then->user + then->nice);
+  unsigned long long system = (now->system + now->steal) - (then->system + then->steal);
+  unsigned long long iowait = now->iowait - then->iowait;
+  unsigned long long irq = (now->irq + now->softirq) - (then->irq + then->softirq);
+  unsigned long long idle = now->idle - then->idle;
+  unsigned long long total = user + system + iowait + irq + idle;
+
+  // Idle and iowait can step backwards on some kernels when a cpu goes offline.
+  if ((now->idle < then->idle) || (now->iowait < then->iowait) || !total) {
+    reply_append(out, "null");
+    return;
+  }
+
+  reply_printf(out, "{\"user\": %.1f, \"system\": %.1f, \"iowait\": %.1f, \"irq\": %.1f, \"idle\": %.1f}",
+	       100.0 * user / total, 100.0 * system / total, 100.0 * iowait / total,
+	       100.0 * irq / total, 100.0 * idle / total);
+}
+
+//
+// Read a sample of the cpu counters, and the time it was taken, with stat_lock held.
+// Reading under the lock keeps the baselines in time order.
+//
+static bool stat_sample(cpu_sample_t *sample) {
+  if (!read_cpu_times(sample->times, &sample->seen)) return false;
+  sample->time = g_get_monotonic_time() / 1000;
+  return true;
+}
+
+//
+// Append the utilisation of the whole system, and of each CPU (null when offline),
+// as percentages of the time since the newest baseline at least STAT_MIN_WINDOW old.
+//
+static void append_cpu_utilisation(reply_t *out) {
+  cpu_sample_t now, then;
+  int cpu, i;
+
+  pthread_mutex_lock(&stat_lock);
+  if (!stat_sample(&now)) goto unlock;
+
+  // The first reader has nothing to compare with yet, so it takes the first baseline.
+  if (!stat_baselines[0].time) stat_baselines[0] = now;
+
+  // Until the first baseline is old enough, wait for the rest of its window.
+  while ((i = baseline_window(stat_baselines[0].time, stat_baselines[1].time, now.time)) < 0) {
+    gint64 wait = STAT_MIN_WINDOW - (now.time - stat_baselines[0].time);
+    pthread_mutex_unlock(&stat_lock);
+    usleep(wait * 1000);
+    pthread_mutex_lock(&stat_lock);
+    if (!stat_sample(&now)) goto unlock;
+  }
+  then = stat_baselines[i];
+
+  if (!i) {
+    stat_baselines[1] = stat_baselines[0];
+    stat_baselines[0] = now;
+  }
+  pthread_mutex_unlock(&stat_lock);
+
+  reply_append(out, "\"cpuUtil\": {\"all\": ");
+  append_cpu_times(out, &now.times[0], &then.times[0]);
+  reply_append(out, ", \"cpus\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    if (cpu) reply_append(out, ", ");
+    if ((now.seen & then.seen) & (1ULL << (cpu+1))) {
+      append_cpu_times(out, &now.times[cpu+1], &then.times[cpu+1]);
+    }
+    else {
+      reply_append(out, "null");
+    }
+  }
+  reply_append(out, "]}, ");
+  return;
+ unlock:
+  pthread_mutex_unlock(&stat_lock);
+}
+
+//
+// The baselines of a single counter.
+//
+typedef struct {
+  unsigned long long total;
+  gint64 time;
+} counter_baseline_t;
+
+//
+// Work out how far a counter has moved on, with the lock for its baselines held, and
+// move the baselines on.  Returns the milliseconds the delta covers, or zero if there
+// is no baseline old enough yet.
+//
+static gint64 counter_delta(counter_baseline_t *baselines, unsigned long long value, gint64 now,
+			    unsigned long long *delta) {
+  gint64 elapsed = 0;
+  int i;
+
+  *delta = 0;
+
+  // A counter going backwards has been reset, so start again.
+  if ((value < baselines[0].total) || (value < baselines[1].total)) {
+    memset(baselines, 0, 2 * sizeof *baselines);
+  }
+
+  i = baseline_window(baselines[0].time, baselines[1].time, now);
+  if (i >= 0) {
+    *delta = value - baselines[i].total;
+    elapsed = now - baselines[i].time;
+  }
+
+  if (!baselines[0].time || !i) {
+    baselines[1] = baselines[0];
+    baselines[0].total = value;
+    baselines[0].time = now;
+  }
+
+  return elapsed;
+}
+
+//
+// Pressure stall information (on kernels which have /proc/pressure) shows how much of
+// the time tasks were stalled waiting for cpu, memory or io, which says directly whether
+// a governor or compcache change has hurt responsiveness.  The stall totals are reported
+// as deltas since the last sample by anyone (see counter_delta), as well as the kernel's
+// running averages.
+// The number of running and blocked tasks from /proc/stat is always reported, and is
+// all there is on kernels without PSI.
+//
+static char *psi_resources[] = { "cpu", "memory", "io", NULL };
+
+// The last two baselines of the some and full totals of each resource.
+static counter_baseline_t psi_baselines[3][2][2];
+static pthread_mutex_t psi_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Append the some and full lines of one /proc/pressure file as a JSON object.
+//
+static bool append_psi_resource(reply_t *out, int resource) {
+  char filename[MAXLINLEN];
+  char line[MAXLINLEN];
+  char kind[8];
+  float avg10, avg60, avg300;
+  unsigned long long total, delta;
+  gint64 now;
+  bool first = true;
+  int k;
+
+  sprintf(filename, "/proc/pressure/%s", psi_resources[resource]);
+  FILE *fp = fopen(filename, "r");
+  if (!fp) return false;
+
+  // The file is read under the lock, so the baselines stay in time order.
+  pthread_mutex_lock(&psi_lock);
+  now = g_get_monotonic_time() / 1000;
+  reply_printf(out, "%s\"%s\": {", resource ? ", " : "", psi_resources[resource]);
+  while (fgets(line, MAXLINLEN, fp)) {
+    if (sscanf(line, "%7s avg10=%f avg60=%f avg300=%f total=%llu",
+	       kind, &avg10, &avg60, &avg300, &total) != 5) continue;
+    if (!strcmp(kind, "some")) k = 0;
+    else if (!strcmp(kind, "full")) k = 1;
+    else continue;
+
+    counter_delta(psi_baselines[resource][k], total, now, &delta);
+
+    reply_printf(out, "%s\"%s\": {\"avg10\": %.2f, \"avg60\": %.2f, \"avg300\": %.2f, \"total\": %llu, \"delta\": %llu}",
+		 first ? "" : ", ", kind, avg10, avg60, avg300, total, delta);
+    first = false;
+  }
+  pthread_mutex_unlock(&psi_lock);
+  fclose(fp);
+  reply_append(out, "}");
+
+  return true;
+}
+
+static void append_pressure(reply_t *out) {
+  char line[MAXLINLEN];
+  int running = -1, blocked = -1;
+  int i;
+
+  if (!access("/proc/pressure/cpu", R_OK)) {
+    reply_append(out, "\"pressure\": {");
+    for (i = 0; psi_resources[i]; i++) {
+      append_psi_resource(out, i);
+    }
+    reply_append(out, "}, ");
+  }
+
+  FILE *fp = fopen("/proc/stat", "r");
+  if (!fp) return;
+  while (fgets(line, MAXLINLEN, fp)) {
+    if (sscanf(line, "procs_running %d", &running) == 1) continue;
+    if (sscanf(line, "procs_blocked %d", &blocked) == 1) break;
+  }
+  fclose(fp);
+
+  if ((running >= 0) && (blocked >= 0)) {
+    reply_printf(out, "\"runQueue\": {\"running\": %d, \"blocked\": %d}, ", running, blocked);
+  }
+}
+
+//
+// Compcache statistics are parsed directly from /proc/ramzswap (the ramzswap module on
+// webOS kernels) or, on newer kernels, from the mm_stat, io_stat and stat files of each
+// /sys/block/zram* device (summed over all of them).  Sizes are in kB, and swap ins and
+// outs are counts of pages, and their rates are worked out with counter_delta.
+//
+typedef struct {
+  char *device;
+  unsigned long long origDataSize, comprDataSize, memUsedTotal, memLimit;
+  unsigned long long pagesStored, swapIns, swapOuts;
+  unsigned long long failedReads, failedWrites;
+} compcache_stats_t;
+
+// The baselines of the swap ins (index 0) and outs (index 1).
+static counter_baseline_t compcache_baselines[2][2];
+static pthread_mutex_t compcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Read /proc/ramzswap.  Returns false if the ramzswap module is not loaded.
+//
+static bool read_ramzswap(compcache_stats_t *stats) {
+  char line[MAXLINLEN];
+  char key[MAXLINLEN];
+  unsigned long long value;
+
+  FILE *fp = fopen("/proc/ramzswap", "r");
+  if (!fp) return false;
+
+  memset(stats, 0, sizeof *stats);
+  stats->device = "ramzswap";
+  while (fgets(line, sizeof line, fp)) {
+    if (sscanf(line, "%[^:]: %llu", key, &value) != 2) continue;
+    if (!strcmp(key, "OrigDataSize")) stats->origDataSize = value;
+    else if (!strcmp(key, "ComprDataSize")) stats->comprDataSize = value;
+    else if (!strcmp(key, "MemUsedTotal")) stats->memUsedTotal = value;
+    else if (!strcmp(key, "MemLimit")) stats->memLimit = value;
+    else if (!strcmp(key, "PagesStored")) stats->pagesStored = value;
+    else if (!strcmp(key, "NumReads")) stats->swapIns = value;
+    else if (!strcmp(key, "NumWrites")) stats->swapOuts = value;
+    else if (!strcmp(key, "FailedReads")) stats->failedReads = value;
+    else if (!strcmp(key, "FailedWrites")) stats->failedWrites = value;
+  }
+  fclose(fp);
+
+  return true;
+}
+
+//
+// Add the statistics of one zram device.  Returns false if it has no mm_stat.
+//
+static bool read_zram(char *name, compcache_stats_t *stats) {
+  char filename[MAXLINLEN];
+  char line[MAXLINLEN];
+  unsigned long long orig, compr, used, limit;
+  unsigned long long sectorsRead, sectorsWritten, failedReads, failedWrites;
+  unsigned long long page = getpagesize();
+
+  // mm_stat is in bytes: orig_data_size compr_data_size mem_used_total mem_limit ...
+  sprintf(filename, "/sys/block/%s/mm_stat", name);
+  if (!read_line(filename, line) ||
+      (sscanf(line, "%llu %llu %llu %llu", &orig, &compr, &used, &limit) != 4)) return false;
+
+  stats->origDataSize += orig / 1024;
+  stats->comprDataSize += compr / 1024;
+  stats->memUsedTotal += used / 1024;
+  stats->memLimit += limit / 1024;
+  stats->pagesStored += orig / page;
+
+  // The block device stat counts 512 byte sectors read (swapped in) and written (out).
+  sprintf(filename, "/sys/block/%s/stat", name);
+  if (read_line(filename, line) &&
+      (sscanf(line, "%*u %*u %llu %*u %*u %*u %llu", &sectorsRead, &sectorsWritten) == 2)) {
+    stats->swapIns += sectorsRead * 512 / page;
+    stats->swapOuts += sectorsWritten * 512 / page;
+  }
+
+  // io_stat is failed_reads failed_writes invalid_io notify_free.
+  sprintf(filename, "/sys/block/%s/io_stat", name);
+  if (read_line(filename, line) &&
+      (sscanf(line, "%llu %llu", &failedReads, &failedWrites) == 2)) {
+    stats->failedReads += failedReads;
+    stats->failedWrites += failedWrites;
+  }
+
+  return true;
+}
+
+//
+// Read the compcache statistics, from ramzswap if it is loaded, otherwise from zram.
+// Returns false if there is neither.
+//
+static bool read_compcache(compcache_stats_t *stats) {
+  struct dirent *ep;
+  bool found = false;
+
+  if (read_ramzswap(stats)) return true;
+
+  DIR *dp = opendir("/sys/block");
+  if (!dp) return false;
+
+  memset(stats, 0, sizeof *stats);
+  stats->device = "zram";
+  while ((ep = readdir(dp))) {
+    if (strncmp(ep->d_name, "zram", 4)) continue;
+    if (read_zram(ep->d_name, stats)) found = true;
+  }
+  closedir(dp);
+
+  return found;
+}
+
+//
+// Append the compcache statistics as a JSON object, if compcache is available.
+//
+static void append_compcache(reply_t *out) {
+  compcache_stats_t stats;
+  unsigned long long ins, outs;
+  gint64 now, insElapsed, outsElapsed;
+
+  pthread_mutex_lock(&compcache_lock);
+  if (!read_compcache(&stats)) {
+    pthread_mutex_unlock(&compcache_lock);
+    return;
+  }
+  now = g_get_monotonic_time() / 1000;
+  insElapsed = counter_delta(compcache_baselines[0], stats.swapIns, now, &ins);
+  outsElapsed = counter_delta(compcache_baselines[1], stats.swapOuts, now, &outs);
+  pthread_mutex_unlock(&compcache_lock);
+
+  reply_printf(out, "\"compcache\": {\"device\": \"%s\", \"origDataSize\": %llu, \"comprDataSize\": %llu, "
+	       "\"memUsedTotal\": %llu, \"memLimit\": %llu, \"compressionRatio\": %.2f, \"pagesStored\": %llu, "
+	       "\"swapIns\": %llu, \"swapOuts\": %llu, \"failedReads\": %llu, \"failedWrites\": %llu",
+	       stats.device, stats.origDataSize, stats.comprDataSize, stats.memUsedTotal, stats.memLimit,
+	       stats.comprDataSize ? (double)stats.origDataSize / stats.comprDataSize : 0.0, stats.pagesStored,
+	       stats.swapIns, stats.swapOuts, stats.failedReads, stats.failedWrites);
+
+  // Rates (pages per second) need an earlier reading to compare with.
+  if (insElapsed && outsElapsed) {
+    reply_printf(out, ", \"swapInRate\": %.1f, \"swapOutRate\": %.1f",
+		 ins * 1000.0 / insElapsed, outs * 1000.0 / outsElapsed);
+  }
+  reply_append(out, "}, ");
+}
+
+//
+// Read each metric selected by fields once, noting where the JSON of each one is.
+//
+static void telemetry_read(telemetry_reading_t *reading, unsigned int fields) {
+  reply_t *out = &reading->text;
+  int value, i;
+
+  reply_reset(out);
+  reading->fields = fields;
+  reading->timestamp = g_get_real_time() / 1000;
+
+  for (i = 0; i < TELEMETRY_FIELDS; i++) {
+    reading->start[i] = out->len;
+    switch (fields & (1U << i)) {
+    case TELEMETRY_FREQ:
+      append_cpu_freqs(out);
+      reply_append(out, ", ");
+      break;
+    case TELEMETRY_TEMP:
+      if (read_temperature(&value)) reply_printf(out, "\"temp\": %d, ", value);
+      break;
+    case TELEMETRY_CURRENT:
+      if (read_current(&value)) reply_printf(out, "\"current\": %d, ", value);
+      break;
+    case TELEMETRY_LOADAVG:
+      append_loadavg(out);
+      break;
+    case TELEMETRY_MEMINFO:
+      append_meminfo(out);
+      break;
+    case TELEMETRY_TIMEINSTATE:
+      append_time_in_state(out);
+      break;
+    case TELEMETRY_CPUUTIL:
+      append_cpu_utilisation(out);
+      break;
+    case TELEMETRY_PRESSURE:
+      append_pressure(out);
+      break;
+    case TELEMETRY_COMPCACHE:
+      append_compcache(out);
+      break;
+    }
+    reading->len[i] = out->len - reading->start[i];
+  }
+}
+
+//
+// Format the fields of a reading selected by fields as a JSON reply in out.
+//
+static void telemetry_format(reply_t *out, telemetry_reading_t *reading, unsigned int fields, bool subscribed) {
+  int i;
+
+  if (reading->text.failed) {
+    out->failed = true;
+    return;
+  }
+
+  reply_set(out, "{\"timestamp\": %lld, ", reading->timestamp);
+  for (i = 0; i < TELEMETRY_FIELDS; i++) {
+    if (fields & reading->fields & (1U << i)) {
+      reply_write(out, reading->text.text + reading->start[i], reading->len[i]);
+    }
+  }
+  if (subscribed) {
+    reply_append(out, "\"subscribed\": true, ");
+  }
+  reply_append(out, "\"returnValue\": true}");
+}
+
+//
+// Read each metric selected by fields once, and format the sample as a JSON reply in out.
+//
+static void telemetry_sample(reply_t *out, unsigned int fields, bool subscribed) {
+  telemetry_reading_t reading = { { 0 } };
+
+  telemetry_read(&reading, fields);
+  telemetry_format(out, &reading, fields, subscribed);
+  reply_free(&reading.text);
+}
+
+//
+// Extract the optional fields array from a message into a field mask.
+// Returns zero if the array names an unknown field.
+//
+static unsigned int telemetry_fields(json_t *object) {
+  unsigned int fields = 0;
+  int i;
+
+  json_t *param = json_find_first_label(object, "fields");
+  if (!param || (param->child->type != JSON_ARRAY)) return TELEMETRY_ALL;
+
+  json_t *entry = param->child->child;
+  while (entry) {
+    if (entry->type != JSON_STRING) return 0;
+    for (i = 0; telemetry_field_names[i]; i++) {
+      if (!strcmp(entry->text, telemetry_field_names[i])) break;
+    }
+    if (!telemetry_field_names[i]) return 0;
+    fields |= 1 << i;
+    entry = entry->next;
+  }
+
+  return fields ? fields : TELEMETRY_ALL;
+}
+
+static gboolean telemetry_timer(gpointer data);
+
+//
+// (Re)start the sampler at the fastest subscriber interval, or stop it if there are none.
+//
+static void telemetry_schedule(void) {
+  guint tick = 0;
+  int i;
+
+  for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+    if (telemetry_subscribers[i].message &&
+	(!tick || (telemetry_subscribers[i].interval < tick))) {
+      tick = telemetry_subscribers[i].interval;
+    }
+  }
+
+  if (telemetry_source && (tick == telemetry_tick)) return;
+
+  if (telemetry_source) g_source_remove(telemetry_source);
+  telemetry_source = tick ? g_timeout_add(tick, telemetry_timer, NULL) : 0;
+  telemetry_tick = tick;
+}
+
+//
+// Send the reading to every subscriber on one connection that is due for it,
+// with just the fields that subscriber asked for.
+//
+static void telemetry_publish(LSHandle *lshandle, telemetry_reading_t *reading, gint64 now) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  LSSubscriptionIter *iter = NULL;
+  int i;
+
+  if (!lshandle) return;
+
+  if (!LSSubscriptionAcquire(lshandle, TELEMETRY_KEY, &iter, &lserror)) goto error;
+
+  while (LSSubscriptionHasNext(iter)) {
+    LSMessage *message = LSSubscriptionNext(iter);
+    for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+      telemetry_subscriber_t *sub = &telemetry_subscribers[i];
+      if (sub->message != message) continue;
+      sub->seen = true;
+      // Allow half a tick of slack, so timer jitter does not skip a whole interval.
+      if (now + telemetry_tick / 2 >= sub->due) {
+	telemetry_format(&buffer, reading, sub->fields, false);
+	if (!LSMessageReply(lshandle, message, reply_text(&buffer), &lserror)) {
+	  LSErrorPrint(&lserror, stderr);
+	  LSErrorFree(&lserror);
+	}
+	sub->due += sub->interval;
+	if (sub->due < now) sub->due = now + sub->interval;
+      }
+      break;
+    }
+  }
+
+  LSSubscriptionRelease(iter);
+
+  return;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+}
+
+//
+// Read a telemetry sample into the reply for a request.
+//
+static void telemetry_sample_work(request_t *req) {
+  telemetry_sample(&req->reply, req->fields, req->subscribed);
+}
+
+//
+// Read the fields wanted by the subscribers that are due, for the sampler.
+//
+static void telemetry_read_work(request_t *req) {
+  telemetry_read(&telemetry_reading, req->fields);
+}
+
+//
+// Back on the main loop with a fresh sample: fan it out, and forget anyone who has left.
+//
+static void telemetry_sample_done(request_t *req) {
+  int i;
+
+  telemetry_sampling = false;
+
+  for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+    telemetry_subscribers[i].seen = false;
+  }
+
+  telemetry_publish(pub_serviceHandle, &telemetry_reading, req->time);
+  telemetry_publish(priv_serviceHandle, &telemetry_reading, req->time);
+
+  // Anyone we did not see has cancelled their subscription.
+  for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+    if (telemetry_subscribers[i].message && !telemetry_subscribers[i].seen) {
+      LSMessageUnref(telemetry_subscribers[i].message);
+      telemetry_subscribers[i].message = NULL;
+    }
+  }
+
+  telemetry_schedule();
+}
+
+//
+// Sampler tick: if any subscriber is due, take one sample on a worker thread.
+// A tick is skipped if the previous sample is still being read.
+//
+static gboolean telemetry_timer(gpointer data) {
+  gint64 now = g_get_monotonic_time() / 1000;
+  guint source = telemetry_source;
+  unsigned int fields = 0;
+  int i;
+
+  if (telemetry_sampling) return TRUE;
+
+  // Only read the union of the fields wanted by the subscribers that are due.
+  for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+    if (telemetry_subscribers[i].message &&
+	(now + telemetry_tick / 2 >= telemetry_subscribers[i].due)) {
+      fields |= telemetry_subscribers[i].fields;
+    }
+  }
+
+  if (!fields) return TRUE;
+
+  request_t *req = request_new(NULL, NULL, telemetry_read_work);
+  if (!req) return TRUE;
+
+  req->done = telemetry_sample_done;
+  req->fields = fields;
+  req->time = now;
+
+  telemetry_sampling = true;
+  request_queue(req);
+
+  return (telemetry_source == source);
+}
+
+//
+// Return a telemetry sample, and optionally subscribe to further samples
+// every interval milliseconds.
+//
+bool subscribe_telemetry_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  int interval = TELEMETRY_DEFAULT_INTERVAL;
+  bool subscribed = false;
+  int i;
+
+  json_t *object = parse_payload(message);
+
+  unsigned int fields = telemetry_fields(object);
+  if (!fields) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid fields array\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  // Extract the interval argument from the message
+  json_t *param = json_find_first_label(object, "interval");
+  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
+    interval = atoi(param->child->text);
+  }
+  if (interval < TELEMETRY_MIN_INTERVAL) interval = TELEMETRY_MIN_INTERVAL;
+
+  if (LSMessageIsSubscription(message)) {
+    for (i = 0; i < TELEMETRY_MAX_SUBSCRIBERS; i++) {
+      if (!telemetry_subscribers[i].message) break;
+    }
+    if (i == TELEMETRY_MAX_SUBSCRIBERS) {
       if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array element\"}",
+			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Too many telemetry subscribers\"}",
 			  &lserror)) goto error;
       return true;
     }
-    json_t *name = json_find_first_label(genericEntry, "name");
-    if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
-      if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name genericEntry\"}",
-			  &lserror)) goto error;
-      return true;
+
+    if (!LSSubscriptionAdd(lshandle, TELEMETRY_KEY, message, &lserror)) goto error;
+
+    LSMessageRef(message);
+    telemetry_subscribers[i].message = message;
+    telemetry_subscribers[i].interval = interval;
+    telemetry_subscribers[i].fields = fields;
+    telemetry_subscribers[i].due = g_get_monotonic_time() / 1000 + interval;
+    subscribed = true;
+
+    telemetry_schedule();
+  }
+
+  // The first sample is read on a worker thread, like all the others.
+  request_t *req = request_new(lshandle, message, telemetry_sample_work);
+  if (!req) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  req->fields = fields;
+  req->subscribed = subscribed;
+  request_queue(req);
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Return every dashboard metric (or just those named in the fields array)
+// in a single reply.
+//
+bool get_telemetry_snapshot_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  json_t *object = parse_payload(message);
+
+  unsigned int fields = telemetry_fields(object);
+  if (!fields) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid fields array\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  request_t *req = request_new(lshandle, message, telemetry_sample_work);
+  if (!req) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  req->fields = fields;
+  request_queue(req);
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+static void get_cpu_utilisation_work(request_t *req) {
+  telemetry_sample(&req->reply, TELEMETRY_CPUUTIL, false);
+}
+
+//
+// Return the user, system, iowait, irq and idle percentages of the whole system and
+// each cpu, since the previous sample
+//
+bool get_cpu_utilisation_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_cpu_utilisation_work, NULL);
+}
+
+static void get_pressure_work(request_t *req) {
+  telemetry_sample(&req->reply, TELEMETRY_PRESSURE, false);
+}
+
+//
+// Return the cpu, memory and io pressure stall information (where the kernel has it),
+// and the number of running and blocked tasks
+//
+bool get_pressure_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_pressure_work, NULL);
+}
+
+//
+// get_memory_stats parses /proc/meminfo and /proc/vmstat here, so the dashboard does not
+// have to split and parseInt every line of them in JavaScript on each tick.  Lines are
+// matched against a table of the fields we know (with the key lengths worked out at
+// compile time), and only the fields named in the optional fields array are returned.
+// Meminfo fields are in kB.  The vmstat fields are event counters, and are returned as
+// the delta and rate per second since the last sample by anyone (see counter_delta),
+// along with the raw total.
+//
+typedef struct {
+  char *key;
+  int len;
+  bool counter;
+} memstat_field_t;
+
+#define MEMSTAT_FIELD(key, counter) { key, sizeof(key) - 1, counter }
+
+static memstat_field_t memstat_fields[] = {
+  MEMSTAT_FIELD("MemTotal", false),
+  MEMSTAT_FIELD("MemFree", false),
+  MEMSTAT_FIELD("MemAvailable", false),
+  MEMSTAT_FIELD("Buffers", false),
+  MEMSTAT_FIELD("Cached", false),
+  MEMSTAT_FIELD("SwapCached", false),
+  MEMSTAT_FIELD("Active", false),
+  MEMSTAT_FIELD("Inactive", false),
+  MEMSTAT_FIELD("Dirty", false),
+  MEMSTAT_FIELD("Writeback", false),
+  MEMSTAT_FIELD("Mapped", false),
+  MEMSTAT_FIELD("Slab", false),
+  MEMSTAT_FIELD("SwapTotal", false),
+  MEMSTAT_FIELD("SwapFree", false),
+  MEMSTAT_FIELD("pswpin", true),
+  MEMSTAT_FIELD("pswpout", true),
+  MEMSTAT_FIELD("pgpgin", true),
+  MEMSTAT_FIELD("pgpgout", true),
+  MEMSTAT_FIELD("pgfault", true),
+  MEMSTAT_FIELD("pgmajfault", true),
+  { NULL, 0, false }
+};
+
+#define MEMSTAT_FIELDS ((int)(sizeof memstat_fields / sizeof memstat_fields[0]) - 1)
+#define MEMSTAT_ALL ((1U << MEMSTAT_FIELDS) - 1)
+
+// The last two baselines of each counter, shared by every caller.
+static counter_baseline_t memstat_baselines[MEMSTAT_FIELDS][2];
+static pthread_mutex_t memstat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Find the table entry for the key at the start of a line, or return -1.
+//
+static int memstat_lookup(char *line) {
+  int len = strcspn(line, ": ");
+  int i;
+
+  for (i = 0; i < MEMSTAT_FIELDS; i++) {
+    if ((memstat_fields[i].len == len) && !memcmp(line, memstat_fields[i].key, len)) return i;
+  }
+
+  return -1;
+}
+
+//
+// Append the selected fields found in one of the files.
+//
+static void append_memstats(reply_t *out, char *filename, unsigned int fields) {
+  char line[MAXLINLEN];
+  unsigned long long value, delta;
+  gint64 now, elapsed;
+  int i;
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) return;
+
+  // The file is read under the lock, so the baselines stay in time order.
+  pthread_mutex_lock(&memstat_lock);
+  now = g_get_monotonic_time() / 1000;
+  while (fgets(line, MAXLINLEN, fp)) {
+    if (((i = memstat_lookup(line)) < 0) || !(fields & (1U << i))) continue;
+    if (sscanf(line + memstat_fields[i].len, "%*[: ]%llu", &value) != 1) continue;
+
+    if (!memstat_fields[i].counter) {
+      reply_printf(out, "\"%s\": %llu, ", memstat_fields[i].key, value);
+      continue;
+    }
+
+    elapsed = counter_delta(memstat_baselines[i], value, now, &delta);
+
+    reply_printf(out, "\"%s\": {\"total\": %llu, \"delta\": %llu, \"rate\": %.1f}, ",
+		 memstat_fields[i].key, value, delta, elapsed ? delta * 1000.0 / elapsed : 0.0);
+  }
+  pthread_mutex_unlock(&memstat_lock);
+  fclose(fp);
+}
+
+//
+// Extract the optional fields array from a message into a field mask.
+// Returns zero if the array names an unknown field.
+//
+static unsigned int memstat_field_mask(json_t *object) {
+  unsigned int fields = 0;
+  int i;
+
+  json_t *param = json_find_first_label(object, "fields");
+  if (!param || (param->child->type != JSON_ARRAY)) return MEMSTAT_ALL;
+
+  json_t *entry = param->child->child;
+  while (entry) {
+    if (entry->type != JSON_STRING) return 0;
+    for (i = 0; i < MEMSTAT_FIELDS; i++) {
+      if (!strcmp(entry->text, memstat_fields[i].key)) break;
+    }
+    if (i == MEMSTAT_FIELDS) return 0;
+    fields |= 1U << i;
+    entry = entry->next;
+  }
+
+  return fields ? fields : MEMSTAT_ALL;
+}
+
+static void get_memory_stats_work(request_t *req) {
+  unsigned int meminfo = 0, vmstat = 0;
+  int i;
+
+  for (i = 0; i < MEMSTAT_FIELDS; i++) {
+    if (memstat_fields[i].counter) vmstat |= 1U << i;
+    else meminfo |= 1U << i;
+  }
+
+  reply_set(&req->reply, "{\"timestamp\": %lld, ", (long long)(g_get_real_time() / 1000));
+  if (req->fields & meminfo) {
+    append_memstats(&req->reply, "/proc/meminfo", req->fields);
+  }
+  if (req->fields & vmstat) {
+    append_memstats(&req->reply, "/proc/vmstat", req->fields);
+  }
+  reply_append(&req->reply, "\"returnValue\": true}");
+}
+
+//
+// Return the meminfo sizes and vmstat counters named in the fields array
+// (or all of them), as numbers
+//
+bool get_memory_stats_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  json_t *object = parse_payload(message);
+
+  unsigned int fields = memstat_field_mask(object);
+  if (!fields) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid fields array\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  request_t *req = request_prepare(lshandle, message, get_memory_stats_work, NULL);
+  if (!req) return true;
+
+  req->fields = fields;
+  request_queue(req);
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// The daemon keeps a history of the dashboard metrics, so the graphs survive the card
+// being closed and do not have to be rolled up in JavaScript.  A sample is taken every
+// second, and folded into three tiers of fixed-size rings: 1 second slots for the last
+// 10 minutes, 10 second slots for the last hour, and 1 minute slots for the last day.
+// Each slot keeps the min, max, sum and count of the samples that fell in it.  The
+// rings are structures of arrays, with each field of each metric contiguous, so a
+// range query only walks the memory it reports.  Slots are stamped with the time
+// period they hold, so slots left over from an earlier lap of the ring are ignored.
+//
+// There is a frequency metric for each cpufreq policy, in cpu order (see
+// cpufreq_policies), so freq1 is the policy of cpu0, and freq2 is cpu1 on a kernel with
+// a policy per cpu, or the second cluster on a big.LITTLE part.
+#define HISTORY_FREQS 4
+
+enum {
+  HISTORY_FREQ, HISTORY_TEMP = HISTORY_FREQ + HISTORY_FREQS, HISTORY_CURR, HISTORY_LOAD, HISTORY_MEM,
+  HISTORY_METRICS
+};
+
+// The names match the dashboard graphs.
+static char *history_metric_names[HISTORY_METRICS] = {
+  "freq1", "freq2", "freq3", "freq4", "temp", "curr", "load", "mem"
+};
+
+#define HISTORY_INTERVAL 1
+#define HISTORY_MAX_POINTS 1440
+
+typedef struct {
+  guint step;			// Seconds per slot.
+  int slots;
+  int base;			// Index of the first slot in the arrays below.
+} history_tier_t;
+
+static history_tier_t history_tiers[] = {
+  { 1, 600, 0 },
+  { 10, 360, 600 },
+  { 60, 1440, 960 },
+};
+
+#define HISTORY_TIERS ((int)(sizeof history_tiers / sizeof history_tiers[0]))
+#define HISTORY_SLOTS (600 + 360 + 1440)
+
+static guint32 history_stamp[HISTORY_SLOTS];
+static float history_min[HISTORY_METRICS][HISTORY_SLOTS];
+static float history_max[HISTORY_METRICS][HISTORY_SLOTS];
+static double history_sum[HISTORY_METRICS][HISTORY_SLOTS];
+static guint history_count[HISTORY_METRICS][HISTORY_SLOTS];
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool history_sampling = false;
+
+// The policies behind the frequency metrics, found at the first sample.  Which cpus
+// share a clock is fixed by the hardware, so this does not change.
+static cpufreq_policy_t history_policies[MAX_CPUS];
+static int history_policy_count = -1;
+
+//
+// Read each metric, and return a mask of those which could be read.
+//
+static unsigned int history_read(float *values) {
+  char filename[MAXLINLEN];
+  char line[MAXLINLEN];
+  char key[MAXLINLEN];
+  unsigned long kb, mem = 0;
+  unsigned int have = 0;
+  float load;
+  int value, found = 0;
+  int policy, cpu;
+
+  if (history_policy_count < 0) history_policy_count = cpufreq_policies(history_policies, ~0U);
+
+  // A policy's frequency is read through any of its cpus which is online.
+  for (policy = 0; (policy < history_policy_count) && (policy < HISTORY_FREQS); policy++) {
+    for (cpu = 0; cpu < present_cpus(); cpu++) {
+      if ((history_policies[policy].cpus & (1U << cpu)) && (!cpu || is_cpu_online(cpu))) break;
+    }
+    sprintf(filename, "%s/cpu%d/cpufreq/scaling_cur_freq", cpudir, cpu);
+    if ((cpu < present_cpus()) && read_integer(filename, &value, NULL)) {
+      values[HISTORY_FREQ + policy] = value;
+      have |= 1 << (HISTORY_FREQ + policy);
     }
-    json_t *value = json_find_first_label(genericEntry, "value");
-    if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) {
-      if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value genericEntry\"}",
-			  &lserror)) goto error;
-      return true;
+  }
+  if (read_temperature(&value)) {
+    values[HISTORY_TEMP] = value;
+    have |= 1 << HISTORY_TEMP;
+  }
+  if (read_current(&value)) {
+    values[HISTORY_CURR] = value;
+    have |= 1 << HISTORY_CURR;
+  }
+
+  FILE *fp = fopen("/proc/loadavg", "r");
+  if (fp) {
+    if (fscanf(fp, "%f", &load) == 1) {
+      values[HISTORY_LOAD] = load;
+      have |= 1 << HISTORY_LOAD;
     }
+    fclose(fp);
+  }
 
-    if (!strcmp(name->child->text, "scaling_governor")) {
-      governor = value->child->text;
+  // Memory in use is counted the same way as the dashboard: used ram plus used swap.
+  fp = fopen("/proc/meminfo", "r");
+  if (fp) {
+    while ((found < 4) && fgets(line, MAXLINLEN, fp)) {
+      if (sscanf(line, "%[^:]: %lu", key, &kb) != 2) continue;
+      if (!strcmp(key, "MemTotal") || !strcmp(key, "SwapTotal")) mem += kb, found++;
+      else if (!strcmp(key, "MemFree") || !strcmp(key, "SwapFree")) mem -= kb, found++;
+    }
+    fclose(fp);
+    if (found == 4) {
+      values[HISTORY_MEM] = mem;
+      have |= 1 << HISTORY_MEM;
     }
+  }
 
-    for (i = 0; i <= maxCpu; i++) {
-      sprintf(directory, "%s/cpu%d/cpufreq", cpudir, i);
-      sprintf(filename, "%s/%s", directory, name->child->text);
+  return have;
+}
 
-      fprintf(stderr, "Writing %s to %s\n", value->child->text, filename);
+//
+// Fold a sample (or a mean from the log) into one tier.
+//
+static void history_fold(int tier, guint32 time, float *values, unsigned int have) {
+  guint32 period = time / history_tiers[tier].step;
+  int i = history_tiers[tier].base + (period % history_tiers[tier].slots);
+  int m;
+
+  if (history_stamp[i] != period) {
+    history_stamp[i] = period;
+    for (m = 0; m < HISTORY_METRICS; m++) {
+      history_sum[m][i] = 0;
+      history_count[m][i] = 0;
+    }
+  }
+  for (m = 0; m < HISTORY_METRICS; m++) {
+    if (!(have & (1 << m))) continue;
+    if (!history_count[m][i] || (values[m] < history_min[m][i])) history_min[m][i] = values[m];
+    if (!history_count[m][i] || (values[m] > history_max[m][i])) history_max[m][i] = values[m];
+    history_sum[m][i] += values[m];
+    history_count[m][i]++;
+  }
+}
 
-      FILE *fp = fopen(filename, "w");
-      if (!fp) {
-	sprintf(errorText, "Unable to open %s", filename);
-	error = true;
-      }
-      else {
-	if (fputs(value->child->text, fp) < 0) {
-	  sprintf(errorText, "Unable to write to %s", filename);
-	  error = true;
-	}
-	if (fclose(fp)) {
-	  sprintf(errorText, "Unable to close %s", filename);
-	  error = true;
-	}
-      }
-      
-      if (error) {
-	sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
-		errorText);
-	break;
-      }
+//
+// The history is also written to a log under /var, so that it survives the service
+// being respawned or the device rebooting, and can reach days back.  The log is a
+// fixed-size file mapped into memory: a header page, then a ring of LOG_BLOCKS blocks
+// of 4kB.  The mean of each LOG_PERIOD seconds becomes a record, and the records in a
+// block are packed by column: the time deltas, then which metrics were present, then
+// each metric as zigzag varint deltas from its previous value.  That comes to under a
+// dozen bytes per record, so a block holds over an hour, and the 1MB file two weeks.
+//
+// The open block is only copied into the map when it fills, and every LOG_SYNC_INTERVAL
+// seconds, so the flash sees a page written every few minutes rather than every sample.
+// Each block carries a sequence number and a CRC, and nothing else in the file ever
+// changes, so a torn write costs no more than the block being written.  On startup the
+// newest run of valid blocks is found by sequence, and the open block is reloaded to
+// carry on from where it stopped.  Blocks are in time order, so a query finds its first
+// block with a binary search.  Records older than the newest one (after the clock has
+// been set back) are dropped, to keep it that way.
+//
+#define LOG_FILE "/var/palm/data/org.webosinternals.govnah-telemetry"
+#define LOG_MAGIC 0x4c54474f		// "OGTL"
+#define LOG_BLOCK_MAGIC 0x4b4c4254	// "TBLK"
+#define LOG_VERSION 1
+#define LOG_BLOCK_SIZE 4096
+#define LOG_BLOCKS 255
+#define LOG_PERIOD 10
+#define LOG_SYNC_INTERVAL 300
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 block_size;
+  guint32 blocks;
+  guint32 metrics;
+} log_header_t;
+
+typedef struct {
+  guint32 magic;
+  guint32 crc;			// Of everything after it, up to the end of the payload.
+  guint32 sequence;
+  guint32 first;		// Time of the first and last records.
+  guint32 last;
+  guint16 count;
+  guint16 length;		// Of the payload which follows.
+} log_block_t;
+
+#define LOG_PAYLOAD ((int)(LOG_BLOCK_SIZE - sizeof(log_block_t)))
+
+// A record takes at least a byte for its time delta, a byte for which metrics it has
+// (so there can be no more than 8 metrics), and a byte for the one metric it must have,
+// which bounds how many fit in a block.
+#define LOG_MIN_RECORD 3
+#define LOG_MAX_RECORDS (LOG_PAYLOAD / LOG_MIN_RECORD)
+
+typedef struct {
+  guint32 time;
+  unsigned int have;
+  gint32 values[HISTORY_METRICS];
+} log_record_t;
+
+// Metrics are stored as integers, so load is kept in hundredths.
+static int log_scale[HISTORY_METRICS] = { 1, 1, 1, 1, 1, 1, 100, 1 };
+
+static unsigned char *log_map = NULL;
+static int log_head = 0;		// The block the staged records go into,
+static guint32 log_sequence = 1;	// and its sequence number.
+static int log_closed = 0;		// Number of full blocks before the head.
+static log_record_t log_stage[LOG_MAX_RECORDS];
+static int log_staged = 0;
+static log_record_t log_scanned[LOG_MAX_RECORDS];	// A closed block, being scanned.
+static guint32 log_synced = 0;
+static guint32 log_last = 0;
+static guint32 log_crc_table[256];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static guint32 log_crc(unsigned char *data, int length) {
+  guint32 crc = 0xffffffff;
+
+  while (length--) crc = log_crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+  return crc ^ 0xffffffff;
+}
+
+static log_block_t *log_block(int index) {
+  return (log_block_t *)(log_map + LOG_BLOCK_SIZE * (index + 1));
+}
+
+static bool log_block_valid(log_block_t *block) {
+  return ((block->magic == LOG_BLOCK_MAGIC) && block->count && (block->count <= LOG_MAX_RECORDS) &&
+	  (block->length <= LOG_PAYLOAD) &&
+	  (block->crc == log_crc((unsigned char *)&block->sequence,
+				 sizeof(log_block_t) - 2 * sizeof(guint32) + block->length)));
+}
+
+static int log_put(unsigned char *out, int at, guint64 value) {
+  do {
+    if ((at < 0) || (at >= LOG_PAYLOAD)) return -1;
+    out[at++] = (value & 0x7f) | ((value >> 7) ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+
+  return at;
+}
+
+static int log_get(unsigned char *in, int at, int length, guint64 *value) {
+  int shift = 0;
+
+  *value = 0;
+  do {
+    if ((at < 0) || (at >= length) || (shift > 63)) return -1;
+    *value |= (guint64)(in[at] & 0x7f) << shift;
+    shift += 7;
+  } while (in[at++] & 0x80);
+
+  return at;
+}
+
+//
+// Pack records into a block payload, and return its length, or -1 if they do not fit.
+//
+static int log_encode(log_record_t *records, int count, unsigned char *out) {
+  gint64 previous, delta;
+  int at = 0, i, m;
+
+  for (i = 0; i < count; i++) {
+    at = log_put(out, at, records[i].time - records[i ? i-1 : 0].time);
+  }
+  for (i = 0; (i < count) && (at >= 0); i++) {
+    if (at >= LOG_PAYLOAD) return -1;
+    out[at++] = records[i].have;
+  }
+  for (m = 0; m < HISTORY_METRICS; m++) {
+    previous = 0;
+    for (i = 0; i < count; i++) {
+      if (!(records[i].have & (1 << m))) continue;
+      delta = records[i].values[m] - previous;
+      at = log_put(out, at, (guint64)((delta << 1) ^ (delta >> 63)));
+      previous = records[i].values[m];
     }
-    
-    genericEntry = genericEntry->next;
   }
 
-  if (governor != NULL) {
+  return at;
+}
 
-    json_t *governorEntry = governorParams->child->child;
-    while (governorEntry) {
-      if (governorEntry->type != JSON_OBJECT) {
-	if (!LSMessageReply(lshandle, message,
-			    "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array element\"}",
-			    &lserror)) goto error;
-	return true;
-      }
-      json_t *name = json_find_first_label(governorEntry, "name");
-      if (!name || (name->child->type != JSON_STRING) ||
-	  (strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
-	if (!LSMessageReply(lshandle, message,
-			    "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name governorEntry\"}",
-			    &lserror)) goto error;
-	return true;
-      }
-      json_t *value = json_find_first_label(governorEntry, "value");
-      if (!value || (value->child->type != JSON_STRING) ||
-	  (strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) {
-	if (!LSMessageReply(lshandle, message,
-			    "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value governorEntry\"}",
-			    &lserror)) goto error;
-	return true;
+//
+// Unpack the records of a block, and return how many there are, or -1 if it is corrupt.
+//
+static int log_decode(log_block_t *block, log_record_t *records) {
+  unsigned char *in = (unsigned char *)(block + 1);
+  guint64 value;
+  gint64 previous;
+  int at = 0, i, m;
+
+  for (i = 0; i < block->count; i++) {
+    at = log_get(in, at, block->length, &value);
+    records[i].time = (i ? records[i-1].time : block->first) + value;
+  }
+  for (i = 0; (i < block->count) && (at >= 0); i++) {
+    if (at >= block->length) return -1;
+    records[i].have = in[at++];
+  }
+  for (m = 0; m < HISTORY_METRICS; m++) {
+    previous = 0;
+    for (i = 0; i < block->count; i++) {
+      if (!(records[i].have & (1 << m))) continue;
+      at = log_get(in, at, block->length, &value);
+      previous += (gint64)(value >> 1) ^ -(gint64)(value & 1);
+      records[i].values[m] = previous;
+    }
+  }
+
+  return (at < 0) ? -1 : block->count;
+}
+
+//
+// Copy the first count staged records into the head block of the map.
+//
+static void log_write_head(int count) {
+  unsigned char block[LOG_BLOCK_SIZE];
+  log_block_t *header = (log_block_t *)block;
+
+  if (!count) return;
+
+  memset(block, 0, sizeof block);
+  int length = log_encode(log_stage, count, (unsigned char *)(header + 1));
+  if (length < 0) return;
+
+  header->magic = LOG_BLOCK_MAGIC;
+  header->sequence = log_sequence;
+  header->first = log_stage[0].time;
+  header->last = log_stage[count-1].time;
+  header->count = count;
+  header->length = length;
+  header->crc = log_crc((unsigned char *)&header->sequence, sizeof(log_block_t) - 2 * sizeof(guint32) + length);
+
+  memcpy(log_block(log_head), block, LOG_BLOCK_SIZE);
+  msync(log_block(log_head), LOG_BLOCK_SIZE, MS_ASYNC);
+}
+
+//
+// Move on to the next block, which drops the oldest one once the ring is full.
+//
+static void log_advance(void) {
+  log_head = (log_head + 1) % LOG_BLOCKS;
+  log_sequence++;
+  if (log_closed < LOG_BLOCKS - 1) log_closed++;
+}
+
+//
+// Add a record to the log.
+//
+static void log_append(log_record_t *record) {
+  unsigned char payload[LOG_BLOCK_SIZE];
+
+  pthread_mutex_lock(&log_lock);
+  if (!log_map || (record->time <= log_last)) {
+    pthread_mutex_unlock(&log_lock);
+    return;
+  }
+
+  log_last = record->time;
+  if (log_staged >= LOG_MAX_RECORDS) {
+    // The head is already full (and written), so this record starts the next block.
+    log_advance();
+    log_staged = 0;
+  }
+  log_stage[log_staged++] = *record;
+  if (log_encode(log_stage, log_staged, payload) < 0) {
+    // Close the head without this record, and start the next block with it.
+    log_write_head(log_staged - 1);
+    log_advance();
+    log_stage[0] = *record;
+    log_staged = 1;
+    log_synced = record->time;
+  }
+  else if (log_staged == LOG_MAX_RECORDS) {
+    log_write_head(log_staged);
+    log_advance();
+    log_staged = 0;
+  }
+  else if (record->time - log_synced >= LOG_SYNC_INTERVAL) {
+    log_write_head(log_staged);
+    log_synced = record->time;
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+//
+// Find the newest run of valid blocks, and reload the newest block to carry on with.
+//
+static void log_recover(void) {
+  log_block_t *block;
+  int best = -1, i;
+
+  for (i = 0; i < LOG_BLOCKS; i++) {
+    block = log_block(i);
+    if (log_block_valid(block) && ((best < 0) || (block->sequence > log_block(best)->sequence))) best = i;
+  }
+  if (best < 0) return;
+
+  log_head = best;
+  log_sequence = log_block(best)->sequence;
+  for (log_closed = 0; log_closed < LOG_BLOCKS - 1; log_closed++) {
+    block = log_block((best - log_closed - 1 + LOG_BLOCKS) % LOG_BLOCKS);
+    if (!log_block_valid(block) || (block->sequence != log_sequence - log_closed - 1)) break;
+  }
+
+  log_staged = log_decode(log_block(best), log_stage);
+  if (log_staged < 0) log_staged = 0;
+  log_synced = log_last = log_block(best)->last;
+
+  // A block that was closed full, before the next one was ever written, cannot be
+  // carried on with, so start the next one.
+  if (log_staged >= LOG_MAX_RECORDS) {
+    log_advance();
+    log_staged = 0;
+  }
+}
+
+//
+// Map the log, creating it (or starting it again, if it has a different layout).
+//
+static void log_open(void) {
+  size_t size = LOG_BLOCK_SIZE * (LOG_BLOCKS + 1);
+  log_header_t header;
+  struct stat st;
+  guint32 crc;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    for (crc = i, k = 0; k < 8; k++) crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    log_crc_table[i] = crc;
+  }
+
+  int fd = open(LOG_FILE, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", LOG_FILE, strerror(errno));
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if (fstat(fd, &st) || (st.st_size != (off_t)size) ||
+      (pread(fd, &header, sizeof header, 0) != sizeof header) ||
+      (header.magic != LOG_MAGIC) || (header.version != LOG_VERSION) ||
+      (header.block_size != LOG_BLOCK_SIZE) || (header.blocks != LOG_BLOCKS) ||
+      (header.metrics != HISTORY_METRICS)) {
+    header.magic = LOG_MAGIC;
+    header.version = LOG_VERSION;
+    header.block_size = LOG_BLOCK_SIZE;
+    header.blocks = LOG_BLOCKS;
+    header.metrics = HISTORY_METRICS;
+    if (ftruncate(fd, 0) || ftruncate(fd, size) ||
+	(pwrite(fd, &header, sizeof header, 0) != sizeof header)) {
+      fprintf(stderr, "Unable to create %s: %s\n", LOG_FILE, strerror(errno));
+      close(fd);
+      return;
+    }
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s: %s\n", LOG_FILE, strerror(errno));
+    return;
+  }
+
+  log_map = map;
+  log_recover();
+}
+
+typedef void (*log_func)(log_record_t *record, void *data);
+
+//
+// Call func for each record between from and to, oldest first.
+//
+static void log_scan(guint32 from, guint32 to, log_func func, void *data) {
+  log_record_t *records = log_scanned;
+  log_block_t *block;
+  int low, high, mid, count, k, i;
+
+  pthread_mutex_lock(&log_lock);
+  if (!log_map) {
+    pthread_mutex_unlock(&log_lock);
+    return;
+  }
+
+  // Find the first full block which ends at or after from.
+  low = 0;
+  high = log_closed;
+  while (low < high) {
+    mid = (low + high) / 2;
+    block = log_block((log_head - log_closed + mid + LOG_BLOCKS) % LOG_BLOCKS);
+    if (block->last < from) low = mid + 1;
+    else high = mid;
+  }
+
+  for (k = low; k < log_closed; k++) {
+    block = log_block((log_head - log_closed + k + LOG_BLOCKS) % LOG_BLOCKS);
+    if (block->first > to) break;
+    if ((count = log_decode(block, records)) < 0) continue;
+    for (i = 0; i < count; i++) {
+      if ((records[i].time >= from) && (records[i].time <= to)) func(&records[i], data);
+    }
+  }
+  for (i = 0; i < log_staged; i++) {
+    if ((log_stage[i].time >= from) && (log_stage[i].time <= to)) func(&log_stage[i], data);
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void log_record_values(log_record_t *record, float *values) {
+  int m;
+
+  for (m = 0; m < HISTORY_METRICS; m++) {
+    values[m] = (float)record->values[m] / log_scale[m];
+  }
+}
+
+//
+// Fold a record from the log back into the tiers it is coarse enough for.
+//
+static void history_replay(log_record_t *record, void *data) {
+  float values[HISTORY_METRICS];
+  int t;
+
+  log_record_values(record, values);
+  pthread_mutex_lock(&history_lock);
+  for (t = 0; t < HISTORY_TIERS; t++) {
+    if (history_tiers[t].step >= LOG_PERIOD) history_fold(t, record->time, values, record->have);
+  }
+  pthread_mutex_unlock(&history_lock);
+}
+
+//
+// Fold a sample taken at time (in seconds) into every tier.  When the sample starts a
+// new log period, the means of the period before are returned in record for the log.
+//
+static bool history_record(guint32 time, float *values, unsigned int have, log_record_t *record) {
+  static guint32 period = 0;
+  bool done = false;
+  int t, m, i;
+
+  pthread_mutex_lock(&history_lock);
+  if (period && (time / LOG_PERIOD != period)) {
+    for (t = 0; history_tiers[t].step != LOG_PERIOD; t++);
+    i = history_tiers[t].base + (period % history_tiers[t].slots);
+    if (history_stamp[i] == period) {
+      record->time = period * LOG_PERIOD;
+      record->have = 0;
+      for (m = 0; m < HISTORY_METRICS; m++) {
+	if (!history_count[m][i]) continue;
+	double mean = history_sum[m][i] / history_count[m][i] * log_scale[m];
+	record->values[m] = (gint32)((mean < 0) ? mean - 0.5 : mean + 0.5);
+	record->have |= 1 << m;
       }
+      done = (record->have != 0);
+    }
+  }
+  period = time / LOG_PERIOD;
 
-      for (i = 0; i <= maxCpu; i++) {
-	sprintf(directory, "%s/cpufreq/%s", cpudir, governor);
-	dp = opendir (directory);
-	if (!dp) {
-	  sprintf(directory, "%s/cpu%d/cpufreq/%s", cpudir, i, governor);
-	}
-	else {
-	  i = maxCpu;
-	  closedir(dp);
-	}
-	sprintf(filename, "%s/%s", directory, name->child->text);
+  for (t = 0; t < HISTORY_TIERS; t++) {
+    history_fold(t, time, values, have);
+  }
+  pthread_mutex_unlock(&history_lock);
 
-	fprintf(stderr, "Writing %s to %s\n", value->child->text, filename);
+  return done;
+}
 
-	FILE *fp = fopen(filename, "w");
-	if (!fp) {
-	  sprintf(errorText, "Unable to open %s", filename);
-	  error = true;
-	}
-	else {
-	  if (fputs(value->child->text, fp) < 0) {
-	    sprintf(errorText, "Unable to write to %s", filename);
-	    error = true;
-	  }
-	  if (fclose(fp)) {
-	    sprintf(errorText, "Unable to close %s", filename);
-	    error = true;
-	  }
-	}
-      
-	if (error) {
-	  sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
-		  errorText);
-	  break;
-	}
+static void history_sample_work(request_t *req) {
+  float values[HISTORY_METRICS];
+  unsigned int have = history_read(values);
+  log_record_t record;
+
+  if (history_record(g_get_real_time() / G_USEC_PER_SEC, values, have, &record)) {
+    log_append(&record);
+  }
+}
+
+static void history_sample_done(request_t *req) {
+  history_sampling = false;
+}
+
+//
+// Sampler tick: read the metrics on a worker thread, unless the last read is still going.
+//
+static gboolean history_timer(gpointer data) {
+  if (history_sampling) return TRUE;
+
+  request_t *req = request_new(NULL, NULL, history_sample_work);
+  if (!req) return TRUE;
+
+  req->done = history_sample_done;
+  history_sampling = true;
+  request_queue(req);
+
+  return TRUE;
+}
+
+//
+// Open the log and refill the coarser tiers from it, then start sampling.
+//
+static void history_init(void) {
+  guint32 now = g_get_real_time() / G_USEC_PER_SEC;
+  history_tier_t *t = &history_tiers[HISTORY_TIERS-1];
+
+  log_open();
+  log_scan(now - t->step * t->slots, now, history_replay, NULL);
+
+  g_timeout_add_seconds(HISTORY_INTERVAL, history_timer, NULL);
+}
+
+//
+// Find the finest tier which still holds from, with slots no longer than step.
+// Returns -1 for ranges older than any tier holds.
+//
+static int history_tier(guint32 now, guint32 from, guint step) {
+  int t;
+
+  for (t = 0; t < HISTORY_TIERS; t++) {
+    if ((now - from < history_tiers[t].step * history_tiers[t].slots) &&
+	((t == HISTORY_TIERS - 1) || (step < history_tiers[t+1].step))) return t;
+  }
+
+  return -1;
+}
+
+static guint32 history_param(json_t *object, char *label, guint32 value) {
+  json_t *param = json_find_first_label(object, label);
+
+  if (param && (param->child->type == JSON_NUMBER)) {
+    return strtoul(param->child->text, NULL, 10);
+  }
+
+  return value;
+}
+
+typedef struct {
+  float min, max;
+  double sum;
+  guint count;
+} history_bucket_t;
+
+typedef struct {
+  history_bucket_t *buckets;
+  guint32 start;
+  guint step;
+  int metric;
+} history_query_t;
+
+static void history_bucket_add(history_bucket_t *bucket, float min, float max, double sum, guint count) {
+  if (!bucket->count || (min < bucket->min)) bucket->min = min;
+  if (!bucket->count || (max > bucket->max)) bucket->max = max;
+  bucket->sum += sum;
+  bucket->count += count;
+}
+
+//
+// Add the slots of a tier to the buckets of a query.
+//
+static void history_fill(history_query_t *query, int tier, int buckets) {
+  history_tier_t *t = &history_tiers[tier];
+  guint32 period;
+  int b, i, m = query->metric;
+
+  pthread_mutex_lock(&history_lock);
+  for (b = 0; b < buckets; b++) {
+    guint32 bucket = query->start + b * query->step;
+    for (period = bucket / t->step; period < (bucket + query->step) / t->step; period++) {
+      i = t->base + (period % t->slots);
+      if ((history_stamp[i] != period) || !history_count[m][i]) continue;
+      history_bucket_add(&query->buckets[b], history_min[m][i], history_max[m][i],
+			 history_sum[m][i], history_count[m][i]);
+    }
+  }
+  pthread_mutex_unlock(&history_lock);
+}
+
+//
+// Add a record from the log to the buckets of a query.
+//
+static void history_fill_record(log_record_t *record, void *data) {
+  history_query_t *query = (history_query_t *)data;
+  float values[HISTORY_METRICS];
+
+  if (!(record->have & (1 << query->metric)) || (record->time < query->start)) return;
+  log_record_values(record, values);
+  history_bucket_add(&query->buckets[(record->time - query->start) / query->step],
+		     values[query->metric], values[query->metric], values[query->metric], 1);
+}
+
+//
+// Append the buckets which have samples as parallel time, min, max, mean and count arrays.
+//
+static void append_history(reply_t *out, history_query_t *query, int buckets) {
+  static char *fields[] = { "time", "min", "max", "mean", "count" };
+  history_bucket_t *bucket;
+  int field, b;
+
+  for (field = 0; field < 5; field++) {
+    bool first = true;
+    reply_printf(out, "%s\"%s\": [", (field ? ", " : ""), fields[field]);
+    for (b = 0; b < buckets; b++) {
+      bucket = &query->buckets[b];
+      if (!bucket->count) continue;
+      reply_append(out, (first ? "" : ", "));
+      first = false;
+      switch (field) {
+      case 0: reply_printf(out, "%u", query->start + b * query->step); break;
+      case 1: reply_printf(out, "%.7g", bucket->min); break;
+      case 2: reply_printf(out, "%.7g", bucket->max); break;
+      case 3: reply_printf(out, "%.7g", bucket->sum / bucket->count); break;
+      case 4: reply_printf(out, "%u", bucket->count); break;
       }
-    
-      governorEntry = governorEntry->next;
     }
+    reply_append(out, "]");
   }
+}
 
-  json_t *overrideEntry = overrideParams->child->child;
-  while (overrideEntry) {
-    if (overrideEntry->type != JSON_OBJECT) {
-      if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array element\"}",
-			  &lserror)) goto error;
-      return true;
-    }
-    json_t *name = json_find_first_label(overrideEntry, "name");
-    if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) {
-      if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing name overrideEntry\"}",
-			  &lserror)) goto error;
-      return true;
-    }
-    json_t *value = json_find_first_label(overrideEntry, "value");
-    if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) {
-      if (!LSMessageReply(lshandle, message,
-			  "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value overrideEntry\"}",
-			  &lserror)) goto error;
-      return true;
-    }
+static void get_history_work(request_t *req) {
+  guint32 now = g_get_real_time() / G_USEC_PER_SEC;
+  history_query_t query;
+  guint32 from, to;
+  guint step, slot;
+  int metric, tier, buckets;
 
-    for (i = 0; i <= maxCpu; i++) {
-      sprintf(directory, "%s/cpufreq/override", cpudir);
-      dp = opendir (directory);
-      if (!dp) {
-	sprintf(directory, "%s/cpu%d/cpufreq/override", cpudir, i);
-      }
-      else {
-	i = maxCpu;
-	closedir(dp);
-      }
-      sprintf(filename, "%s/%s", directory, name->child->text);
+  json_t *param = json_find_first_label(req->object, "metric");
+  for (metric = 0; param && (param->child->type == JSON_STRING) && (metric < HISTORY_METRICS); metric++) {
+    if (!strcmp(param->child->text, history_metric_names[metric])) break;
+  }
+  if (!param || (param->child->type != JSON_STRING) || (metric == HISTORY_METRICS)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unknown metric\"}");
+    return;
+  }
 
-      fprintf(stderr, "Writing %s to %s\n", value->child->text, filename);
+  to = history_param(req->object, "to", now);
+  from = history_param(req->object, "from", to - 300);
+  step = history_param(req->object, "step", 1);
+  if (to > now) to = now;
+  if ((from > to) || !step) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid range\"}");
+    return;
+  }
 
-      FILE *fp = fopen(filename, "w");
-      if (!fp) {
-	sprintf(errorText, "Unable to open %s", filename);
-	error = true;
-      }
-      else {
-	if (fputs(value->child->text, fp) < 0) {
-	  sprintf(errorText, "Unable to write to %s", filename);
-	  error = true;
-	}
-	if (fclose(fp)) {
-	  sprintf(errorText, "Unable to close %s", filename);
-	  error = true;
-	}
-      }
-      
-      if (error) {
-	sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
-		errorText);
-	break;
-      }
-    }
-    
-    overrideEntry = overrideEntry->next;
+  // Ranges older than the tiers hold come from the log.  Steps are whole slots
+  // (or log periods), and there are never too many of them.
+  tier = history_tier(now, from, step);
+  slot = (tier < 0) ? LOG_PERIOD : history_tiers[tier].step;
+  step = ((step + slot - 1) / slot) * slot;
+  while ((to - from) / step >= HISTORY_MAX_POINTS) step += slot;
+
+  query.metric = metric;
+  query.step = step;
+  query.start = from - (from % step);
+  buckets = (to - query.start) / step + 1;
+  query.buckets = (history_bucket_t *)calloc(buckets, sizeof(history_bucket_t));
+  if (!query.buckets) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}");
+    return;
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  if (tier < 0) {
+    log_scan(query.start, to, history_fill_record, &query);
+  }
+  else {
+    history_fill(&query, tier, buckets);
+  }
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  reply_set(&req->reply, "{\"metric\": \"%s\", \"from\": %u, \"to\": %u, \"step\": %u, ",
+	    history_metric_names[metric], from, to, step);
+  append_history(&req->reply, &query, buckets);
+  reply_append(&req->reply, ", \"returnValue\": true}");
+
+  free(query.buckets);
 }
 
 //
-// Write upstart script to make cpufreq params "sticky"
+// Return the min, max, mean and count of a dashboard metric in each step seconds
+// between from and to (default the last five minutes, in 1 second steps).  Ranges
+// older than a day are answered from the log, in 10 second means
 //
-bool stick_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+bool get_history_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_history_work, NULL);
+}
 
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
+//
+// Cpufreq and cpu hotplug attributes are watched for changes made by anyone (including
+// other tools), and changes are published to subscribers of subscribe_sysfs_changes,
+// so the settings scenes do not have to poll.  Attributes which the kernel updates with
+// sysfs_notify wake us straight away through poll(POLLPRI); all of them are also checked
+// every WATCH_INTERVAL milliseconds, since most cpufreq attributes are never notified
+// (and inotify does not see sysfs attribute changes at all).  The attributes are always
+// read on a worker thread, and the watches stop when the last subscriber leaves.
+//
+#define WATCH_KEY "sysfsChanges"
+#define WATCH_INTERVAL 2000
+// Three cpufreq attributes for each policy, and the online attribute of each cpu.
+#define WATCH_MAX_ATTRS (MAX_CPUS * 4)
+
+typedef struct {
+  char *name;
+  int cpu;
+  char path[MAXLINLEN];
+  int fd;
+  guint source;
+  GIOChannel *channel;
+  char value[MAXLINLEN];	// Last published value, used on the main loop.
+  char sample[MAXLINLEN];	// Freshly read value, written by the worker thread.
+  bool sampled;
+  bool known;
+} watch_attr_t;
+
+static watch_attr_t watch_attrs[WATCH_MAX_ATTRS];
+static int watch_count = 0;
+static guint watch_source = 0;
+static bool watch_checking = false;
+
+static char *watch_cpufreq_names[] = {
+  "scaling_governor", "scaling_min_freq", "scaling_max_freq", NULL
+};
 
-  bool error = false;
-  char *governor = NULL;
-  int maxCpu = 0;
-  int i;
-  DIR *dp;
+static gboolean watch_notify(GIOChannel *channel, GIOCondition condition, gpointer data);
 
-  sprintf(buffer, "{\"returnValue\": true }");
+//
+// Read the current value of a watched attribute, without the trailing newline.
+// Reading from the start of the file also re-arms poll(POLLPRI) for the next change.
+//
+static bool watch_read(int fd, char *value) {
+  ssize_t len = pread(fd, value, MAXLINLEN-1, 0);
+  if (len < 0) return false;
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  while (len && ((value[len-1] == '\n') || (value[len-1] == ' '))) len--;
+  value[len] = '\0';
 
-  // Extract the maxCpu argument from the message
-  json_t *param = json_find_first_label(object, "maxCpu");
-  if (param && ((param->child->type == JSON_STRING) || param->child->type == JSON_NUMBER)) {
-    maxCpu = atoi(param->child->text);
+  return true;
+}
+
+static void watch_arm(watch_attr_t *attr) {
+  if (attr->channel && !attr->source) {
+    attr->source = g_io_add_watch(attr->channel, G_IO_PRI | G_IO_ERR, watch_notify, attr);
   }
+}
 
-  // Extract the genericParams argument from the message
-  json_t *genericParams = json_find_first_label(object, "genericParams");
-  if (!genericParams || (genericParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing genericParams array\"}",
-			&lserror)) goto error;
-    return true;
+static void watch_add(char *name, int cpu, char *path) {
+  if (watch_count == WATCH_MAX_ATTRS) {
+    fprintf(stderr, "Unable to watch %s: too many attributes\n", path);
+    return;
   }
 
-  // Extract the governorParams argument from the message
-  json_t *governorParams = json_find_first_label(object, "governorParams");
-  if (!governorParams || (governorParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing governorParams array\"}",
-			&lserror)) goto error;
-    return true;
+  watch_attr_t *attr = &watch_attrs[watch_count];
+
+  attr->fd = attr_open(path);
+  if (attr->fd < 0) return;
+
+  attr->name = name;
+  attr->cpu = cpu;
+  strcpy(attr->path, path);
+  attr->source = 0;
+  attr->sampled = false;
+  attr->known = false;
+
+  // The first check fills in the value, and arms the watch.
+  attr->channel = g_io_channel_unix_new(attr->fd);
+
+  watch_count++;
+}
+
+//
+// Publish a message to every subscriber to a key on one connection, and count them.
+//
+static int publish_subscribers(LSHandle *lshandle, char *key, char *text) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  LSSubscriptionIter *iter = NULL;
+  int count = 0;
+
+  if (!lshandle) return 0;
+
+  if (!LSSubscriptionAcquire(lshandle, key, &iter, &lserror)) goto error;
+
+  while (LSSubscriptionHasNext(iter)) {
+    LSMessage *message = LSSubscriptionNext(iter);
+    count++;
+    if (text && !LSMessageReply(lshandle, message, text, &lserror)) {
+      LSErrorPrint(&lserror, stderr);
+      LSErrorFree(&lserror);
+    }
   }
 
-  // Extract the overrideParams argument from the message
-  json_t *overrideParams = json_find_first_label(object, "overrideParams");
-  if (!overrideParams || (overrideParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing overrideParams array\"}",
-			&lserror)) goto error;
-    return true;
+  LSSubscriptionRelease(iter);
+
+  return count;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return 0;
+}
+
+static void append_watched(reply_t *out, char *name, int cpu, char *value, bool *first) {
+  reply_printf(out, "%s{\"attribute\": \"%s\", \"cpu\": %d, \"value\": \"", *first ? "" : ", ", name, cpu);
+  reply_escape(out, value);
+  reply_append(out, "\"}");
+  *first = false;
+}
+
+static void watch_stop(void) {
+  int i;
+
+  for (i = 0; i < watch_count; i++) {
+    if (watch_attrs[i].source) g_source_remove(watch_attrs[i].source);
+    g_io_channel_unref(watch_attrs[i].channel);
+    close(watch_attrs[i].fd);
   }
+  watch_count = 0;
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-settings");
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  if (watch_source) g_source_remove(watch_source);
+  watch_source = 0;
+}
+
+static void watch_check_work(request_t *req) {
+  int i;
+
+  for (i = 0; i < watch_count; i++) {
+    watch_attrs[i].sampled = watch_read(watch_attrs[i].fd, watch_attrs[i].sample);
   }
+}
 
-  error = false;
-  if (fputs("description \"Govnah Settings\"\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("start on stopped finish\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("script\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevBootPanicked`\" = \"false\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevShutdownClean`\" = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m -n com.palm.system last_umount_clean`\"  = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
- 
-  if (maxCpu) {
-    // Bring the other CPUs online
-    for (i = 1; i <= maxCpu; i++) {
-      sprintf(line, "echo -n '1' > %s/cpu%d/online || true\n", cpudir, i);
-      if (fputs(line, fp) < 0) error = true;
+//
+// Back on the main loop after a check: publish anything which has changed, re-arm the
+// watches, and stop watching if nobody is listening any more.
+//
+static void watch_check_done(request_t *req) {
+  bool changed = false;
+  bool first = true;
+  int i;
+
+  watch_checking = false;
+
+  // The first value read for each attribute is only a baseline.
+  reply_set(&buffer, "{\"attributes\": [");
+  for (i = 0; i < watch_count; i++) {
+    watch_attr_t *attr = &watch_attrs[i];
+    if (!attr->sampled) continue;
+    if (attr->known && strcmp(attr->sample, attr->value)) {
+      append_watched(&buffer, attr->name, attr->cpu, attr->sample, &first);
+      changed = true;
     }
-    if (fputs("\n", fp) < 0) error = true;
+    strcpy(attr->value, attr->sample);
+    attr->known = true;
   }
-  
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  reply_append(&buffer, "], \"subscribed\": true, \"returnValue\": true}");
+
+  int subscribers = (publish_subscribers(pub_serviceHandle, WATCH_KEY, changed ? reply_text(&buffer) : NULL) +
+		     publish_subscribers(priv_serviceHandle, WATCH_KEY, changed ? reply_text(&buffer) : NULL));
+
+  for (i = 0; i < watch_count; i++) {
+    if (watch_attrs[i].sampled) watch_arm(&watch_attrs[i]);
   }
-  
-  json_t *genericEntry = genericParams->child->child;
-  while (genericEntry) {
-    if (genericEntry->type != JSON_OBJECT) goto loop1;
-    json_t *name = json_find_first_label(genericEntry, "name");
-    if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) goto loop1;
-    json_t *value = json_find_first_label(genericEntry, "value");
-    if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) goto loop1;
 
-    if (!strcmp(name->child->text, "scaling_governor")) {
-      governor = value->child->text;
-    }
+  if (!subscribers) watch_stop();
+}
 
-    for (i = 0; i <= maxCpu; i++) {
-      sprintf(directory, "%s/cpu%d/cpufreq", cpudir, i);
-      fprintf(stderr, "echo %s > %s/%s\n", value->child->text, directory, name->child->text);
-      sprintf(line, "echo -n '%s' > %s/%s\n", value->child->text, directory, name->child->text);
+static void watch_check(void) {
+  if (watch_checking || !watch_count) return;
 
-      if (fputs(line, fp) < 0) {
-	(void)fclose(fp);
-	(void)unlink(filename);
-	sprintf(buffer,
-		"{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-		filename);
-	if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-	return true;
-      }
-    }
-      
-  loop1:
-    genericEntry = genericEntry->next;
-  }
+  request_t *req = request_new(NULL, NULL, watch_check_work);
+  if (!req) return;
 
-  if (governor != NULL) {
+  req->done = watch_check_done;
 
-    json_t *governorEntry = governorParams->child->child;
-    while (governorEntry) {
-      if (governorEntry->type != JSON_OBJECT) goto loop2;
-      json_t *name = json_find_first_label(governorEntry, "name");
-      if (!name || (name->child->type != JSON_STRING) ||
-	  (strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) goto loop2;
-      json_t *value = json_find_first_label(governorEntry, "value");
-      if (!value || (value->child->type != JSON_STRING) ||
-	  (strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) goto loop2;
+  watch_checking = true;
+  request_queue(req);
+}
 
-      for (i = 0; i <= maxCpu; i++) {
-	sprintf(directory, "%s/cpufreq/%s", cpudir, governor);
-	dp = opendir (directory);
-	if (!dp) {
-	  sprintf(directory, "%s/cpu%d/cpufreq/%s", cpudir, i, governor);
-	}
-	else {
-	  i = maxCpu;
-	  closedir(dp);
-	}
-	fprintf(stderr, "echo %s > %s/%s\n", value->child->text, directory, name->child->text);
-	sprintf(line, "echo -n '%s' > %s/%s\n", value->child->text, directory, name->child->text);
-	if (fputs(line, fp) < 0) {
-	  (void)fclose(fp);
-	  (void)unlink(filename);
-	  sprintf(buffer,
-		  "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-		  filename);
-	if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-	return true;
-	}
-      }
-      
-    loop2:
-      governorEntry = governorEntry->next;
+//
+// The kernel has notified a change.  Stop watching until the attribute has been read
+// (poll keeps reporting it until then), and check everything straight away.
+//
+static gboolean watch_notify(GIOChannel *channel, GIOCondition condition, gpointer data) {
+  watch_attr_t *attr = (watch_attr_t *)data;
+
+  attr->source = 0;
+  watch_check();
+
+  return FALSE;
+}
+
+static gboolean watch_timer(gpointer data) {
+  watch_check();
+  return TRUE;
+}
+
+//
+// Open the cpufreq attributes of every policy (reported against its first cpu),
+// and the online attribute of every cpu but cpu0, which cannot be taken offline.
+//
+static void watch_start(void) {
+  cpufreq_policy_t policies[MAX_CPUS];
+  char directory[MAXLINLEN];
+  char path[MAXLINLEN];
+  int count, cpu, i, p;
+
+  if (watch_count) return;
+
+  count = cpufreq_policies(policies, ~0U);
+  for (p = 0; p < count; p++) {
+    policy_directory(&policies[p], directory);
+    for (i = 0; watch_cpufreq_names[i]; i++) {
+      sprintf(path, "%s/%s", directory, watch_cpufreq_names[i]);
+      watch_add(watch_cpufreq_names[i], policies[p].cpu, path);
     }
   }
 
-  json_t *overrideEntry = overrideParams->child->child;
-  while (overrideEntry) {
-    if (overrideEntry->type != JSON_OBJECT) goto loop3;
-    json_t *name = json_find_first_label(overrideEntry, "name");
-    if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS) != strlen(name->child->text))) goto loop3;
-    json_t *value = json_find_first_label(overrideEntry, "value");
-    if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS" ") != strlen(value->child->text))) goto loop3;
+  for (cpu = 1; cpu < present_cpus(); cpu++) {
+    sprintf(path, "%s/cpu%d/online", cpudir, cpu);
+    watch_add("online", cpu, path);
+  }
 
-    for (i = 0; i <= maxCpu; i++) {
-      sprintf(directory, "%s/cpufreq/override", cpudir);
-      dp = opendir (directory);
-      if (!dp) {
-	sprintf(directory, "%s/cpu%d/cpufreq/override", cpudir, i);
-      }
-      else {
-	i = maxCpu;
-	closedir(dp);
-      }
-      fprintf(stderr, "echo %s > %s/%s\n", value->child->text, directory, name->child->text);
-      sprintf(line, "echo -n '%s' > %s/%s\n", value->child->text, directory, name->child->text);
-      if (fputs(line, fp) < 0) {
-	(void)fclose(fp);
-	(void)unlink(filename);
-	sprintf(buffer,
-		"{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-		filename);
-	if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-	return true;
-      }
+  if (watch_count) {
+    watch_source = g_timeout_add(WATCH_INTERVAL, watch_timer, NULL);
+  }
+}
+
+//
+// Read the watched attributes for the first reply.  This opens each one afresh rather
+// than using the watches, which belong to the main loop and the checker, or the
+// attribute cache, whose few slots are for the attributes polled all the time.
+//
+static void watch_snapshot_work(request_t *req) {
+  cpufreq_policy_t policies[MAX_CPUS];
+  char directory[MAXLINLEN];
+  char path[MAXLINLEN];
+  char value[MAXLINLEN];
+  bool first = true;
+  int count, cpu, i, len, p;
+
+  reply_set(&req->reply, "{\"attributes\": [");
+
+  count = cpufreq_policies(policies, ~0U);
+  for (p = 0; p < count; p++) {
+    policy_directory(&policies[p], directory);
+    for (i = 0; watch_cpufreq_names[i]; i++) {
+      sprintf(path, "%s/%s", directory, watch_cpufreq_names[i]);
+      if (!read_line(path, value)) continue;
+      for (len = strlen(value); len && (value[len-1] == ' '); ) value[--len] = '\0';
+      append_watched(&req->reply, watch_cpufreq_names[i], policies[p].cpu, value, &first);
     }
-      
-  loop3:
-    overrideEntry = overrideEntry->next;
   }
 
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("end script\n", fp) < 0) error = true;
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  for (cpu = 1; cpu < present_cpus(); cpu++) {
+    sprintf(path, "%s/cpu%d/online", cpudir, cpu);
+    if (!read_line(path, value)) continue;
+    append_watched(&req->reply, "online", cpu, value, &first);
   }
-  
-  if (fclose(fp)) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+
+  reply_printf(&req->reply, "], \"subscribed\": %s, \"returnValue\": true}",
+	       req->subscribed ? "true" : "false");
+}
+
+//
+// Return the current governor, frequency limits and cpu online states, and optionally
+// subscribe to a message listing the attributes that have changed, whenever they change.
+//
+bool subscribe_sysfs_changes_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  bool subscribed = false;
+
+  if (LSMessageIsSubscription(message)) {
+    if (!LSSubscriptionAdd(lshandle, WATCH_KEY, message, &lserror)) goto error;
+    subscribed = true;
+  }
+
+  // Watches started for a one-off read are stopped again by the first check.
+  watch_start();
+
+  request_t *req = request_prepare(lshandle, message, watch_snapshot_work, NULL);
+  if (req) {
+    req->subscribed = subscribed;
+    request_queue(req);
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  // Read a baseline for the watches straight away.
+  watch_check();
 
   return true;
  error:
@@ -1258,126 +6221,216 @@ bool stick_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *c
 }
 
 //
-// Delete cpufreq params upstart script
+// Cpu hotplug is tracked by listening for kernel uevents on a netlink socket on the
+// main loop.  Each online or offline event updates the online bitmap, and is kept
+// with a timestamp (and published to subscribers), so we can see how often a cpu flaps.
 //
-bool unstick_cpufreq_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+#define HOTPLUG_KEY "hotplug"
+#define HOTPLUG_EVENTS 64
+#define UEVENT_BUFFER_SIZE 4096
+
+typedef struct {
+  gint64 timestamp;		// Milliseconds since the epoch.
+  int cpu;
+  bool online;
+} hotplug_event_t;
+
+static hotplug_event_t hotplug_events[HOTPLUG_EVENTS];
+static unsigned long hotplug_event_count = 0;
+static unsigned long hotplug_transitions[MAX_CPUS];
+
+static void append_hotplug_event(reply_t *out, hotplug_event_t *event, bool *first) {
+  reply_printf(out, "%s{\"cpu\": %d, \"online\": %s, \"timestamp\": %lld}", *first ? "" : ", ",
+	       event->cpu, event->online ? "true" : "false", (long long)event->timestamp);
+  *first = false;
+}
+
+//
+// Read the current state of every cpu into the bitmap (cpu0 is always online).
+//
+static void hotplug_seed(void) {
+  int cpu;
+
+  unsigned int online;
+
+  if (read_cpu_list("online", &online)) {
+    g_atomic_int_set(&cpu_online_mask, (gint)(online | 1));
+    return;
+  }
+
+  for (cpu = 1; cpu < present_cpus(); cpu++) {
+    cpu_online_update(cpu, read_cpu_online(cpu));
+  }
+}
 
-  char filename[MAXLINLEN];
+static void hotplug_record(int cpu, bool online) {
+  char directory[MAXLINLEN];
+  bool first = true;
 
-  sprintf(buffer, "{\"returnValue\": true }");
+  cpu_online_update(cpu, online);
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-settings");
-  (void)unlink(filename);
+  // The cpufreq directory goes away when a cpu goes offline, and is recreated later.
+  sprintf(directory, "%s/cpu%d/cpufreq/", cpudir, cpu);
+  attr_cache_invalidate(directory);
+  if (!online) g_atomic_int_inc(&profile_generation);
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  hotplug_event_t *event = &hotplug_events[hotplug_event_count++ % HOTPLUG_EVENTS];
+  event->timestamp = g_get_real_time() / 1000;
+  event->cpu = cpu;
+  event->online = online;
+  hotplug_transitions[cpu]++;
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
-}
+  reply_set(&buffer, "{\"events\": [");
+  append_hotplug_event(&buffer, event, &first);
+  reply_append(&buffer, "], \"subscribed\": true, \"returnValue\": true}");
 
-//
-// Read cpufreq_params file
-//
-bool get_cpufreq_file_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message,
-			"/bin/cat /var/palm/event.d/org.webosinternals.govnah-settings 2>&1");
+  publish_subscribers(pub_serviceHandle, HOTPLUG_KEY, reply_text(&buffer));
+  publish_subscribers(priv_serviceHandle, HOTPLUG_KEY, reply_text(&buffer));
 }
 
 //
-// Read time_in_state
+// A uevent is a header ("online@/devices/system/cpu/cpu1") followed by null
+// separated KEY=value strings.  Only cpu online and offline events are of interest.
 //
-bool get_time_in_state_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+static void hotplug_uevent(char *text, ssize_t len) {
+  char *action = NULL;
+  char *devpath = NULL;
+  char *subsystem = NULL;
+  char *p;
+  int cpu;
+
+  for (p = text; p < text + len; p += strlen(p) + 1) {
+    if (!strncmp(p, "ACTION=", 7)) action = p + 7;
+    else if (!strncmp(p, "DEVPATH=", 8)) devpath = p + 8;
+    else if (!strncmp(p, "SUBSYSTEM=", 10)) subsystem = p + 10;
+  }
 
-  int cpu = 0;
-  
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  if (!action || !devpath || !subsystem || strcmp(subsystem, "cpu")) return;
 
-  // Extract the governor argument from the message
-  json_t *param = json_find_first_label(object, "cpu");
-  if (param && ((param->child->type == JSON_STRING) || (param->child->type == JSON_NUMBER))) {
-    cpu = atoi(param->child->text);
-  }
+  p = strrchr(devpath, '/');
+  if (!p || (sscanf(p, "/cpu%d", &cpu) != 1) || (cpu < 0) || (cpu >= MAX_CPUS)) return;
 
-  if (cpu == 0) {
-    return simple_command(lshandle, message,
-			  "/bin/cat /sys/devices/system/cpu/cpu0/cpufreq/stats/time_in_state 2>&1");
+  if (!strcmp(action, "online")) {
+    hotplug_record(cpu, true);
   }
-  else if (is_cpu_online(1)) {
-    return simple_command(lshandle, message,
-			  "/bin/cat /sys/devices/system/cpu/cpu1/cpufreq/stats/time_in_state 2>&1");
+  else if (!strcmp(action, "offline")) {
+    hotplug_record(cpu, false);
   }
-  else {
-    if (!LSMessageReply(lshandle, message, "{\"returnValue\": false}", &lserror)) goto error;
+}
+
+static gboolean hotplug_receive(GIOChannel *channel, GIOCondition condition, gpointer data) {
+  char text[UEVENT_BUFFER_SIZE];
+  struct sockaddr_nl addr;
+  socklen_t addrlen;
+  ssize_t len;
+
+  int fd = g_io_channel_unix_get_fd(channel);
+
+  while (true) {
+    addrlen = sizeof addr;
+    len = recvfrom(fd, text, sizeof text - 1, MSG_DONTWAIT, (struct sockaddr *)&addr, &addrlen);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      // If the socket overflowed, we have lost events, so start again from sysfs.
+      if (errno == ENOBUFS) {
+	hotplug_seed();
+	continue;
+      }
+      break;
+    }
+    // Only believe messages from the kernel.
+    if (addr.nl_pid != 0) continue;
+    text[len] = '\0';
+    hotplug_uevent(text, len);
   }
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  return TRUE;
 }
 
-//
-// Read total_trans
-//
-bool get_total_trans_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message,
-			"/bin/cat /sys/devices/system/cpu/cpu0/cpufreq/stats/total_trans 2>&1");
+static gboolean hotplug_reseed_timer(gpointer data) {
+  hotplug_seed();
+  return TRUE;
 }
 
 //
-// Read trans_table
+// Start listening for uevents.  The bitmap is seeded after the socket is bound,
+// so no change can slip between the two.  If netlink is not available, the online
+// files are read as before.
 //
-bool get_trans_table_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message,
-			"/bin/cat /sys/devices/system/cpu/cpu0/cpufreq/stats/trans_table 2>&1");
+static void hotplug_init(void) {
+  struct sockaddr_nl addr;
+
+  int fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to listen for hotplug events: %s\n", strerror(errno));
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  memset(&addr, 0, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr)) {
+    fprintf(stderr, "Unable to listen for hotplug events: %s\n", strerror(errno));
+    close(fd);
+    return;
+  }
+
+  hotplug_seed();
+
+  // The watch holds its own reference to the channel.
+  GIOChannel *channel = g_io_channel_unix_new(fd);
+  g_io_add_watch(channel, G_IO_IN, hotplug_receive, NULL);
+  g_io_channel_unref(channel);
+
+  // In case an event is ever missed without the socket overflowing.
+  g_timeout_add_seconds(HOTPLUG_RESEED_INTERVAL, hotplug_reseed_timer, NULL);
+
+  hotplug_listening = true;
 }
 
 //
-// Read compcache configuration
+// Return the online state and number of transitions of each cpu, and the most recent
+// hotplug events, and optionally subscribe to each event as it happens.
 //
-bool get_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+bool get_hotplug_events_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
   LSError lserror;
   LSErrorInit(&lserror);
-  
-  char command[MAXLINLEN];
 
-  sprintf(buffer, "{\"returnValue\": true }");
-  
-  strcpy(run_command_buffer, "/lib/modules/");
-  if (!run_command("/bin/uname -r", false)) {
+  bool subscribed = false;
+  bool first = true;
+  unsigned long i;
+  int cpu;
+
+  if (!hotplug_listening) {
     if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to determine kernel version\"}",
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Hotplug events are not available\"}",
 			&lserror)) goto error;
     return true;
   }
-  sprintf(command, "/usr/bin/test -f %s/extra/ramzswap.ko", run_command_buffer);
-  strcpy(run_command_buffer, "");
-  if (!run_command(command, false)) {
-    sprintf(buffer, "{\"params\": [], \"returnValue\": true }");
+
+  if (LSMessageIsSubscription(message)) {
+    if (!LSSubscriptionAdd(lshandle, HOTPLUG_KEY, message, &lserror)) goto error;
+    subscribed = true;
+  }
+
+  reply_set(&buffer, "{\"online\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    reply_printf(&buffer, "%s%s", cpu ? ", " : "", is_cpu_online(cpu) ? "true" : "false");
   }
-  else {
-    strcpy(run_command_buffer, "");
-    if (run_command("/bin/grep MemLimit /proc/ramzswap 2>/dev/null | awk '{print $2}'", false) && run_command_buffer[0]) {
-      sprintf(buffer, "{\"params\": [{\"name\":\"compcache_enabled\", \"value\": \"1\", \"writeable\": true}, {\"name\": \"compcache_memlimit\", \"value\": \"%s\", \"writeable\": true}], \"returnValue\": true }", run_command_buffer);
-    }
-    else {
-      sprintf(buffer, "{\"params\": [{\"name\":\"compcache_enabled\", \"value\": \"0\", \"writeable\": true}, {\"name\": \"compcache_memlimit\", \"value\": \"16384\", \"writeable\": true}], \"returnValue\": true }");
-    }
+  reply_append(&buffer, "], \"transitions\": [");
+  for (cpu = 0; cpu < present_cpus(); cpu++) {
+    reply_printf(&buffer, "%s%lu", cpu ? ", " : "", hotplug_transitions[cpu]);
   }
+  reply_append(&buffer, "], \"events\": [");
+  i = (hotplug_event_count > HOTPLUG_EVENTS) ? hotplug_event_count - HOTPLUG_EVENTS : 0;
+  for (; i < hotplug_event_count; i++) {
+    append_hotplug_event(&buffer, &hotplug_events[i % HOTPLUG_EVENTS], &first);
+  }
+  reply_printf(&buffer, "], \"subscribed\": %s, \"returnValue\": true}", subscribed ? "true" : "false");
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  if (!LSMessageReply(lshandle, message, reply_text(&buffer), &lserror)) goto error;
 
   return true;
  error:
@@ -1387,6 +6440,38 @@ bool get_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *c
   return false;
 }
 
+static void get_compcache_config_work(request_t *req) {
+  char filename[MAXLINLEN];
+  compcache_stats_t stats;
+
+  char *release = kernel_release();
+  if (!release) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to determine kernel version\"}");
+    return;
+  }
+  sprintf(filename, "/lib/modules/%s/extra/ramzswap.ko", release);
+  if (access(filename, F_OK)) {
+    reply_set(&req->reply, "{\"params\": [], ");
+  }
+  else if (read_ramzswap(&stats) && stats.memLimit) {
+    reply_set(&req->reply, "{\"params\": [{\"name\":\"compcache_enabled\", \"value\": \"1\", \"writeable\": true}, {\"name\": \"compcache_memlimit\", \"value\": \"%llu\", \"writeable\": true}], ", stats.memLimit);
+  }
+  else {
+    reply_set(&req->reply, "{\"params\": [{\"name\":\"compcache_enabled\", \"value\": \"0\", \"writeable\": true}, {\"name\": \"compcache_memlimit\", \"value\": \"16384\", \"writeable\": true}], ");
+  }
+
+  // Report how well compcache is doing, if it is running.
+  append_compcache(&req->reply);
+  reply_append(&req->reply, "\"returnValue\": true }");
+}
+
+//
+// Read compcache configuration, and its statistics
+//
+bool get_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_compcache_config_work, NULL);
+}
+
 //
 // Write compcache configuration
 //
@@ -1395,11 +6480,10 @@ bool set_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *c
   LSErrorInit(&lserror);
 
   char directory[MAXLINLEN];
-  char command[MAXLINLEN];
 
-  sprintf(buffer, "{\"returnValue\": true }");
+  reply_set(&buffer, "{\"returnValue\": true }");
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = parse_payload(message);
   bool enable = false;
   char *memlimit = NULL;
 
@@ -1441,91 +6525,44 @@ bool set_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *c
     return true;
   }
 
-  strcpy(run_command_buffer, "/lib/modules/");
-  if (!run_command("/bin/uname -r", false)) {
+  char *release = kernel_release();
+  if (!release) {
     if (!LSMessageReply(lshandle, message,
 			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to determine kernel version\"}",
 			&lserror)) goto error;
     return true;
   }
-  strcpy(directory, run_command_buffer);
+  sprintf(directory, "/lib/modules/%s", release);
+
+  compcache_stats_t stats;
+  bool enabled = read_ramzswap(&stats) && stats.memLimit;
 
-  bool enabled = false;
-  strcpy(run_command_buffer, "");
-  if (run_command("/bin/grep MemLimit /proc/ramzswap 2>/dev/null | awk '{print $2}'", false) && run_command_buffer[0]) {
-    enabled = true;
+  // Only one reconfiguration may be in progress at a time.
+  job_t *job = job_busy() ? NULL : job_new(lshandle, message);
+  if (!job) {
+    if (!LSMessageReply(lshandle, message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Another command is already running\"}",
+			&lserror)) goto error;
+    return true;
   }
 
   if (!enabled && enable) {
-    strcpy(command, "/sbin/swapoff -a 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    sprintf(command, "/sbin/insmod %s/extra/xvmalloc.ko 2>&1", directory);
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    sprintf(command, "/sbin/insmod %s/extra/ramzswap.ko backing_swap=/dev/mapper/store-swap memlimit_kb=%s 2>&1", directory, memlimit);
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    sprintf(command, "/bin/sleep 3 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    strcpy(command, "/sbin/swapon /dev/ramzswap0 -p 0 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
+    job_command(job, "/sbin/swapoff -a");
+    job_command(job, "/sbin/insmod %s/extra/xvmalloc.ko", directory);
+    job_command(job, "/sbin/insmod %s/extra/ramzswap.ko backing_swap=/dev/mapper/store-swap memlimit_kb=%s",
+		directory, memlimit);
+    job_delay(job, 3000);
+    job_command(job, "/sbin/swapon /dev/ramzswap0 -p 0");
   }
   else if (enabled && !enable) {
-    strcpy(command, "/sbin/swapoff -a 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    strcpy(command, "/sbin/rmmod ramzswap 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    strcpy(command, "/sbin/rmmod xvmalloc 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command("/sbin/rmmod xvmalloc", true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
-    strcpy(command, "/sbin/swapon /dev/mapper/store-swap -p 0 2>&1");
-    strcpy(run_command_buffer, "{\"stdOut\": [");
-    if (!run_command(command, true)) {
-      strcat(run_command_buffer, "]");
-      if (!report_command_failure(lshandle, message, command, run_command_buffer+11, NULL)) goto error;
-      return true;
-    }
+    job_command(job, "/sbin/swapoff -a");
+    job_command(job, "/sbin/rmmod ramzswap");
+    job_command(job, "/sbin/rmmod xvmalloc");
+    job_command(job, "/sbin/swapon /dev/mapper/store-swap -p 0");
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  // The reply is sent by the job when the last step completes.
+  job_start(job);
 
   return true;
  error:
@@ -1535,22 +6572,10 @@ bool set_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *c
   return false;
 }
 
-//
-// Write upstart script to make compcache configuration "sticky"
-//
-bool stick_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
-
-  bool error = false;
-  char *governor = NULL;
-
-  sprintf(buffer, "{\"returnValue\": true }");
+static void stick_compcache_config_work(request_t *req) {
+  reply_t section = { 0 };
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = req->object;
 
   bool enable = false;
   char *memlimit = NULL;
@@ -1558,10 +6583,8 @@ bool stick_compcache_config_method(LSHandle* lshandle, LSMessage *message, void
   // Extract the compcacheConfig argument from the message
   json_t *compcacheConfig = json_find_first_label(object, "compcacheConfig");
   if (!compcacheConfig || (compcacheConfig->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing compcacheConfig array\"}",
-			&lserror)) goto error;
-    return true;
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing compcacheConfig array\"}");
+    return;
   }
 
   json_t *entry = compcacheConfig->child->child;
@@ -1587,360 +6610,146 @@ bool stick_compcache_config_method(LSHandle* lshandle, LSMessage *message, void
   }
 
   if (!memlimit) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing memlimit\"}",
-			&lserror)) goto error;
-    return true;
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing memlimit\"}");
+    return;
   }
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-compcache");
-
   if (!enable) {
-    (void)unlink(filename);
-    // fprintf(stderr, "Message is %s\n", buffer);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+    stick_section(req, "compcache", NULL);
+    return;
   }
 
-  error = false;
-  if (fputs("description \"Govnah CompCache Configuration\"\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("start on stopped finish\n", fp) < 0) error = true;
-  if (fputs("stop on runlevel [!2]\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("script\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevBootPanicked`\" = \"false\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevShutdownClean`\" = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m -n com.palm.system last_umount_clean`\"  = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
- 
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-  
-  if (fputs("swapoff -a\n", fp) < 0) error = true;
-  if (fputs("insmod /lib/modules/`uname -r`/extra/xvmalloc.ko\n", fp) < 0) error = true;
-  sprintf(line,
-	  "insmod /lib/modules/`uname -r`/extra/ramzswap.ko memlimit_kb=%s backing_swap=/dev/mapper/store-swap\n",
-	  memlimit);
-  if (fputs(line, fp) < 0) error = true;
-  if (fputs("sleep 3\n", fp) < 0) error = true;
-  if (fputs("swapon /dev/ramzswap0 -p 1\n", fp) < 0) error = true;
-
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("end script\n", fp) < 0) error = true;
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-  
-  if (fclose(fp)) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
+  reply_printf(&section, "{\"memlimit\": \"%s\"}", memlimit);
+  stick_section(req, "compcache", &section);
+}
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+//
+// Save compcache configuration in the boot config, to make it "sticky"
+//
+bool stick_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, stick_compcache_config_work, NULL);
+}
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+static void unstick_compcache_config_work(request_t *req) {
+  stick_section(req, "compcache", NULL);
 }
 
 //
-// Delete compcache config upstart script
+// Remove compcache config from the boot config
 //
 bool unstick_compcache_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char filename[MAXLINLEN];
-
-  sprintf(buffer, "{\"returnValue\": true }");
-
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-compcache");
-  (void)unlink(filename);
-
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  return queue_write_request(lshandle, message, unstick_compcache_config_work, NULL);
 }
 
 //
-// Read compcache_config file
+// Read the boot config file, which holds the sticky compcache config
 //
 bool get_compcache_file_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message,
-			"/bin/cat /var/palm/event.d/org.webosinternals.govnah-compcache 2>&1");
+  return simple_file(lshandle, message, BOOT_CONFIG);
 }
 
 //
 // Read /sys/block/mmcblk0/queue/scheduler
 //
 bool get_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /sys/block/mmcblk0/queue/scheduler 2>&1");
+  return cached_file(lshandle, message, "/sys/block/mmcblk0/queue/scheduler", 60);
 }
 
-//
-// Write /sys/block/mmcblk0/queue/scheduler
-//
-bool set_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char filename[MAXLINLEN];
+static void set_io_scheduler_work(request_t *req) {
   char errorText[MAXLINLEN];
+  bool skipped;
 
-  bool error = false;
-
-  sprintf(buffer, "{\"returnValue\": true }");
-
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = req->object;
 
   // Extract the value argument from the message
   json_t *value = json_find_first_label(object, "value");
-  if (!value || (value->child->type != JSON_STRING)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}",
-			&lserror)) goto error;
-    return true;
+  if (!value || (value->child->type != JSON_STRING) ||
+      (strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}");
+    return;
   }
 
-  sprintf(filename, "/sys/block/mmcblk0/queue/scheduler");
-
-  // fprintf(stderr, "Writing %s to %s\n", value->child->text, filename);
-
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    sprintf(errorText, "Unable to open %s", filename);
-    error = true;
-  }
-  else {
-    if (fputs(value->child->text, fp) < 0) {
-      sprintf(errorText, "Unable to write to %s", filename);
-      error = true;
-    }
-    if (fclose(fp)) {
-      sprintf(errorText, "Unable to close %s", filename);
-      error = true;
-    }
-  }
-      
-  if (error) {
-    sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    errorText);
+  if (!io_scheduler_available(value->child->text)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Io scheduler %s is not available\"}",
+	      value->child->text);
+    return;
   }
-  
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  if (!write_tunable("/sys/block/mmcblk0/queue/scheduler", value->child->text, errorText, &skipped)) {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+	      errorText);
+  }
 }
 
 //
-// Write upstart script to make cpufreq params "sticky"
+// Write /sys/block/mmcblk0/queue/scheduler
 //
-bool stick_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
-
-  bool error = false;
+bool set_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, set_io_scheduler_work, "/sys/block/mmcblk0/queue/scheduler");
+}
 
-  sprintf(buffer, "{\"returnValue\": true }");
+static void stick_io_scheduler_work(request_t *req) {
+  reply_t section = { 0 };
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = req->object;
 
   // Extract the value argument from the message
   json_t *value = json_find_first_label(object, "value");
-  if (!value || (value->child->type != JSON_STRING)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}",
-			&lserror)) goto error;
-    return true;
-  }
-
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-iosched");
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-
-  error = false;
-  if (fputs("description \"Govnah IO Scheduler Settings\"\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("start on stopped finish\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("script\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevBootPanicked`\" = \"false\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevShutdownClean`\" = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m -n com.palm.system last_umount_clean`\"  = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
- 
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-  
-  sprintf(filename, "/sys/block/mmcblk0/queue/scheduler");
-
-  // fprintf(stderr, "echo %s > %s\n", value->child->text, filename);
-  sprintf(line, "echo -n '%s' > %s\n", value->child->text, filename);
-
-  if (fputs(line, fp) < 0) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-      
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("end script\n", fp) < 0) error = true;
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-  
-  if (fclose(fp)) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  if (!value || (value->child->type != JSON_STRING) ||
+      (strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}");
+    return;
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  reply_printf(&section, "{\"value\": \"%s\"}", value->child->text);
+  stick_section(req, "iosched", &section);
 }
 
 //
-// Delete cpufreq params upstart script
+// Save the io scheduler in the boot config, to make it "sticky"
 //
-bool unstick_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char filename[MAXLINLEN];
-
-  sprintf(buffer, "{\"returnValue\": true }");
-
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-iosched");
-  (void)unlink(filename);
+bool stick_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, stick_io_scheduler_work, NULL);
+}
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+static void unstick_io_scheduler_work(request_t *req) {
+  stick_section(req, "iosched", NULL);
+}
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+//
+// Remove the io scheduler from the boot config
+//
+bool unstick_io_scheduler_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, unstick_io_scheduler_work, NULL);
 }
 
 //
 // Read /proc/sys/net/ipv4/tcp_available_congestion_control
 //
 bool get_tcp_available_congestion_control_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/sys/net/ipv4/tcp_available_congestion_control 2>&1");
+  return cached_file(lshandle, message, "/proc/sys/net/ipv4/tcp_available_congestion_control", 60);
 }
 
 //
 // Read /proc/sys/net/ipv4/tcp_congestion_control
 //
 bool get_tcp_congestion_control_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  return simple_command(lshandle, message, "/bin/cat /proc/sys/net/ipv4/tcp_congestion_control 2>&1");
+  return cached_file(lshandle, message, "/proc/sys/net/ipv4/tcp_congestion_control", 60);
 }
 
-//
-// Write /proc/sys/net/ipv4/tcp_congestion_control
-//
-bool set_tcp_congestion_control_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
+static void set_tcp_congestion_control_work(request_t *req) {
   char filename[MAXLINLEN];
   char errorText[MAXLINLEN];
 
   bool error = false;
 
-  sprintf(buffer, "{\"returnValue\": true }");
-
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = req->object;
 
   // Extract the genericParams argument from the message
   json_t *value = json_find_first_label(object, "value");
   if (!value || (value->child->type != JSON_STRING)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}",
-			&lserror)) goto error;
-    return true;
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}");
+    return;
   }
 
   sprintf(filename, "/proc/sys/net/ipv4/tcp_congestion_control");
@@ -1964,301 +6773,402 @@ bool set_tcp_congestion_control_method(LSHandle* lshandle, LSMessage *message, v
   }
       
   if (error) {
-    sprintf(buffer, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
 	    errorText);
   }
   
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
 }
 
 //
-// Write upstart script to make sysfs params "sticky"
+// Write /proc/sys/net/ipv4/tcp_congestion_control
 //
-bool stick_sysfs_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
-
-  bool error = false;
+bool set_tcp_congestion_control_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, set_tcp_congestion_control_work,
+			     "/proc/sys/net/ipv4/tcp_congestion_control");
+}
 
-  sprintf(buffer, "{\"returnValue\": true }");
+static void stick_sysfs_params_work(request_t *req) {
+  reply_t section = { 0 };
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = req->object;
 
   // Extract the sysfsParams argument from the message
   json_t *sysfsParams = json_find_first_label(object, "sysfsParams");
   if (!sysfsParams || (sysfsParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing sysfsParams array\"}",
-			&lserror)) goto error;
-    return true;
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing sysfsParams array\"}");
+    return;
   }
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-sysfs");
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  reply_append(&section, "{");
+  boot_config_params(&section, "sysfsParams", sysfsParams, ALLOWED_CHARS"/", ALLOWED_CHARS);
+  reply_append(&section, "}");
+  stick_section(req, "sysfs", &section);
+}
+
+//
+// Save sysfs params in the boot config, to make them "sticky"
+//
+bool stick_sysfs_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, stick_sysfs_params_work, NULL);
+}
+
+static void unstick_sysfs_params_work(request_t *req) {
+  stick_section(req, "sysfs", NULL);
+}
+
+//
+// Remove sysfs params from the boot config
+//
+bool unstick_sysfs_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, unstick_sysfs_params_work, NULL);
+}
+
+static void stick_sysctl_params_work(request_t *req) {
+  reply_t section = { 0 };
+
+  json_t *object = req->object;
+
+  // Extract the sysctlParams argument from the message
+  json_t *sysctlParams = json_find_first_label(object, "sysctlParams");
+  if (!sysctlParams || (sysctlParams->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing sysctlParams array\"}");
+    return;
   }
 
-  error = false;
-  if (fputs("description \"Govnah SysFS Settings\"\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("start on stopped finish\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("script\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevBootPanicked`\" = \"false\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevShutdownClean`\" = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m -n com.palm.system last_umount_clean`\"  = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
- 
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  // Names are relative to /proc/sys.
+  reply_append(&section, "{");
+  boot_config_params(&section, "sysctlParams", sysctlParams, ALLOWED_CHARS"/", ALLOWED_CHARS);
+  reply_append(&section, "}");
+  stick_section(req, "sysctl", &section);
+}
+
+//
+// Save sysctl params in the boot config, to make them "sticky"
+//
+bool stick_sysctl_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, stick_sysctl_params_work, NULL);
+}
+
+static void unstick_sysctl_params_work(request_t *req) {
+  stick_section(req, "sysctl", NULL);
+}
+
+//
+// Remove sysctl params from the boot config
+//
+bool unstick_sysctl_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_write_request(lshandle, message, unstick_sysctl_params_work, NULL);
+}
+
+//
+// Write each entry of a params array, whose names are files under directory,
+// skipping any which already hold the value.
+//
+static void boot_params_work(request_t *req, char *label, char *directory) {
+  char filename[MAXLINLEN];
+  char errorText[MAXLINLEN];
+  int writes = 0, skips = 0;
+  bool skipped;
+
+  json_t *params = json_find_first_label(req->object, label);
+  if (!params || (params->child->type != JSON_ARRAY)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing %s array\"}", label);
+    return;
   }
-  
-  json_t *entry = sysfsParams->child->child;
+
+  json_t *entry = params->child->child;
   while (entry) {
-    if (entry->type != JSON_OBJECT) goto loop;
+    if (entry->type != JSON_OBJECT) goto next;
     json_t *name = json_find_first_label(entry, "name");
     if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS"/") != strlen(name->child->text))) goto loop;
+	(strspn(name->child->text, ALLOWED_CHARS"/") != strlen(name->child->text))) goto next;
     json_t *value = json_find_first_label(entry, "value");
     if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) goto loop;
+	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) goto next;
 
-    fprintf(stderr, "echo %s > %s\n", value->child->text, name->child->text);
-    sprintf(line, "echo -n '%s' > %s\n", value->child->text, name->child->text);
-
-    if (fputs(line, fp) < 0) {
-      (void)fclose(fp);
-      (void)unlink(filename);
-      sprintf(buffer,
-	      "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	      filename);
-      if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-      return true;
+    snprintf(filename, MAXLINLEN, "%s%s", directory, name->child->text);
+    if (!write_tunable(filename, value->child->text, errorText, &skipped)) {
+      reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+		errorText);
+      return;
     }
-      
-  loop:
+    if (skipped) skips++;
+    else writes++;
+
+  next:
     entry = entry->next;
   }
 
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("end script\n", fp) < 0) error = true;
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  reply_set(&req->reply, "{\"writesPerformed\": %d, \"writesSkipped\": %d, \"returnValue\": true}", writes, skips);
+}
+
+static void boot_iosched_work(request_t *req) {
+  char errorText[MAXLINLEN];
+  bool skipped;
+
+  json_t *value = json_find_first_label(req->object, "value");
+  if (!value || (value->child->type != JSON_STRING) ||
+      (strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing value\"}");
+    return;
   }
-  
-  if (fclose(fp)) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+
+  if (!io_scheduler_available(value->child->text)) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Io scheduler %s is not available\"}",
+	      value->child->text);
+    return;
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  if (!write_tunable("/sys/block/mmcblk0/queue/scheduler", value->child->text, errorText, &skipped)) {
+    reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+	      errorText);
+    return;
+  }
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  reply_set(&req->reply, "{\"writesPerformed\": %d, \"writesSkipped\": %d, \"returnValue\": true}",
+	    skipped ? 0 : 1, skipped ? 1 : 0);
+}
+
+static void boot_sysfs_work(request_t *req) {
+  boot_params_work(req, "sysfsParams", "");
+}
+
+static void boot_sysctl_work(request_t *req) {
+  boot_params_work(req, "sysctlParams", "/proc/sys/");
 }
 
 //
-// Delete sysfs params upstart script
+// Run a command (arguments separated by single spaces) and wait for it, without a shell.
 //
-bool unstick_sysfs_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+static bool boot_command(char *errorText, const char *format, ...) {
+  char command[MAXLINLEN];
+  char *argv[JOB_MAX_ARGS];
+  int argc = 0;
+  int status;
+  va_list args;
 
-  char filename[MAXLINLEN];
+  va_start(args, format);
+  vsnprintf(command, MAXLINLEN, format, args);
+  va_end(args);
 
-  sprintf(buffer, "{\"returnValue\": true }");
+  fprintf(stderr, "Running %s\n", command);
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-sysfs");
-  (void)unlink(filename);
+  sprintf(errorText, "Unable to run command: %s", command);
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  char *arg = strtok(command, " ");
+  while (arg && (argc < JOB_MAX_ARGS - 1)) {
+    argv[argc++] = arg;
+    arg = strtok(NULL, " ");
+  }
+  argv[argc] = NULL;
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
-}
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (!pid) {
+    execv(argv[0], argv);
+    _exit(127);
+  }
 
-//
-// Write upstart script to make sysctl params "sticky"
-//
-bool stick_sysctl_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return false;
+  }
 
-  char directory[MAXLINLEN];
-  char filename[MAXLINLEN];
-  char line[MAXLINLEN];
+  return WIFEXITED(status) && !WEXITSTATUS(status);
+}
 
-  bool error = false;
+static void boot_compcache_work(request_t *req) {
+  char errorText[MAXLINLEN];
+  char directory[MAXLINLEN];
+  compcache_stats_t stats;
 
-  sprintf(buffer, "{\"returnValue\": true }");
+  json_t *memlimit = json_find_first_label(req->object, "memlimit");
+  if (!memlimit || (memlimit->child->type != JSON_STRING) ||
+      (strspn(memlimit->child->text, ALLOWED_CHARS) != strlen(memlimit->child->text))) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing memlimit\"}");
+    return;
+  }
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  // Nothing to do if compcache has already been set up, either as ramzswap or (on
+  // newer kernels) as zram, found the same way get_compcache_config finds it.
+  if (read_compcache(&stats)) return;
 
-  // Extract the sysctlParams argument from the message
-  json_t *sysctlParams = json_find_first_label(object, "sysctlParams");
-  if (!sysctlParams || (sysctlParams->child->type != JSON_ARRAY)) {
-    if (!LSMessageReply(lshandle, message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing sysctlParams array\"}",
-			&lserror)) goto error;
-    return true;
+  char *release = kernel_release();
+  if (!release) {
+    reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to determine kernel version\"}");
+    return;
   }
+  sprintf(directory, "/lib/modules/%s", release);
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-sysctl");
-  FILE *fp = fopen(filename, "w");
+  if (!boot_command(errorText, "/sbin/swapoff -a") ||
+      !boot_command(errorText, "/sbin/insmod %s/extra/xvmalloc.ko", directory) ||
+      !boot_command(errorText, "/sbin/insmod %s/extra/ramzswap.ko memlimit_kb=%s backing_swap=/dev/mapper/store-swap",
+		    directory, memlimit->child->text)) goto failed;
+
+  // Give the device time to appear.
+  sleep(3);
+
+  if (!boot_command(errorText, "/sbin/swapon /dev/ramzswap0 -p 1")) goto failed;
+  return;
+
+ failed:
+  reply_set(&req->reply, "{\"errorText\": \"%s\", \"returnValue\": false, \"errorCode\": -1 }",
+	    errorText);
+}
+
+//
+// At boot, the sections of the boot config are applied in this order: cpufreq first
+// (through apply_profile, so frequency limits are ordered safely and a failure puts
+// everything back), so the rest of the boot runs at the chosen speeds, and compcache
+// last, since moving swap over to it is slow.  Each section is handed to its work
+// function as a request, just as if it had come in as a message.
+//
+static struct {
+  char *name;
+  request_func work;
+} boot_sections[] = {
+  { "cpufreq",		apply_profile_work },
+  { "iosched",		boot_iosched_work },
+  { "sysfs",		boot_sysfs_work },
+  { "sysctl",		boot_sysctl_work },
+  { "compcache",	boot_compcache_work },
+  { 0, 0 }
+};
+
+//
+// Apply the boot config, for the --apply-boot-config option.  The outcome of each
+// section, and the time taken, are saved in the boot status file, where get_boot_config
+// can report them.  Returns false if any section failed.
+//
+bool apply_boot_config(void) {
+  char *texts[sizeof boot_sections / sizeof boot_sections[0]] = { 0 };
+  reply_t status = { 0 };
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  bool success = true;
+  int i;
+
+  gint64 start = g_get_monotonic_time();
+
+  FILE *fp = fopen(BOOT_CONFIG, "r");
   if (!fp) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+    fprintf(stderr, "No boot config in %s\n", BOOT_CONFIG);
     return true;
   }
-
-  error = false;
-  if (fputs("description \"Govnah SysCtl Settings\"\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("start on stopped finish\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("script\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevBootPanicked`\" = \"false\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m com.palm.properties.prevShutdownClean`\" = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("[ \"`/usr/bin/lunaprop -m -n com.palm.system last_umount_clean`\"  = \"true\" ] || exit 0\n", fp) < 0) error = true;
-  if (fputs("\n", fp) < 0) error = true;
- 
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+  while ((len = getline(&line, &size, fp)) > 0) {
+    if (line[len-1] == '\n') line[len-1] = '\0';
+    for (i = 0; boot_sections[i].name; i++) {
+      size_t n = strlen(boot_sections[i].name);
+      if (!strncmp(line, boot_sections[i].name, n) && (line[n] == ' ')) {
+	free(texts[i]);
+	texts[i] = strdup(line + n + 1);
+      }
+    }
   }
-  
-  json_t *entry = sysctlParams->child->child;
-  while (entry) {
-    if (entry->type != JSON_OBJECT) goto loop;
-    json_t *name = json_find_first_label(entry, "name");
-    if (!name || (name->child->type != JSON_STRING) ||
-	(strspn(name->child->text, ALLOWED_CHARS"/") != strlen(name->child->text))) goto loop;
-    json_t *value = json_find_first_label(entry, "value");
-    if (!value || (value->child->type != JSON_STRING) ||
-	(strspn(value->child->text, ALLOWED_CHARS) != strlen(value->child->text))) goto loop;
+  free(line);
+  fclose(fp);
 
-    // fprintf(stderr, "echo %s > %s/%s\n", value->child->text, directory, name->child->text);
-    sprintf(line, "echo -n '%s' > %s/%s\n", value->child->text, directory, name->child->text);
+  reply_append(&status, "{");
 
-    if (fputs(line, fp) < 0) {
-      (void)fclose(fp);
-      (void)unlink(filename);
-      sprintf(buffer,
-	      "{\"errorText\": \"Unable to open %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	      filename);
-      if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-      return true;
+  for (i = 0; boot_sections[i].name; i++) {
+    if (!texts[i]) continue;
+
+    request_t *req = request_new(NULL, NULL, boot_sections[i].work);
+    if (!req) {
+      success = false;
+      break;
     }
-      
-  loop:
-    entry = entry->next;
-  }
 
-  if (fputs("\n", fp) < 0) error = true;
-  if (fputs("end script\n", fp) < 0) error = true;
-  if (error) {
-    (void)fclose(fp);
-    (void)unlink(filename);
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to write to %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
-  }
-  
-  if (fclose(fp)) {
-    sprintf(buffer,
-	    "{\"errorText\": \"Unable to close %s\", \"returnValue\": false, \"errorCode\": -1 }",
-	    filename);
-    if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
-    return true;
+    req->object = json_arena_parse(&req->arena, texts[i]);
+    if (req->object) {
+      req->work(req);
+    }
+    else {
+      reply_set(&req->reply, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid %s section\"}",
+		boot_sections[i].name);
+    }
+
+    json_t *reply = json_arena_parse(&req->arena, reply_text(&req->reply));
+    json_t *returnValue = reply ? json_find_first_label(reply, "returnValue") : NULL;
+    if (!returnValue || (returnValue->child->type != JSON_TRUE)) {
+      fprintf(stderr, "Unable to apply %s: %s\n", boot_sections[i].name, reply_text(&req->reply));
+      success = false;
+    }
+
+    reply_printf(&status, "\"%s\": %s, ", boot_sections[i].name, reply_text(&req->reply));
+
+    reply_free(&req->reply);
+    arena_free(&req->arena);
+    free(req);
+    free(texts[i]);
+    texts[i] = NULL;
   }
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  for (i = 0; boot_sections[i].name; i++) free(texts[i]);
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+  gint64 elapsed = g_get_monotonic_time() - start;
+  fprintf(stderr, "Applied boot config in %d.%03d ms\n", (int)(elapsed / 1000), (int)(elapsed % 1000));
+
+  // The monotonic clock counts from boot, so this also says when we were run.
+  reply_printf(&status, "\"startedMs\": %lld, \"elapsedUs\": %lld, \"returnValue\": %s}",
+	       (long long)(start / 1000), (long long)elapsed, success ? "true" : "false");
+
+  fp = fopen(BOOT_STATUS, "w");
+  if (fp) {
+    fprintf(fp, "%s\n", reply_text(&status));
+    fclose(fp);
+  }
+  reply_free(&status);
+
+  return success;
 }
 
-//
-// Delete sysctl params upstart script
-//
-bool unstick_sysctl_params_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
+static void get_boot_config_work(request_t *req) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  bool first = true;
 
-  char filename[MAXLINLEN];
+  reply_set(&req->reply, "{\"config\": {");
+
+  pthread_mutex_lock(&boot_config_lock);
+  FILE *fp = fopen(BOOT_CONFIG, "r");
+  if (fp) {
+    while ((len = getline(&line, &size, fp)) > 0) {
+      if (line[len-1] == '\n') line[len-1] = '\0';
+      char *json = strchr(line, ' ');
+      if (!json) continue;
+      *json++ = '\0';
+      if ((strspn(line, ALLOWED_CHARS) != strlen(line)) || !json_arena_parse(&req->arena, json)) continue;
+      reply_printf(&req->reply, "%s\"%s\": %s", (first ? "" : ", "), line, json);
+      first = false;
+    }
+    fclose(fp);
+  }
+  pthread_mutex_unlock(&boot_config_lock);
 
-  sprintf(buffer, "{\"returnValue\": true }");
+  reply_append(&req->reply, "}");
 
-  sprintf(filename, "/var/palm/event.d/org.webosinternals.govnah-sysctl");
-  (void)unlink(filename);
+  fp = fopen(BOOT_STATUS, "r");
+  if (fp) {
+    if ((len = getline(&line, &size, fp)) > 0) {
+      if (line[len-1] == '\n') line[len-1] = '\0';
+      if (json_arena_parse(&req->arena, line)) {
+	reply_printf(&req->reply, ", \"lastBoot\": %s", line);
+      }
+    }
+    fclose(fp);
+  }
+  free(line);
 
-  // fprintf(stderr, "Message is %s\n", buffer);
-  if (!LSMessageReply(lshandle, message, buffer, &lserror)) goto error;
+  reply_append(&req->reply, ", \"returnValue\": true}");
+}
 
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
+//
+// Read the boot config, and the outcome of applying it at the last boot
+//
+bool get_boot_config_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return queue_request(lshandle, message, get_boot_config_work, NULL);
 }
 
 //
@@ -2285,7 +7195,7 @@ bool getProfiles_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
   LSError lserror;
   LSErrorInit(&lserror);
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = parse_payload(message);
 
   // Extract the params argument from the message
   json_t *id = json_find_first_label(object, "returnid");
@@ -2296,11 +7206,11 @@ bool getProfiles_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
     return true;
   }
 
-  sprintf(buffer, "{\"id\":\"org.webosinternals.govnah\",\"params\":{\"type\":\"get-profiles\",\"returnid\":\"%s\"}}",
+  reply_set(&buffer, "{\"id\":\"org.webosinternals.govnah\",\"params\":{\"type\":\"get-profiles\",\"returnid\":\"%s\"}}",
 	  id->child->text);
 
   LSMessageRef(message);
-  if (!LSCall(priv_serviceHandle, "palm://com.palm.applicationManager/launch", buffer,
+  if (!LSCall(priv_serviceHandle, "palm://com.palm.applicationManager/launch", reply_text(&buffer),
 	      getProfiles_handler, message, NULL, &lserror)) goto error;
 
   return true;
@@ -2335,7 +7245,7 @@ bool setProfile_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
   LSError lserror;
   LSErrorInit(&lserror);
 
-  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *object = parse_payload(message);
 
   // Extract the params argument from the message
   json_t *id = json_find_first_label(object, "profileid");
@@ -2346,11 +7256,11 @@ bool setProfile_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
     return true;
   }
 
-  sprintf(buffer, "{\"id\":\"org.webosinternals.govnah\",\"params\":{\"type\":\"set-profile\",\"profileid\":%s}}",
+  reply_set(&buffer, "{\"id\":\"org.webosinternals.govnah\",\"params\":{\"type\":\"set-profile\",\"profileid\":%s}}",
 	  id->child->text);
 
   LSMessageRef(message);
-  if (!LSCall(priv_serviceHandle, "palm://com.palm.applicationManager/launch", buffer,
+  if (!LSCall(priv_serviceHandle, "palm://com.palm.applicationManager/launch", reply_text(&buffer),
 	      getProfiles_handler, message, NULL, &lserror)) goto error;
 
   return true;
@@ -2361,8 +7271,36 @@ bool setProfile_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
   return false;
 }
 
+//
+// Report the response cache hit and miss counters.
+//
+bool get_cache_stats_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  int entries = 0;
+  int i;
+
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    if (cache_entries[i].key) entries++;
+  }
+
+  reply_set(&buffer, "{\"hits\": %lu, \"misses\": %lu, \"invalidations\": %lu, \"entries\": %d, \"returnValue\": true}",
+	    cache_hits, cache_misses, cache_invalidations, entries);
+
+  if (!LSMessageReply(lshandle, message, reply_text(&buffer), &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
 LSMethod luna_methods[] = {
   { "status",			dummy_method },
+  { "get_cache_stats",		get_cache_stats_method },
 
   { "getMachineName",		get_machine_name_method },
 
@@ -2379,7 +7317,9 @@ LSMethod luna_methods[] = {
   { "get_scaling_cur_freq",     get_scaling_cur_freq_method },
   { "get_scaling_governor",     get_scaling_governor_method },
   { "get_cpufreq_params",	get_cpufreq_params_method },
+  { "get_cpufreq_policies",	get_cpufreq_policies_method },
   { "set_cpufreq_params",	set_cpufreq_params_method },
+  { "apply_profile",		apply_profile_method },
   { "stick_cpufreq_params",	stick_cpufreq_params_method },
   { "unstick_cpufreq_params",	unstick_cpufreq_params_method },
   { "get_cpufreq_file",		get_cpufreq_file_method },
@@ -2387,6 +7327,17 @@ LSMethod luna_methods[] = {
   { "get_time_in_state",	get_time_in_state_method },
   { "get_total_trans",		get_total_trans_method },
   { "get_trans_table",		get_trans_table_method },
+  { "get_cpufreq_stats",	get_cpufreq_stats_method },
+
+  { "subscribe_telemetry",	subscribe_telemetry_method },
+  { "get_telemetry_snapshot",	get_telemetry_snapshot_method },
+  { "get_cpu_utilisation",	get_cpu_utilisation_method },
+  { "get_pressure",		get_pressure_method },
+  { "get_memory_stats",		get_memory_stats_method },
+  { "get_history",		get_history_method },
+
+  { "subscribe_sysfs_changes",	subscribe_sysfs_changes_method },
+  { "get_hotplug_events",	get_hotplug_events_method },
 
   { "get_compcache_config",	get_compcache_config_method },
   { "set_compcache_config",	set_compcache_config_method },
@@ -2408,6 +7359,7 @@ LSMethod luna_methods[] = {
 
   { "stick_sysctl_params",	stick_sysctl_params_method },
   { "unstick_sysctl_params",	unstick_sysctl_params_method },
+  { "get_boot_config",		get_boot_config_method },
 
   { "getProfiles",		getProfiles_method },
   { "setProfile",		setProfile_method },
@@ -2415,6 +7367,11 @@ LSMethod luna_methods[] = {
 };
 
 bool register_methods(LSPalmService *serviceHandle, LSError lserror) {
+  kernel_init();
+  topology_init();
+  request_init();
+  hotplug_init();
+  history_init();
   return LSPalmServiceRegisterCategory(serviceHandle, "/", luna_methods,
 				       NULL, NULL, NULL, &lserror);
 }
@@ -23,6 +23,9 @@
 
 bool register_methods(LSPalmService *serviceHandle, LSError lserror);
 
+// Apply the sticky settings at boot, without starting the service.
+bool apply_boot_config(void);
+
 // Twice the chunk size (so any character can be escaped), plus a terminating null.
 #define MAXBUFLEN 8193
 // Size of file chunks to pass back up to webOS.
@@ -32,6 +32,11 @@ bool luna_service_initialize(const char *dbusAddress) {
   LSError lserror;
   LSErrorInit(&lserror);
 
+#if !GLIB_CHECK_VERSION(2,32,0)
+  // The worker pool needs the threading system, which older glib does not start itself.
+  if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
   loop = g_main_loop_new(NULL, FALSE);
   if (loop==NULL)
     goto end;
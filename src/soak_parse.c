@@ -0,0 +1,95 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at
+ your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+//
+// Soak test for request payload parsing: make the given number of calls (default one
+// million), rotating through get_scaling_cur_freq, a telemetry snapshot,
+// set_cpufreq_params (with a payload it rejects) and get_cpufreq_params, and report
+// the resident set size and the heap in use at each quarter.  The memory should stay
+// flat.
+//
+// Each call goes through the same request_new, work function and request_done as a
+// real one, but directly on this thread (no luna bus, no worker threads).  The payload
+// is parsed into the request's arena, as request_new does for a message.  With "mjson"
+// as the second argument it is parsed with json_parse_document instead and never freed,
+// which is what the handlers used to do, for comparison.
+//
+// Build it with "make soak_parse" in src, and run it with
+// "./soak_parse [calls] [mjson]".
+//
+#include <malloc.h>
+
+#include "luna_methods.c"
+
+static struct {
+  request_func work;
+  char *payload;
+} soak_calls[] = {
+  { get_scaling_cur_freq_work,	"{\"cpu\": 0}" },
+  { telemetry_sample_work,	"{\"fields\": [\"loadavg\", \"temp\"]}" },
+  { set_cpufreq_params_work,	"{\"maxCpu\": 0, \"genericParams\": [{\"name\": \"bad name!\", \"value\": \"1\"}], "
+				"\"governorParams\": [], \"overrideParams\": []}" },
+  { get_cpufreq_params_work,	"{}" },
+};
+
+#define SOAK_CALLS (sizeof soak_calls / sizeof soak_calls[0])
+
+static long soak_rss(void) {
+  long size = 0, resident = 0;
+
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) return 0;
+  if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = 0;
+  fclose(fp);
+
+  return resident * (getpagesize() / 1024);
+}
+
+int main(int argc, char **argv) {
+  long calls = (argc > 1) ? atol(argv[1]) : 1000000;
+  bool mjson = (argc > 2) && !strcmp(argv[2], "mjson");
+  request_t *req;
+  long i;
+
+  if (calls < 4) calls = 4;
+
+  // The work functions log failures, and the writes they refuse.
+  if (!freopen("/dev/null", "w", stderr)) return 1;
+
+  printf("%ld calls, payloads parsed with %s:\n", calls, mjson ? "json_parse_document" : "json_arena_parse");
+  for (i = 0; i < calls; i++) {
+    int call = i % SOAK_CALLS;
+
+    if (!(req = request_new(NULL, NULL, soak_calls[call].work))) {
+      printf("Out of memory after %ld calls\n", i);
+      return 1;
+    }
+    if (mjson) req->object = json_parse_document(soak_calls[call].payload);
+    else req->object = json_arena_parse(&req->arena, soak_calls[call].payload);
+    req->fields = telemetry_fields(req->object);
+
+    req->work(req);
+    request_done(req);
+
+    if (!((i + 1) % (calls / 4))) {
+      printf("  %8ld calls  rss %6ld kB  heap in use %9d bytes\n", i + 1, soak_rss(), mallinfo().uordblks);
+    }
+  }
+
+  return 0;
+}